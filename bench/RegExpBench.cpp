@@ -0,0 +1,121 @@
+// Compares the regular expression engines indexing log lines, as zindex
+// --regex does. Lines are read from the file given (uncompressed), or made up
+// to look like a typical JSON event log and web server access log.
+//
+// Usage: regexp-bench [file [regex...]]
+
+#include "IndexSink.h"
+#include "RegExp.h"
+#include "RegExpIndexer.h"
+#include "StringView.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<std::string> makeLines(size_t numLines) {
+    static const char *actions[] = {"login", "logout", "purchase", "refund",
+                                    "view", "search"};
+    static const char *paths[] = {"/", "/index.html", "/api/v2/orders",
+                                  "/static/app.js", "/search?q=zindex"};
+    std::mt19937 random(1234);
+    std::vector<std::string> lines;
+    char line[512];
+    for (size_t i = 0; i < numLines; ++i) {
+        auto id = static_cast<unsigned>(random() % 100000000);
+        if (i % 2) {
+            snprintf(line, sizeof(line),
+                     "{\"timestamp\":\"2015-03-%02u %02u:%02u:%02u.%03u\","
+                     "\"eventId\":%u,\"action\":\"%s\",\"user\":"
+                     "\"user%u@example.com\",\"orderId\":{\"id\":%u},"
+                     "\"amount\":%u.%02u}",
+                     1 + id % 28, id % 24, id % 60, id / 60 % 60, id % 1000,
+                     static_cast<unsigned>(i),
+                     actions[id % (sizeof(actions) / sizeof(*actions))],
+                     id % 5000, id, id % 1000, id % 100);
+        } else {
+            snprintf(line, sizeof(line),
+                     "10.%u.%u.%u - - [10/Mar/2015:%02u:%02u:%02u +0000] "
+                     "\"GET %s HTTP/1.1\" %u %u \"-\" \"Mozilla/5.0 (X11; "
+                     "Linux x86_64) AppleWebKit/537.36\"",
+                     id % 256, id / 256 % 256, id / 65536 % 256, id % 24,
+                     id % 60, id / 60 % 60,
+                     paths[id % (sizeof(paths) / sizeof(*paths))],
+                     id % 7 ? 200 : 404, id % 50000);
+        }
+        lines.emplace_back(line);
+    }
+    return lines;
+}
+
+struct CountingSink : IndexSink {
+    size_t numKeys = 0;
+    size_t checksum = 0;
+
+    void add(const char *index, size_t indexLength, size_t offset) override {
+        ++numKeys;
+        checksum = checksum * 31 + offset;
+        for (size_t i = 0; i < indexLength; ++i)
+            checksum = checksum * 31 + index[i];
+    }
+};
+
+const char *engineName(RegExp::Engine engine) {
+    return engine == RegExp::Engine::Dfa ? "dfa" : "posix";
+}
+
+}
+
+int main(int argc, const char *argv[]) {
+    std::vector<std::string> lines;
+    if (argc > 1) {
+        std::ifstream in(argv[1]);
+        if (!in) {
+            std::cerr << "Unable to open " << argv[1] << std::endl;
+            return 1;
+        }
+        for (std::string line; std::getline(in, line);)
+            lines.push_back(line);
+    } else {
+        lines = makeLines(500000);
+    }
+    std::vector<std::string> regexes;
+    for (int i = 2; i < argc; ++i) regexes.push_back(argv[i]);
+    if (regexes.empty()) {
+        regexes = {"\"eventId\":([0-9]+)",
+                   "^[0-9.]+ - - \\[([^]]+)\\]",
+                   "\"GET ([^ \"]+)",
+                   "user[0-9]+@example\\.com",
+                   "\"action\":\"(login|logout)\""};
+    }
+    size_t totalBytes = 0;
+    for (auto &line : lines) totalBytes += line.size() + 1;
+    std::cout << lines.size() << " lines, " << totalBytes << " bytes"
+              << std::endl;
+
+    for (auto &regex : regexes) {
+        std::cout << regex << std::endl;
+        size_t checksums[2];
+        for (auto engine : {RegExp::Engine::Posix, RegExp::Engine::Dfa}) {
+            RegExpIndexer indexer(regex, engine);
+            CountingSink sink;
+            auto start = std::chrono::steady_clock::now();
+            for (auto &line : lines) indexer.index(sink, StringView(line));
+            std::chrono::duration<double> seconds =
+                    std::chrono::steady_clock::now() - start;
+            checksums[engine == RegExp::Engine::Dfa] = sink.checksum;
+            printf("  %-5s %8.3fs %9.1f MB/s %10zu keys\n",
+                   engineName(indexer.engine()), seconds.count(),
+                   totalBytes / seconds.count() / 1e6, sink.numKeys);
+        }
+        if (checksums[0] != checksums[1])
+            std::cout << "  (the engines found different keys)" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,800 @@
+#include "Codec.h"
+
+#include "RandomAccessFile.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef ZINDEX_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ZINDEX_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef ZINDEX_HAVE_XZ
+#include <lzma.h>
+#endif
+
+#if defined(ZINDEX_HAVE_ZSTD) || defined(ZINDEX_HAVE_BZIP2) \
+    || defined(ZINDEX_HAVE_XZ)
+#define ZINDEX_HAVE_CODECS
+#endif
+
+namespace {
+
+constexpr auto SkipBufferSize = 32768u;
+constexpr auto ReadAhead = 256 * 1024u;
+constexpr uint32_t ZstdMagic = 0xfd2fb528;
+constexpr uint32_t SkippableMagic = 0x184d2a50; // to 0x184d2a5f
+constexpr uint32_t SeekTableMagic = 0x184d2a5e;
+constexpr uint32_t SeekableMagic = 0x8f92eab1;
+constexpr auto SkippableHeaderSize = 8u;
+constexpr auto SeekTableFooterSize = 9u;
+constexpr uint8_t XzMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0};
+// bzip2's block and end of stream markers (the digits of pi and sqrt(pi)),
+// each 48 bits long.
+constexpr uint64_t Bzip2BlockMagic = 0x314159265359;
+constexpr uint64_t Bzip2EndMagic = 0x177245385090;
+constexpr uint64_t Bzip2MagicMask = (1ull << 48) - 1;
+constexpr auto Bzip2MagicBits = 48u;
+constexpr auto Bzip2CrcBits = 32u;
+// No compressed block is bigger (900k symbols at 9 bits or so each), so no
+// block's end is looked for further on.
+constexpr uint64_t Bzip2MaxBlockBits = 2 * 1024 * 1024 * 8ull;
+
+uint32_t readLe32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16)
+           | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+#ifdef ZINDEX_HAVE_CODECS
+
+// Points data at exactly length bytes at offset (read into buffer if need
+// be), or throws.
+void readExactly(const RandomAccessFile &file, uint64_t offset, size_t length,
+                 uint8_t *buffer, const uint8_t *&data) {
+    if (file.read(offset, length, buffer, data) != length)
+        throw std::runtime_error("Unexpected end of compressed file");
+}
+
+// Reads the file a piece at a time from some offset on, for streaming
+// decompressors: in place if it's mapped, otherwise into a buffer.
+class FileInput {
+    const RandomAccessFile &file_;
+    uint64_t position_;
+    uint64_t end_;
+    std::vector<uint8_t> buffer_;
+
+public:
+    FileInput(const RandomAccessFile &file, uint64_t begin, uint64_t end)
+            : file_(file), position_(begin), end_(end) {
+        if (!file.mapped()) buffer_.resize(ReadAhead);
+        file_.willNeed(position_, ReadAhead);
+    }
+
+    // The next piece of the file, or none at the end.
+    size_t next(const uint8_t *&data) {
+        auto length = std::min<uint64_t>(ReadAhead, end_ - position_);
+        if (length == 0) return 0;
+        if (file_.mapped()) file_.willNeed(position_ + length, ReadAhead);
+        auto numRead = file_.read(position_, length, buffer_.data(), data);
+        position_ += numRead;
+        return numRead;
+    }
+
+    size_t memoryUsed() const { return buffer_.capacity(); }
+};
+
+#endif
+
+#ifdef ZINDEX_HAVE_ZSTD
+
+void zstdCheck(size_t result) {
+    if (ZSTD_isError(result))
+        throw std::runtime_error(std::string("Error from zstd : ")
+                                 + ZSTD_getErrorName(result));
+}
+
+class ZstdDecompressor : public Decompressor {
+    FileInput input_;
+    ZSTD_DStream *stream_;
+    ZSTD_inBuffer in_;
+    bool endOfInput_;
+    // From the last call that got anywhere: zero once a frame's complete.
+    size_t lastResult_;
+
+public:
+    ZstdDecompressor(const RandomAccessFile &file, uint64_t begin,
+                     uint64_t end)
+            : input_(file, begin, end), stream_(ZSTD_createDStream()),
+              in_{nullptr, 0, 0}, endOfInput_(false), lastResult_(0) {
+        if (!stream_) throw std::bad_alloc();
+        zstdCheck(ZSTD_initDStream(stream_));
+    }
+
+    ~ZstdDecompressor() override { ZSTD_freeDStream(stream_); }
+
+    ZstdDecompressor(const ZstdDecompressor &) = delete;
+    ZstdDecompressor &operator=(const ZstdDecompressor &) = delete;
+
+    size_t read(uint8_t *out, size_t length) override {
+        ZSTD_outBuffer outBuffer{out, length, 0};
+        while (outBuffer.pos < outBuffer.size) {
+            if (in_.pos == in_.size && !endOfInput_) {
+                const uint8_t *data;
+                auto numRead = input_.next(data);
+                endOfInput_ = numRead == 0;
+                in_ = ZSTD_inBuffer{data, numRead, 0};
+            }
+            auto outBefore = outBuffer.pos;
+            auto inBefore = in_.pos;
+            auto result = ZSTD_decompressStream(stream_, &outBuffer, &in_);
+            zstdCheck(result);
+            if (outBuffer.pos != outBefore || in_.pos != inBefore) {
+                lastResult_ = result;
+            } else if (endOfInput_) {
+                if (lastResult_ != 0)
+                    throw std::runtime_error("Truncated zstd frame");
+                break;
+            }
+        }
+        return outBuffer.pos;
+    }
+
+    size_t memoryUsed() const override {
+        return sizeof(*this) + input_.memoryUsed()
+               + ZSTD_sizeof_DStream(stream_);
+    }
+};
+
+// As written by zstd's seekable format: a table of each frame's size, in a
+// skippable frame at the end of the file.
+std::vector<Frame> seekTableFrames(const RandomAccessFile &file) {
+    auto size = file.size();
+    if (size < SkippableHeaderSize + SeekTableFooterSize) return {};
+    uint8_t footerBuffer[SeekTableFooterSize];
+    const uint8_t *footer;
+    readExactly(file, size - SeekTableFooterSize, SeekTableFooterSize,
+                footerBuffer, footer);
+    if (readLe32(footer + 5) != SeekableMagic) return {};
+    uint64_t numFrames = readLe32(footer);
+    auto descriptor = footer[4];
+    if (descriptor & 0x7c) return {};
+    uint64_t entrySize = descriptor & 0x80 ? 12 : 8;
+    auto tableSize = SkippableHeaderSize + numFrames * entrySize
+                     + SeekTableFooterSize;
+    if (tableSize > size) return {};
+    std::vector<uint8_t> tableBuffer(tableSize);
+    const uint8_t *table;
+    readExactly(file, size - tableSize, tableSize, &tableBuffer[0], table);
+    if (readLe32(table) != SeekTableMagic
+        || readLe32(table + 4) != tableSize - SkippableHeaderSize)
+        return {};
+    std::vector<Frame> frames;
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < numFrames; ++i) {
+        auto entry = table + SkippableHeaderSize + i * entrySize;
+        Frame frame{offset, readLe32(entry), 0};
+        offset += frame.size;
+        if (frame.size) frames.push_back(frame);
+    }
+    if (offset != size - tableSize) return {};
+    return frames;
+}
+
+class ZstdCodec : public Codec {
+public:
+    std::string name() const override { return "zstd"; }
+
+    std::vector<Frame> findFrames(
+            const RandomAccessFile &file) const override {
+        auto frames = seekTableFrames(file);
+        if (!frames.empty()) return frames;
+        // Otherwise walk the frames' block headers.
+        for (uint64_t offset = 0; offset < file.size();) {
+            uint8_t headerBuffer[SkippableHeaderSize];
+            const uint8_t *header;
+            readExactly(file, offset, SkippableHeaderSize, headerBuffer,
+                        header);
+            auto magic = readLe32(header);
+            if ((magic & 0xfffffff0) == SkippableMagic) {
+                offset += SkippableHeaderSize + readLe32(header + 4);
+                continue;
+            }
+            if (magic != ZstdMagic)
+                throw std::runtime_error(
+                        "No zstd frame at offset " + std::to_string(offset));
+            auto descriptor = header[4];
+            auto contentSizeFlag = descriptor >> 6;
+            bool singleSegment = descriptor & 0x20;
+            bool checksum = descriptor & 0x04;
+            const unsigned dictionaryIdSizes[] = {0, 1, 2, 4};
+            auto position = offset + 5 + (singleSegment ? 0 : 1)
+                            + dictionaryIdSizes[descriptor & 3]
+                            + (contentSizeFlag ? 1u << contentSizeFlag
+                                               : singleSegment ? 1 : 0);
+            for (bool last = false; !last;) {
+                uint8_t blockBuffer[3];
+                const uint8_t *block;
+                readExactly(file, position, 3, blockBuffer, block);
+                auto blockHeader = block[0] | (block[1] << 8)
+                                   | (block[2] << 16);
+                last = blockHeader & 1;
+                auto type = (blockHeader >> 1) & 3;
+                if (type == 3)
+                    throw std::runtime_error("Invalid zstd block type");
+                // RLE blocks hold just the one byte.
+                position += 3 + (type == 1 ? 1 : blockHeader >> 3);
+            }
+            if (checksum) position += 4;
+            if (position > file.size())
+                throw std::runtime_error("Truncated zstd frame");
+            frames.push_back(Frame{offset, position - offset, 0});
+            offset = position;
+        }
+        return frames;
+    }
+
+    void decompressFrame(const RandomAccessFile &file, const Frame &frame,
+                         std::vector<uint8_t> &out) const override {
+        ZstdDecompressor decompressor(file, frame.offset,
+                                      frame.offset + frame.size);
+        auto start = out.size();
+        for (;;) {
+            auto oldSize = out.size();
+            auto toRead = std::max<size_t>(oldSize - start, ReadAhead);
+            out.resize(oldSize + toRead);
+            auto numRead = decompressor.read(&out[oldSize], toRead);
+            out.resize(oldSize + numRead);
+            if (numRead < toRead) break;
+        }
+    }
+
+    std::unique_ptr<Decompressor> decompressorAt(
+            const RandomAccessFile &file, uint64_t offset,
+            unsigned) const override {
+        return std::unique_ptr<Decompressor>(
+                new ZstdDecompressor(file, offset, file.size()));
+    }
+};
+
+#endif
+
+#ifdef ZINDEX_HAVE_BZIP2
+
+// bzip2 blocks start wherever the previous one ended, not on byte
+// boundaries, and the file has no table of them, so they're found by
+// scanning for the marker at the start of each. A block's data could happen
+// to hold a marker too. Decompressing the block up to there then fails (its
+// CRC check, if nothing else), so the marker is taken as data, and the block
+// tried up to the next one. The frame found at such a marker holds nothing.
+struct Bzip2Marker {
+    uint64_t bit;
+    // Otherwise the end of a stream, after which another may follow.
+    bool block;
+};
+
+// The first marker starting at or after fromBit, or if there's none the end
+// of the file (as if a stream ended there).
+Bzip2Marker nextBzip2Marker(const RandomAccessFile &file, uint64_t fromBit) {
+    std::vector<uint8_t> buffer(file.mapped() ? 0 : ReadAhead);
+    uint64_t window = 0;
+    for (auto byte = fromBit / 8; byte < file.size();) {
+        const uint8_t *data;
+        auto numRead = file.read(byte, ReadAhead, buffer.data(), data);
+        for (size_t i = 0; i < numRead; ++i) {
+            window = (window << 8) | data[i];
+            // Earliest first: with the most bits of this byte following.
+            for (int shift = 7; shift >= 0; --shift) {
+                auto bits = (window >> shift) & Bzip2MagicMask;
+                if (bits != Bzip2BlockMagic && bits != Bzip2EndMagic)
+                    continue;
+                auto start = (byte + i + 1) * 8 - shift - Bzip2MagicBits;
+                if (start >= fromBit)
+                    return Bzip2Marker{start, bits == Bzip2BlockMagic};
+            }
+        }
+        byte += numRead;
+    }
+    return Bzip2Marker{file.size() * 8, false};
+}
+
+// Big-endian bits, as bzip2 writes them.
+class BitWriter {
+    std::vector<uint8_t> &out_;
+    uint64_t bits_ = 0;
+    unsigned numBits_ = 0;
+
+public:
+    explicit BitWriter(std::vector<uint8_t> &out) : out_(out) { }
+
+    // Up to 56 bits.
+    void put(uint64_t bits, unsigned count) {
+        bits_ = (bits_ << count) | (bits & ((1ull << count) - 1));
+        numBits_ += count;
+        while (numBits_ >= 8) {
+            numBits_ -= 8;
+            out_.push_back((bits_ >> numBits_) & 0xff);
+        }
+    }
+
+    // Pads the last byte with zeros.
+    void flush() {
+        if (numBits_) put(0, 8 - numBits_);
+    }
+};
+
+void bzip2Check(int result) {
+    if (result != BZ_OK && result != BZ_STREAM_END)
+        throw std::runtime_error("Error from bzip2 : "
+                                 + std::to_string(result));
+}
+
+// Appends the data of the block in [startBit, endBit) to out. libbz2 can only
+// decompress whole streams, so it's given a stream of just this block: with
+// a header allowing the largest blocks, and an end of stream marker followed
+// by the stream's CRC, which for a single block is the block's own.
+void decompressBzip2Block(const RandomAccessFile &file, uint64_t startBit,
+                          uint64_t endBit, std::vector<uint8_t> &out) {
+    auto firstByte = startBit / 8;
+    auto numBytes = (endBit + 7) / 8 - firstByte;
+    std::vector<uint8_t> buffer(file.mapped() ? 0 : numBytes);
+    const uint8_t *data;
+    readExactly(file, firstByte, numBytes, buffer.data(), data);
+    auto bitAt = [&](uint64_t bit) {
+        bit -= firstByte * 8;
+        return (data[bit / 8] >> (7 - bit % 8)) & 1;
+    };
+    std::vector<uint8_t> stream;
+    stream.reserve(numBytes + 32);
+    BitWriter writer(stream);
+    for (auto c : {'B', 'Z', 'h', '9'}) writer.put(c, 8);
+    uint64_t bit = startBit;
+    // A bit at a time up to a byte boundary in the file, then bytes.
+    for (; bit < endBit && bit % 8; ++bit) writer.put(bitAt(bit), 1);
+    for (; bit + 8 <= endBit; bit += 8) writer.put(data[bit / 8 - firstByte], 8);
+    for (; bit < endBit; ++bit) writer.put(bitAt(bit), 1);
+    uint32_t crc = 0;
+    for (unsigned i = 0; i < Bzip2CrcBits; ++i)
+        crc = (crc << 1) | bitAt(startBit + Bzip2MagicBits + i);
+    writer.put(Bzip2EndMagic, Bzip2MagicBits);
+    writer.put(crc, Bzip2CrcBits);
+    writer.flush();
+
+    bz_stream bz;
+    bz.bzalloc = nullptr;
+    bz.bzfree = nullptr;
+    bz.opaque = nullptr;
+    bzip2Check(BZ2_bzDecompressInit(&bz, 0, 0));
+    bz.next_in = reinterpret_cast<char *>(stream.data());
+    bz.avail_in = stream.size();
+    auto start = out.size();
+    try {
+        for (;;) {
+            auto oldSize = out.size();
+            auto toRead = std::max<size_t>(oldSize - start, ReadAhead);
+            out.resize(oldSize + toRead);
+            bz.next_out = reinterpret_cast<char *>(&out[oldSize]);
+            bz.avail_out = toRead;
+            auto result = BZ2_bzDecompress(&bz);
+            bzip2Check(result);
+            out.resize(oldSize + toRead - bz.avail_out);
+            if (result == BZ_STREAM_END) break;
+            if (bz.avail_out)
+                throw std::runtime_error("Truncated bzip2 block");
+        }
+    } catch (...) {
+        BZ2_bzDecompressEnd(&bz);
+        throw;
+    }
+    BZ2_bzDecompressEnd(&bz);
+}
+
+// Appends the data of the block starting at startBit to out, returning the
+// marker after it. That's the next marker unless decompressing up to there
+// fails, when it's the first after that which works. Throws the first
+// failure if none does.
+Bzip2Marker decompressBzip2BlockAt(const RandomAccessFile &file,
+                                   uint64_t startBit,
+                                   std::vector<uint8_t> &out) {
+    auto size = out.size();
+    auto end = nextBzip2Marker(file, startBit + Bzip2MagicBits);
+    std::exception_ptr firstError;
+    for (;;) {
+        try {
+            decompressBzip2Block(file, startBit, end.bit, out);
+            return end;
+        } catch (const std::runtime_error &) {
+            if (!firstError) firstError = std::current_exception();
+            out.resize(size);
+        }
+        if (end.bit >= file.size() * 8
+            || end.bit - startBit > Bzip2MaxBlockBits)
+            std::rethrow_exception(firstError);
+        end = nextBzip2Marker(file, end.bit + 1);
+    }
+}
+
+// Whether the marker at bit is data in some earlier block, rather than the
+// start of a block. The block it's in would start at the last marker before
+// it that decompresses.
+bool insideBzip2Block(const RandomAccessFile &file, uint64_t bit) {
+    std::vector<uint64_t> before;
+    auto marker = nextBzip2Marker(
+            file, bit > Bzip2MaxBlockBits ? bit - Bzip2MaxBlockBits : 0);
+    for (; marker.bit < bit; marker = nextBzip2Marker(file, marker.bit + 1))
+        if (marker.block) before.push_back(marker.bit);
+    std::vector<uint8_t> scratch;
+    for (auto start = before.rbegin(); start != before.rend(); ++start) {
+        try {
+            scratch.clear();
+            return decompressBzip2BlockAt(file, *start, scratch).bit > bit;
+        } catch (const std::runtime_error &) {
+        }
+    }
+    return false;
+}
+
+// A block at a time, skipping over the ends of streams.
+class Bzip2Decompressor : public Decompressor {
+    const RandomAccessFile &file_;
+    Bzip2Marker next_;
+    std::vector<uint8_t> block_;
+    size_t position_ = 0;
+
+public:
+    Bzip2Decompressor(const RandomAccessFile &file, uint64_t startBit)
+            : file_(file), next_{startBit, true} { }
+
+    size_t read(uint8_t *out, size_t length) override {
+        size_t numRead = 0;
+        while (numRead < length) {
+            if (position_ == block_.size()) {
+                while (!next_.block && next_.bit < file_.size() * 8)
+                    next_ = nextBzip2Marker(
+                            file_, next_.bit + Bzip2MagicBits + Bzip2CrcBits);
+                if (!next_.block) break;
+                block_.clear();
+                position_ = 0;
+                next_ = decompressBzip2BlockAt(file_, next_.bit, block_);
+            }
+            auto toCopy = std::min(length - numRead,
+                                   block_.size() - position_);
+            std::copy_n(&block_[position_], toCopy, out + numRead);
+            position_ += toCopy;
+            numRead += toCopy;
+        }
+        return numRead;
+    }
+
+    // Each block's decompressed whole, with libbz2's state freed after.
+    size_t memoryUsed() const override {
+        return sizeof(*this) + block_.capacity();
+    }
+};
+
+class Bzip2Codec : public Codec {
+public:
+    std::string name() const override { return "bzip2"; }
+
+    std::vector<Frame> findFrames(
+            const RandomAccessFile &file) const override {
+        std::vector<Frame> frames;
+        auto marker = nextBzip2Marker(file, 0);
+        while (marker.bit < file.size() * 8) {
+            if (!marker.block) {
+                marker = nextBzip2Marker(
+                        file, marker.bit + Bzip2MagicBits + Bzip2CrcBits);
+                continue;
+            }
+            auto end = nextBzip2Marker(file, marker.bit + Bzip2MagicBits);
+            auto offset = marker.bit / 8;
+            frames.push_back(Frame{offset, (end.bit + 7) / 8 - offset,
+                                   static_cast<unsigned>(marker.bit % 8)});
+            marker = end;
+        }
+        return frames;
+    }
+
+    void decompressFrame(const RandomAccessFile &file, const Frame &frame,
+                         std::vector<uint8_t> &out) const override {
+        auto startBit = frame.offset * 8 + frame.bitOffset;
+        try {
+            decompressBzip2BlockAt(file, startBit, out);
+        } catch (const std::runtime_error &) {
+            // Found at a marker in the data of the block before, which has
+            // all the data.
+            if (!insideBzip2Block(file, startBit)) throw;
+        }
+    }
+
+    std::unique_ptr<Decompressor> decompressorAt(
+            const RandomAccessFile &file, uint64_t offset,
+            unsigned bitOffset) const override {
+        return std::unique_ptr<Decompressor>(
+                new Bzip2Decompressor(file, offset * 8 + bitOffset));
+    }
+};
+
+#endif
+
+#ifdef ZINDEX_HAVE_XZ
+
+void xzCheck(lzma_ret result) {
+    if (result != LZMA_OK && result != LZMA_STREAM_END)
+        throw std::runtime_error("Error from xz : " + std::to_string(result));
+}
+
+struct XzBlock {
+    Frame frame;
+    // The kind of check the block ends with, from its stream's header.
+    lzma_check check;
+};
+
+// The blocks of an xz file, from the index at the end of each of its streams
+// (of which there may be several, with padding between).
+std::vector<XzBlock> findXzBlocks(const RandomAccessFile &file) {
+    std::vector<XzBlock> blocks;
+    auto end = file.size();
+    while (end > 0) {
+        uint8_t footerBuffer[LZMA_STREAM_HEADER_SIZE];
+        const uint8_t *footer;
+        if (end < 2 * LZMA_STREAM_HEADER_SIZE)
+            throw std::runtime_error("Truncated xz file");
+        readExactly(file, end - 4, 4, footerBuffer, footer);
+        if (readLe32(footer) == 0) {
+            end -= 4; // stream padding
+            continue;
+        }
+        readExactly(file, end - LZMA_STREAM_HEADER_SIZE,
+                    LZMA_STREAM_HEADER_SIZE, footerBuffer, footer);
+        lzma_stream_flags flags;
+        xzCheck(lzma_stream_footer_decode(&flags, footer));
+        auto indexEnd = end - LZMA_STREAM_HEADER_SIZE;
+        if (flags.backward_size > indexEnd)
+            throw std::runtime_error("Invalid xz index");
+        std::vector<uint8_t> indexBuffer(flags.backward_size);
+        const uint8_t *indexData;
+        readExactly(file, indexEnd - flags.backward_size, flags.backward_size,
+                    indexBuffer.data(), indexData);
+        lzma_index *index = nullptr;
+        uint64_t memoryLimit = UINT64_MAX;
+        size_t position = 0;
+        xzCheck(lzma_index_buffer_decode(&index, &memoryLimit, nullptr,
+                                         indexData, &position,
+                                         flags.backward_size));
+        auto streamSize = lzma_index_stream_size(index);
+        std::vector<XzBlock> streamBlocks;
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+            streamBlocks.push_back(XzBlock{
+                    Frame{iter.block.compressed_stream_offset,
+                          iter.block.total_size, 0},
+                    flags.check});
+        }
+        lzma_index_end(index, nullptr);
+        if (streamSize > end)
+            throw std::runtime_error("Invalid xz index");
+        end -= streamSize;
+        for (auto &block : streamBlocks) block.frame.offset += end;
+        blocks.insert(blocks.begin(), streamBlocks.begin(),
+                      streamBlocks.end());
+    }
+    return blocks;
+}
+
+// Decompresses the blocks [begin, end) one after another.
+class XzDecompressor : public Decompressor {
+    const RandomAccessFile &file_;
+    const XzBlock *next_;
+    const XzBlock *end_;
+    std::unique_ptr<FileInput> input_;
+    lzma_stream stream_;
+    // The decoder refers to both while decoding a block.
+    lzma_block block_;
+    lzma_filter filters_[LZMA_FILTERS_MAX + 1];
+    lzma_ret lastResult_;
+
+public:
+    XzDecompressor(const RandomAccessFile &file, const XzBlock *begin,
+                   const XzBlock *end)
+            : file_(file), next_(begin), end_(end), stream_(LZMA_STREAM_INIT),
+              block_(), lastResult_(LZMA_STREAM_END) {
+        filters_[0].id = LZMA_VLI_UNKNOWN;
+    }
+
+    ~XzDecompressor() override {
+        freeFilters();
+        lzma_end(&stream_);
+    }
+
+    XzDecompressor(const XzDecompressor &) = delete;
+    XzDecompressor &operator=(const XzDecompressor &) = delete;
+
+    size_t read(uint8_t *out, size_t length) override {
+        stream_.next_out = out;
+        stream_.avail_out = length;
+        while (stream_.avail_out) {
+            if (lastResult_ == LZMA_STREAM_END) {
+                if (next_ == end_) break;
+                startBlock(*next_++);
+            }
+            if (stream_.avail_in == 0) {
+                const uint8_t *data;
+                auto numRead = input_->next(data);
+                if (numRead == 0)
+                    throw std::runtime_error("Truncated xz block");
+                stream_.next_in = data;
+                stream_.avail_in = numRead;
+            }
+            lastResult_ = lzma_code(&stream_, LZMA_RUN);
+            xzCheck(lastResult_);
+        }
+        return length - stream_.avail_out;
+    }
+
+    // Block decoders can't say what they use, but their filters can.
+    size_t memoryUsed() const override {
+        uint64_t decoder = 0;
+        if (filters_[0].id != LZMA_VLI_UNKNOWN)
+            decoder = lzma_raw_decoder_memusage(filters_);
+        if (decoder == UINT64_MAX) decoder = 0;
+        return sizeof(*this) + (input_ ? input_->memoryUsed() : 0) + decoder;
+    }
+
+private:
+    void startBlock(const XzBlock &block) {
+        freeFilters();
+        uint8_t headerBuffer[LZMA_BLOCK_HEADER_SIZE_MAX];
+        const uint8_t *header;
+        readExactly(file_, block.frame.offset, 1, headerBuffer, header);
+        block_ = lzma_block();
+        block_.version = 1;
+        block_.check = block.check;
+        block_.filters = filters_;
+        block_.header_size = lzma_block_header_size_decode(header[0]);
+        if (block_.header_size > block.frame.size)
+            throw std::runtime_error("Invalid xz block");
+        readExactly(file_, block.frame.offset, block_.header_size,
+                    headerBuffer, header);
+        xzCheck(lzma_block_header_decode(&block_, nullptr, header));
+        xzCheck(lzma_block_decoder(&stream_, &block_));
+        input_.reset(new FileInput(file_,
+                                   block.frame.offset + block_.header_size,
+                                   block.frame.offset + block.frame.size));
+        stream_.avail_in = 0;
+        lastResult_ = LZMA_OK;
+    }
+
+    void freeFilters() {
+        for (auto filter = filters_; filter->id != LZMA_VLI_UNKNOWN; ++filter)
+            free(filter->options);
+        filters_[0].id = LZMA_VLI_UNKNOWN;
+    }
+};
+
+class XzCodec : public Codec {
+    mutable std::mutex mutex_;
+    mutable bool foundBlocks_ = false;
+    mutable std::vector<XzBlock> blocks_;
+
+public:
+    std::string name() const override { return "xz"; }
+
+    std::vector<Frame> findFrames(
+            const RandomAccessFile &file) const override {
+        std::vector<Frame> frames;
+        for (auto &block : blocks(file)) frames.push_back(block.frame);
+        return frames;
+    }
+
+    void decompressFrame(const RandomAccessFile &file, const Frame &frame,
+                         std::vector<uint8_t> &out) const override {
+        auto block = find(file, frame.offset);
+        XzDecompressor decompressor(file, block, block + 1);
+        auto start = out.size();
+        for (;;) {
+            auto oldSize = out.size();
+            auto toRead = std::max<size_t>(oldSize - start, ReadAhead);
+            out.resize(oldSize + toRead);
+            auto numRead = decompressor.read(&out[oldSize], toRead);
+            out.resize(oldSize + numRead);
+            if (numRead < toRead) break;
+        }
+    }
+
+    std::unique_ptr<Decompressor> decompressorAt(
+            const RandomAccessFile &file, uint64_t offset,
+            unsigned) const override {
+        auto &all = blocks(file);
+        return std::unique_ptr<Decompressor>(new XzDecompressor(
+                file, find(file, offset), all.data() + all.size()));
+    }
+
+private:
+    // Blocks need their stream's check type to be decoded, which only the
+    // stream's header and footer give, so they're remembered.
+    const std::vector<XzBlock> &blocks(const RandomAccessFile &file) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!foundBlocks_) {
+            blocks_ = findXzBlocks(file);
+            foundBlocks_ = true;
+        }
+        return blocks_;
+    }
+
+    const XzBlock *find(const RandomAccessFile &file, uint64_t offset) const {
+        auto &all = blocks(file);
+        auto block = std::lower_bound(
+                all.begin(), all.end(), offset,
+                [](const XzBlock &block, uint64_t offset) {
+                    return block.frame.offset < offset;
+                });
+        if (block == all.end() || block->frame.offset != offset)
+            throw std::runtime_error("No xz block at offset "
+                                     + std::to_string(offset));
+        return &*block;
+    }
+};
+
+#endif
+
+}
+
+void Decompressor::skip(uint64_t numBytes) {
+    uint8_t discardBuffer[SkipBufferSize];
+    while (numBytes) {
+        auto toRead = std::min<uint64_t>(numBytes, SkipBufferSize);
+        if (read(discardBuffer, toRead) != toRead) return;
+        numBytes -= toRead;
+    }
+}
+
+std::string detectCompression(const RandomAccessFile &file) {
+    uint8_t magicBuffer[sizeof(XzMagic)];
+    const uint8_t *magic;
+    auto numRead = file.read(0, sizeof(magicBuffer), magicBuffer, magic);
+    if (numRead < 4) return "";
+    auto value = readLe32(magic);
+    if (value == ZstdMagic || (value & 0xfffffff0) == SkippableMagic)
+        return "zstd";
+    if (magic[0] == 'B' && magic[1] == 'Z' && magic[2] == 'h'
+        && magic[3] >= '1' && magic[3] <= '9')
+        return "bzip2";
+    if (numRead == sizeof(XzMagic)
+        && std::equal(magic, magic + numRead, XzMagic))
+        return "xz";
+    return "";
+}
+
+bool codecAvailable(const std::string &name) {
+#ifdef ZINDEX_HAVE_ZSTD
+    if (name == "zstd") return true;
+#endif
+#ifdef ZINDEX_HAVE_BZIP2
+    if (name == "bzip2") return true;
+#endif
+#ifdef ZINDEX_HAVE_XZ
+    if (name == "xz") return true;
+#endif
+    (void)name;
+    return false;
+}
+
+std::unique_ptr<Codec> makeCodec(const std::string &name) {
+#ifdef ZINDEX_HAVE_ZSTD
+    if (name == "zstd") return std::unique_ptr<Codec>(new ZstdCodec);
+#endif
+#ifdef ZINDEX_HAVE_BZIP2
+    if (name == "bzip2") return std::unique_ptr<Codec>(new Bzip2Codec);
+#endif
+#ifdef ZINDEX_HAVE_XZ
+    if (name == "xz") return std::unique_ptr<Codec>(new XzCodec);
+#endif
+    throw std::runtime_error("Compression format '" + name
+                             + "' is not supported by this build");
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class RandomAccessFile;
+
+// Decompressed data, read on from some point in a compressed file.
+class Decompressor {
+public:
+    virtual ~Decompressor() = default;
+
+    // Reads up to length bytes; fewer are returned only at the end of the
+    // data.
+    virtual size_t read(uint8_t *out, size_t length) = 0;
+
+    // Roughly how much memory it holds on to, its library's state included,
+    // for caches of decompressors to count.
+    virtual size_t memoryUsed() const = 0;
+
+    // Discards the next numBytes bytes.
+    void skip(uint64_t numBytes);
+};
+
+// An independently decodable piece of a compressed file.
+struct Frame {
+    uint64_t offset;
+    uint64_t size;
+    // For formats whose frames needn't start on a byte boundary (bzip2), the
+    // number of bits of the byte at offset before the frame starts.
+    unsigned bitOffset;
+};
+
+// Compression formats other than gzip (which the index handles with zlib
+// directly, windows and all). Their files are made of frames that decode
+// independently, each of which becomes an access point needing no window.
+// A codec is only ever used with the one file, and may remember what it's
+// learned about it; it's safe to use from several threads at once.
+class Codec {
+public:
+    virtual ~Codec() = default;
+
+    // As recorded in an index's metadata.
+    virtual std::string name() const = 0;
+    // The file's frames, in order, found as cheaply as the format allows.
+    // Some may turn out to hold no data: bzip2's can only be told apart from
+    // data that looks like their start by decompressing them. Throws
+    // std::runtime_error if the file isn't as expected.
+    virtual std::vector<Frame> findFrames(
+            const RandomAccessFile &file) const = 0;
+    // Appends one frame's data (if any) to out.
+    virtual void decompressFrame(const RandomAccessFile &file,
+                                 const Frame &frame,
+                                 std::vector<uint8_t> &out) const = 0;
+    // Decompresses from the start of the frame at offset (and bitOffset) on
+    // to the end of the file. The decompressor reads the file as it goes, so
+    // mustn't outlive it.
+    virtual std::unique_ptr<Decompressor> decompressorAt(
+            const RandomAccessFile &file, uint64_t offset,
+            unsigned bitOffset) const = 0;
+};
+
+// The name of the format the file's in, judging by its first few bytes: one
+// of those makeCodec() knows, or empty for gzip (or zlib) and anything not
+// recognised.
+std::string detectCompression(const RandomAccessFile &file);
+// Whether this build supports the named format (each is optional).
+bool codecAvailable(const std::string &name);
+// Throws std::runtime_error if the format's unknown or not supported by this
+// build.
+std::unique_ptr<Codec> makeCodec(const std::string &name);
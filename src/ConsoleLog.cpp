@@ -19,6 +19,7 @@ ConsoleLog::ConsoleLog(Log::Severity logLevel, bool forceColour)
 }
 
 void ConsoleLog::log(Log::Severity severity, const std::string &message) {
+    std::lock_guard<std::mutex> lock(mutex_);
     auto &out = severity >= Log::Severity::Warning ? std::cerr : std::cout;
     bool needReset = ansiColour_;
     if (ansiColour_) {
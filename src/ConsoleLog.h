@@ -2,8 +2,11 @@
 
 #include "Log.h"
 
+#include <mutex>
+
 class ConsoleLog : public Log {
     bool ansiColour_;
+    std::mutex mutex_;
 public:
     ConsoleLog(Log::Severity logLevel, bool forceColour);
 
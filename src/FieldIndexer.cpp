@@ -1,18 +1,24 @@
-#include <cstring>
 #include "FieldIndexer.h"
 #include "IndexSink.h"
 
+FieldIndexer::FieldIndexer(char separator, int field)
+        : FieldIndexer(std::make_shared<FieldSplitter>(separator), field) { }
+
+FieldIndexer::FieldIndexer(std::shared_ptr<FieldSplitter> splitter,
+                           int field)
+        : splitter_(std::move(splitter)), field_(field) {
+    splitter_->addUser(field_);
+}
+
 void FieldIndexer::index(IndexSink &sink, StringView line) {
-    auto ptr = line.begin();
-    auto end = line.end();
-    for (auto i = 1; i < field_; ++i) {
-        auto nextSep = static_cast<const char *>(
-                memchr(ptr, separator_, end - ptr));
-        if (!nextSep) return;
-        ptr = nextSep + 1;
-    }
-    auto lastSep = memchr(ptr, separator_, end - ptr);
-    if (lastSep) end = static_cast<const char *>(lastSep);
-    if (ptr != end)
-        sink.add(ptr, end - ptr, ptr - line.begin());
+    auto &fields = splitter_->fields(line);
+    if (field_ < 1 || field_ > fields.size()) return;
+    auto &field = fields[field_ - 1];
+    std::string scratch;
+    auto text = splitter_->text(line, field, scratch);
+    if (text.length() == 0) return;
+    // Offsets are of the text in the line, so within any quotes.
+    auto quoted = splitter_->quoting() != FieldSplitter::Quoting::None
+                  && line.begin()[field.begin] == '"';
+    sink.add(text.begin(), text.length(), field.begin + quoted);
 }
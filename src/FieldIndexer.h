@@ -1,16 +1,20 @@
 #pragma once
 
+#include "FieldSplitter.h"
 #include "LineIndexer.h"
 
+#include <memory>
 #include <string>
 
 class FieldIndexer : public LineIndexer {
-    char separator_;
-    int field_;
+    std::shared_ptr<FieldSplitter> splitter_;
+    size_t field_;
 public:
-    FieldIndexer(char separator, int field)
-            : separator_(separator),
-              field_(field) { }
+    FieldIndexer(char separator, int field);
+    // Indexes the field of lines as split by splitter, which other indexers
+    // may share to split each line just once.
+    FieldIndexer(std::shared_ptr<FieldSplitter> splitter, int field);
 
     void index(IndexSink &sink, StringView line) override;
+    bool threadSafe() const override { return true; }
 };
@@ -0,0 +1,186 @@
+#include "FieldSplitter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr auto BlockSize = 32u;
+
+// Bit i set where block[i] == c.
+uint32_t matchesInBlock(const char *block, char c) {
+#if defined(__AVX2__)
+    auto bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c))));
+#elif defined(__SSE2__)
+    auto wanted = _mm_set1_epi8(c);
+    auto low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    auto high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16));
+    return static_cast<uint32_t>(
+                   _mm_movemask_epi8(_mm_cmpeq_epi8(low, wanted)))
+           | (static_cast<uint32_t>(
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(high, wanted)))
+              << 16);
+#else
+    uint32_t mask = 0;
+    for (auto i = 0u; i < BlockSize; ++i)
+        if (block[i] == c) mask |= 1u << i;
+    return mask;
+#endif
+}
+
+// Bits from to to (inclusive) set.
+uint32_t bitsBetween(uint32_t from, uint32_t to) {
+    return static_cast<uint32_t>((2ull << to) - (1ull << from));
+}
+
+std::atomic<uint64_t> nextSplitterId(0);
+
+// The last line each shared splitter split on this thread, and how many more
+// of its users are yet to ask for it.
+struct SharedSplit {
+    uint64_t splitterId;
+    const char *begin;
+    size_t length;
+    size_t usesLeft;
+    std::vector<FieldSplitter::Field> fields;
+};
+
+thread_local std::vector<SharedSplit> sharedSplits;
+
+}
+
+FieldSplitter::FieldSplitter(char delimiter, Quoting quoting)
+        : delimiter_(delimiter), quoting_(quoting), id_(nextSplitterId++),
+          numUsers_(0), maxField_(0) { }
+
+void FieldSplitter::split(StringView line, std::vector<Field> &fields,
+                          size_t maxFields) const {
+    fields.clear();
+    auto begin = line.begin();
+    auto length = line.length();
+    bool quoted = quoting_ == Quoting::Rfc4180;
+    size_t fieldStart = 0;
+    // Whether the previous block ended inside quotes, and whether its last
+    // quote was the first of a doubled pair.
+    bool inQuotes = false;
+    bool skipQuote = false;
+    // The last, partial block, padded out so it can be matched as a whole
+    // one without reading past the line.
+    char tail[BlockSize];
+    for (size_t block = 0; block < length; block += BlockSize) {
+        auto data = begin + block;
+        if (length - block < BlockSize) {
+            memset(tail, 0, BlockSize);
+            memcpy(tail, data, length - block);
+            data = tail;
+        }
+        auto delimiters = matchesInBlock(data, delimiter_);
+        if (data == tail)
+            delimiters &= static_cast<uint32_t>(
+                    (1ull << (length - block)) - 1);
+        if (quoted) {
+            auto quotes = matchesInBlock(data, '"');
+            if (skipQuote) quotes &= ~1u;
+            skipQuote = false;
+            // Most blocks have no quotes to walk through. Those that do are
+            // walked a quote at a time: only one starting a field opens
+            // quotes, and within them a doubled quote is just a quote.
+            uint32_t inside = 0;
+            uint32_t openedAt = 0;
+            while (quotes) {
+                auto position = static_cast<uint32_t>(__builtin_ctz(quotes));
+                quotes &= quotes - 1;
+                auto at = block + position;
+                if (!inQuotes) {
+                    if (at == 0 || begin[at - 1] == delimiter_) {
+                        inQuotes = true;
+                        openedAt = position;
+                    }
+                } else if (at + 1 < length && begin[at + 1] == '"') {
+                    if (position + 1 < BlockSize)
+                        quotes &= ~(1u << (position + 1));
+                    else
+                        skipQuote = true;
+                } else {
+                    inside |= bitsBetween(openedAt, position);
+                    inQuotes = false;
+                }
+            }
+            if (inQuotes) inside |= bitsBetween(openedAt, BlockSize - 1);
+            delimiters &= ~inside;
+        }
+        if (!delimiters) continue;
+        // Make room for the block's fields at once, rather than checking for
+        // it at each.
+        auto numFields = fields.size();
+        fields.resize(numFields + __builtin_popcount(delimiters));
+        auto field = fields.data() + numFields;
+        do {
+            auto position = block + __builtin_ctz(delimiters);
+            *field++ = Field{fieldStart, position};
+            fieldStart = position + 1;
+            delimiters &= delimiters - 1;
+        } while (delimiters);
+        if (maxFields && fields.size() >= maxFields) {
+            fields.resize(maxFields);
+            return;
+        }
+    }
+    fields.push_back(Field{fieldStart, length});
+}
+
+void FieldSplitter::addUser(size_t field) {
+    ++numUsers_;
+    maxField_ = std::max(maxField_, field);
+}
+
+const std::vector<FieldSplitter::Field> &FieldSplitter::fields(
+        StringView line) {
+    auto shared = std::find_if(sharedSplits.begin(), sharedSplits.end(),
+                               [this](const SharedSplit &split) {
+                                   return split.splitterId == id_;
+                               });
+    if (shared == sharedSplits.end()) {
+        sharedSplits.emplace_back();
+        shared = sharedSplits.end() - 1;
+        shared->splitterId = id_;
+        shared->usesLeft = 0;
+    }
+    if (shared->usesLeft && shared->begin == line.begin()
+        && shared->length == line.length()) {
+        --shared->usesLeft;
+        return shared->fields;
+    }
+    split(line, shared->fields, maxField_);
+    shared->begin = line.begin();
+    shared->length = line.length();
+    shared->usesLeft = numUsers_ ? numUsers_ - 1 : 0;
+    return shared->fields;
+}
+
+StringView FieldSplitter::text(StringView line, const Field &field,
+                               std::string &scratch) const {
+    auto begin = line.begin() + field.begin;
+    auto end = line.begin() + field.end;
+    if (quoting_ == Quoting::None || begin == end || *begin != '"')
+        return StringView(begin, end - begin);
+    ++begin;
+    if (end > begin && end[-1] == '"') --end;
+    auto quote = static_cast<const char *>(memchr(begin, '"', end - begin));
+    if (!quote) return StringView(begin, end - begin);
+    scratch.assign(begin, quote);
+    for (auto ptr = quote; ptr < end; ++ptr) {
+        scratch += *ptr;
+        if (*ptr == '"' && ptr + 1 < end && ptr[1] == '"') ++ptr;
+    }
+    return StringView(scratch);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "StringView.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Splits lines into fields at a delimiter, finding the delimiters 32 bytes at
+// a time (with SSE2 or AVX2, where the build has them). Optionally, fields may
+// be quoted as in RFC 4180 CSV: a field starting with a double quote runs to
+// the matching one, delimiters and all, with quotes inside doubled. Quotes
+// anywhere else are just part of the field.
+//
+// Several field indexers may share a splitter, which then splits each line
+// just once for all of them, so long as each indexes every line in turn (as
+// the index builder does, on each of its threads).
+class FieldSplitter {
+public:
+    enum class Quoting {
+        None,
+        Rfc4180
+    };
+
+    // A field's extent in the line, quotes and all.
+    struct Field {
+        size_t begin;
+        size_t end;
+    };
+
+    explicit FieldSplitter(char delimiter, Quoting quoting = Quoting::None);
+
+    char delimiter() const { return delimiter_; }
+    Quoting quoting() const { return quoting_; }
+
+    // Splits the line into its first maxFields fields (all of them if zero).
+    void split(StringView line, std::vector<Field> &fields,
+               size_t maxFields = 0) const;
+
+    // Registers an indexer of the (1-based) field, which will call fields().
+    void addUser(size_t field);
+    // The line's fields, as far as any user needs, split once for all its
+    // users.
+    const std::vector<Field> &fields(StringView line);
+
+    // A field's text: without its quotes, if quoted, and with doubled quotes
+    // made single (in scratch, if there are any).
+    StringView text(StringView line, const Field &field,
+                    std::string &scratch) const;
+
+private:
+    char delimiter_;
+    Quoting quoting_;
+    uint64_t id_;
+    size_t numUsers_;
+    size_t maxField_;
+};
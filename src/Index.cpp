@@ -1,17 +1,35 @@
 #include "Index.h"
 
+#include "Codec.h"
+#include "KeySorter.h"
 #include "LineFinder.h"
 #include "LineSink.h"
 #include "LineIndexer.h"
+#include "LruCache.h"
+#include "RandomAccessFile.h"
+#include "SpeculativeInflate.h"
 #include "Sqlite.h"
+#include "WindowCodec.h"
 
 #include <zlib.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
+#include <map>
 #include <iostream>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <tuple>
 #include <vector>
 #include <unordered_map>
@@ -19,6 +37,7 @@
 #include "Log.h"
 #include "StringView.h"
 #include "PrettyBytes.h"
+#include "ThreadPool.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -30,12 +49,37 @@ constexpr auto WindowSize = 32768u;
 constexpr auto ChunkSize = 16384u;
 constexpr auto LogProgressEverySecs = 20;
 constexpr auto Version = 1;
-
-void seek(File &f, uint64_t pos) {
-    auto err = ::fseek(f.get(), pos, SEEK_SET);
-    if (err != 0)
-        throw std::runtime_error("Error seeking in file"); // todo errno
-}
+constexpr auto BatchMaxLines = 16384u;
+constexpr auto BatchMaxBytes = 4 * 1024 * 1024u;
+constexpr auto BatchesInFlightPerThread = 4u;
+constexpr auto BulkInsertRows = 256u;
+constexpr auto DefaultSortMemory = 512 * 1024 * 1024ull;
+// Each unique index sorts with at least this much, however many share the
+// budget, so runs aren't spilled a few keys at a time.
+constexpr auto MinSortMemoryPerIndex = 64 * 1024ull;
+constexpr auto MinRegionRead = 64 * 1024u;
+constexpr auto ReadAhead = 256 * 1024u;
+constexpr auto FetchesInFlightPerThread = 2u;
+// Roughly what each checkpoint's row costs in the index, besides its window.
+constexpr auto CheckpointRowBytes = 32u;
+// Roughly what zlib allocates to inflate: its state, and the window it keeps.
+constexpr auto InflateStateBytes = 7 * 1024u + WindowSize;
+constexpr auto GzipTrailerSize = 8u;
+constexpr auto GzipHeaderSize = 12u; // up to and including XLEN
+// BGZF members are indexed in parallel in ranges of about this much
+// compressed data.
+constexpr auto MemberRangeBytes = 1024 * 1024u;
+constexpr auto RangesInFlightPerThread = 2u;
+// Other gzip files' members are only, if none is (or seems to be) bigger than
+// this compressed, as each range is inflated whole in memory.
+constexpr auto MaxParallelMemberBytes = 4 * 1024 * 1024u;
+// As bgzip: the most data a member may hold and still fit in 64KiB however
+// badly it compresses.
+constexpr auto BgzfMemberData = 0xff00u;
+constexpr auto BgzfHeaderSize = 18u;
+// Files are rewritten as BGZF in pieces of this many members, each compressed
+// on its own thread.
+constexpr auto RewriteMembersPerPiece = 64u;
 
 struct ZlibError : std::runtime_error {
     ZlibError(int result) :
@@ -47,25 +91,13 @@ void X(int zlibErr) {
     if (zlibErr != Z_OK) throw ZlibError(zlibErr);
 }
 
-size_t makeWindow(uint8_t *out, size_t outSize, const uint8_t *in,
-                  uint64_t left) {
-    uint8_t temp[WindowSize];
-    // Could compress directly into out if I wasn't so lazy.
+// Copies the circular buffer in, whose oldest byte is left bytes from its
+// end, into out in order.
+void unwrapWindow(const uint8_t *in, uint64_t left, uint8_t *out) {
     if (left)
-        memcpy(temp, in + WindowSize - left, left);
+        memcpy(out, in + WindowSize - left, left);
     if (left < WindowSize)
-        memcpy(temp + left, in, WindowSize - left);
-    uLongf destLen = outSize;
-    X(compress2(out, &destLen, temp, WindowSize, 9));
-    return destLen;
-}
-
-void uncompress(const std::vector<uint8_t> &compressed, uint8_t *to,
-                size_t len) {
-    uLongf destLen = len;
-    X(::uncompress(to, &len, &compressed[0], compressed.size()));
-    if (destLen != len)
-        throw std::runtime_error("Unable to decompress a full window");
+        memcpy(out + left, in, WindowSize - left);
 }
 
 struct ZStream {
@@ -88,60 +120,540 @@ struct ZStream {
     ZStream &operator=(ZStream &) = delete;
 };
 
-struct IndexHandler : IndexSink {
+// Finds where the gzip member after one whose stream ended at offset starts
+// (past its trailer, which raw streams leave unread), returning false if no
+// member follows. As with gzip, anything after the last member but another
+// member's header (zero padding, say) is ignored.
+bool nextMember(int fd, uint64_t &offset, bool raw) {
+    if (raw) offset += GzipTrailerSize;
+    uint8_t magic[2];
+    ssize_t numRead;
+    do {
+        numRead = pread(fd, magic, sizeof(magic), offset);
+    } while (numRead == -1 && errno == EINTR);
+    if (numRead == -1)
+        throw std::runtime_error(std::string("Unable to read: ")
+                                 + strerror(errno));
+    return numRead == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+// Finds the members of a BGZF file (as bgzip writes), each of whose headers
+// gives the member's size, so they can be found without decompressing
+// anything. Returns none if the file isn't BGZF throughout.
+std::vector<Frame> findBgzfMembers(const RandomAccessFile &file) {
+    std::vector<Frame> members;
+    uint64_t offset = 0;
+    while (offset < file.size()) {
+        uint8_t headerBuffer[GzipHeaderSize];
+        const uint8_t *header;
+        if (file.read(offset, GzipHeaderSize, headerBuffer, header)
+            != GzipHeaderSize
+            || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8
+            || !(header[3] & 0x04))
+            return {};
+        size_t extraLength = header[10] | (header[11] << 8);
+        if (extraLength == 0) return {};
+        std::vector<uint8_t> extraBuffer(extraLength);
+        const uint8_t *extra;
+        if (file.read(offset + GzipHeaderSize, extraLength, &extraBuffer[0],
+                      extra) != extraLength)
+            return {};
+        uint64_t size = 0;
+        for (size_t field = 0; field + 4 <= extraLength;) {
+            size_t fieldLength = extra[field + 2] | (extra[field + 3] << 8);
+            if (extra[field] == 'B' && extra[field + 1] == 'C'
+                && fieldLength == 2 && field + 6 <= extraLength)
+                size = (extra[field + 4] | (extra[field + 5] << 8)) + 1u;
+            field += 4 + fieldLength;
+        }
+        if (size == 0 || offset + size > file.size()) return {};
+        members.push_back(Frame{offset, size, 0});
+        offset += size;
+    }
+    return members;
+}
+
+// Finds where the members of a gzip file made by concatenating others (as
+// with rotated logs) may start, by looking for their headers: the magic
+// number, deflate, no reserved flags, and a plausible XFL and OS. Data within
+// a member may look like a header as well, so only inflating them says which
+// are. Returns none unless the file starts with a member, another seems to
+// follow, and none seems bigger than MaxParallelMemberBytes.
+std::vector<Frame> findGzipMembers(const RandomAccessFile &file) {
+    std::vector<Frame> members;
+    // A header's worth more than is scanned, to see ones across the end.
+    std::vector<uint8_t> buffer(ReadAhead + GzipHeaderSize);
+    for (uint64_t offset = 0; offset < file.size(); offset += ReadAhead) {
+        const uint8_t *data;
+        auto numRead = file.read(offset, buffer.size(), &buffer[0], data);
+        auto end = data + numRead;
+        auto scanEnd = data + std::min<size_t>(numRead, ReadAhead);
+        for (auto p = data; p < scanEnd; ++p) {
+            p = static_cast<const uint8_t *>(memchr(p, 0x1f, scanEnd - p));
+            if (!p) break;
+            if (end - p >= 10 && p[1] == 0x8b && p[2] == 8
+                && !(p[3] & 0xe0) && (p[8] == 0 || p[8] == 2 || p[8] == 4)
+                && (p[9] <= 13 || p[9] == 255))
+                members.push_back(Frame{offset + (p - data), 0, 0});
+        }
+        if (members.empty() || members[0].offset != 0
+            || offset + (scanEnd - data) - members.back().offset
+               > MaxParallelMemberBytes)
+            return {};
+    }
+    if (members.size() < 2) return {};
+    for (size_t i = 0; i < members.size(); ++i)
+        members[i].size = (i + 1 < members.size() ? members[i + 1].offset
+                                                  : file.size())
+                          - members[i].offset;
+    return members;
+}
+
+// Indices built before checkpoint costs were recorded need somewhere to put
+// them.
+void addCostColumnIfMissing(Sqlite &db) {
+    auto columns = db.prepare("PRAGMA table_info(AccessPoints)");
+    while (!columns.step()) {
+        if (columns.columnString(1) == "decompressMicros") return;
+    }
+    db.exec("ALTER TABLE AccessPoints ADD COLUMN decompressMicros INTEGER");
+}
+
+// Inserts rows into a table many at a time, using a multi-row INSERT prepared
+// once up front and binding parameters by position. Any remainder that does
+// not fill a whole multi-row statement is inserted a row at a time.
+class BulkInsert {
+    Sqlite::Statement single_;
+    Sqlite::Statement multi_;
+    int columns_;
+
+    static std::string sql(const std::string &table, int columns, int rows) {
+        std::string row = "(?";
+        for (auto i = 1; i < columns; ++i) row += ",?";
+        row += ")";
+        auto result = "INSERT INTO " + table + " VALUES" + row;
+        for (auto i = 1; i < rows; ++i) result += "," + row;
+        return result;
+    }
+
+public:
+    BulkInsert(const Sqlite &db, const std::string &table, int columns)
+            : single_(db.prepare(sql(table, columns, 1))),
+              multi_(db.prepare(sql(table, columns, BulkInsertRows))),
+              columns_(columns) { }
+
+    // Calls bind(statement, firstParameterIndex, row) for each row.
+    template<typename Rows, typename Bind>
+    void insert(const Rows &rows, Bind bind) {
+        size_t row = 0;
+        for (; row + BulkInsertRows <= rows.size(); row += BulkInsertRows) {
+            multi_.reset();
+            for (auto i = 0u; i < BulkInsertRows; ++i)
+                bind(multi_, i * columns_ + 1, rows[row + i]);
+            multi_.step();
+        }
+        for (; row < rows.size(); ++row) {
+            single_.reset();
+            bind(single_, 1, rows[row]);
+            single_.step();
+        }
+    }
+};
+
+struct DeflateStream {
+    z_stream stream;
+
+    DeflateStream() {
+        memset(&stream, 0, sizeof(stream));
+        X(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                       Z_DEFAULT_STRATEGY));
+    }
+
+    ~DeflateStream() {
+        (void)deflateEnd(&stream);
+    }
+
+    DeflateStream(DeflateStream &) = delete;
+
+    DeflateStream &operator=(DeflateStream &) = delete;
+};
+
+// Appends length (at most BgzfMemberData) bytes of data to out as a BGZF
+// member: a gzip member whose header gives its size.
+void appendBgzfMember(DeflateStream &ds, const uint8_t *data, size_t length,
+                      std::vector<uint8_t> &out) {
+    // The last two bytes are the member's size (less one), filled in below.
+    const uint8_t header[BgzfHeaderSize] = {
+            0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0};
+    auto start = out.size();
+    out.insert(out.end(), header, header + sizeof(header));
+    out.resize(start + BgzfHeaderSize + deflateBound(&ds.stream, length));
+    X(deflateReset(&ds.stream));
+    ds.stream.next_in = const_cast<Bytef *>(data);
+    ds.stream.avail_in = length;
+    ds.stream.next_out = &out[start + BgzfHeaderSize];
+    ds.stream.avail_out = out.size() - start - BgzfHeaderSize;
+    if (deflate(&ds.stream, Z_FINISH) != Z_STREAM_END)
+        throw ZlibError(Z_BUF_ERROR);
+    out.resize(out.size() - ds.stream.avail_out);
+    auto appendLe = [&out](uint32_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) out.push_back((value >> (8 * i)) & 0xff);
+    };
+    auto crc = length ? crc32(crc32(0, nullptr, 0), data, length)
+                      : crc32(0, nullptr, 0);
+    appendLe(crc, 4);
+    appendLe(length, 4);
+    auto blockSize = out.size() - start - 1;
+    out[start + BgzfHeaderSize - 2] = blockSize & 0xff;
+    out[start + BgzfHeaderSize - 1] = blockSize >> 8;
+}
+
+// Decompresses forwards from an access point in a compressed file, carrying
+// on through any gzip members that follow. Readers keep their own position,
+// so several may share the file.
+class AccessPointReader : public Decompressor {
+    const RandomAccessFile &file_;
+    uint64_t position_;
+    ZStream zs_;
+    uint8_t input_[ChunkSize];
+    bool raw_;
+    bool finished_;
+
+public:
+    AccessPointReader(const RandomAccessFile &file, uint64_t compressedOffset,
+                      int bitOffset, WindowCodec windowCodec,
+                      const std::vector<uint8_t> &storedWindow)
+            : file_(file), position_(compressedOffset),
+              zs_(ZStream::Type::Raw), raw_(true), finished_(false) {
+        uint8_t buffer[WindowSize];
+        start(bitOffset, decodeWindow(windowCodec, storedWindow, buffer,
+                                      WindowSize));
+    }
+
+    // From the start of a gzip (or zlib) file.
+    explicit AccessPointReader(const RandomAccessFile &file)
+            : file_(file), position_(0), zs_(ZStream::Type::ZlibOrGzip),
+              raw_(false), finished_(false) {
+        file_.willNeed(position_, ReadAhead);
+    }
+
+    // Starts from a window of WindowSize bytes given as is.
+    AccessPointReader(const RandomAccessFile &file, uint64_t compressedOffset,
+                      int bitOffset, const uint8_t *window)
+            : file_(file), position_(compressedOffset),
+              zs_(ZStream::Type::Raw), raw_(true), finished_(false) {
+        start(bitOffset, window);
+    }
+
+    size_t memoryUsed() const override {
+        return sizeof(*this) + InflateStateBytes;
+    }
+
+    size_t read(uint8_t *out, size_t length) override {
+        zs_.stream.avail_out = length;
+        zs_.stream.next_out = out;
+        while (zs_.stream.avail_out && !finished_) {
+            if (zs_.stream.avail_in == 0) refill();
+            auto ret = inflate(&zs_.stream, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                throw ZlibError(ret);
+            if (ret == Z_STREAM_END) finished_ = !startNextMember();
+        }
+        return length - zs_.stream.avail_out;
+    }
+
+    // As read(), but stops early at the end of each deflate block (other than
+    // the last), setting blockEnd. The next block starts at
+    // compressedOffset() and bitOffset().
+    size_t readBlock(uint8_t *out, size_t length, bool &blockEnd) {
+        zs_.stream.avail_out = length;
+        zs_.stream.next_out = out;
+        blockEnd = false;
+        while (zs_.stream.avail_out && !finished_ && !blockEnd) {
+            if (zs_.stream.avail_in == 0) refill();
+            auto ret = inflate(&zs_.stream, Z_BLOCK);
+            if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                throw ZlibError(ret);
+            if (ret == Z_STREAM_END) finished_ = !startNextMember();
+            else
+                blockEnd = (zs_.stream.data_type & 0x80)
+                           && !(zs_.stream.data_type & 0x40);
+        }
+        return length - zs_.stream.avail_out;
+    }
+
+    uint64_t compressedOffset() const {
+        return position_ - zs_.stream.avail_in;
+    }
+
+    int bitOffset() const { return zs_.stream.data_type & 0x7; }
+
+private:
+    void start(int bitOffset, const uint8_t *window) {
+        file_.willNeed(position_, ReadAhead);
+        if (bitOffset) {
+            uint8_t c;
+            const uint8_t *data;
+            if (file_.read(position_ - 1, 1, &c, data) != 1)
+                throw ZlibError(Z_DATA_ERROR);
+            X(inflatePrime(&zs_.stream, bitOffset, *data >> (8 - bitOffset)));
+        }
+        X(inflateSetDictionary(&zs_.stream, window, WindowSize));
+        zs_.stream.avail_in = 0;
+    }
+
+    bool startNextMember() {
+        auto offset = compressedOffset();
+        if (!nextMember(file_.fd(), offset, raw_)) return false;
+        X(inflateReset2(&zs_.stream,
+                        static_cast<int>(ZStream::Type::ZlibOrGzip)));
+        raw_ = false;
+        position_ = offset;
+        zs_.stream.avail_in = 0;
+        return true;
+    }
+
+    void refill() {
+        // A mapped file is inflated in place, in larger pieces; otherwise
+        // it's read into our buffer.
+        auto length = file_.mapped() ? ReadAhead : sizeof(input_);
+        if (file_.mapped()) file_.willNeed(position_ + length, length);
+        const uint8_t *data;
+        auto numRead = file_.read(position_, length, input_, data);
+        if (numRead == 0) throw ZlibError(Z_DATA_ERROR);
+        position_ += numRead;
+        zs_.stream.avail_in = numRead;
+        zs_.stream.next_in = const_cast<Bytef *>(data);
+    }
+};
+
+// Zeroes the bytes of a window that the WindowSize bytes decompressed after it
+// don't refer back to, so that it may be stored cheaply. What follows is
+// decompressed against marker windows: all zeros and all ones show which
+// output bytes were copied from the window, then windows holding each byte's
+// position show where from. Returns false (leaving the window alone) if the
+// masked window doesn't reproduce the same output.
+bool maskWindow(const RandomAccessFile &file, uint64_t compressedOffset,
+                int bitOffset, uint8_t *window) {
+    std::vector<uint8_t> marker(WindowSize);
+    auto inflateWith = [&](std::vector<uint8_t> &out) {
+        out.resize(WindowSize);
+        AccessPointReader reader(file, compressedOffset, bitOffset,
+                                 &marker[0]);
+        out.resize(reader.read(&out[0], WindowSize));
+    };
+    std::vector<uint8_t> zeros, ones, low, high, expected, actual;
+    std::fill(marker.begin(), marker.end(), 0x00);
+    inflateWith(zeros);
+    std::fill(marker.begin(), marker.end(), 0xff);
+    inflateWith(ones);
+    for (size_t i = 0; i < WindowSize; ++i) marker[i] = i & 0xff;
+    inflateWith(low);
+    for (size_t i = 0; i < WindowSize; ++i) marker[i] = i >> 8;
+    inflateWith(high);
+    std::copy(window, window + WindowSize, marker.begin());
+    inflateWith(expected);
+
+    std::fill(marker.begin(), marker.end(), 0);
+    for (size_t i = 0; i < zeros.size(); ++i) {
+        if (zeros[i] == ones[i]) continue;
+        auto pos = (static_cast<size_t>(high[i]) << 8) | low[i];
+        marker[pos] = window[pos];
+    }
+    inflateWith(actual);
+    if (actual != expected) return false;
+    std::copy(marker.begin(), marker.end(), window);
+    return true;
+}
+
+// The decompressed data following an access point, decompressed lazily as
+// more of it is asked for. Regions which aren't being cached may skip and
+// throw away data they no longer need.
+class DecompressedRegion {
+    std::unique_ptr<Decompressor> reader_;
+    bool retain_;
+    uint64_t begin_;
+    std::vector<uint8_t> data_;
+    std::mutex mutex_;
+
+public:
+    DecompressedRegion(std::unique_ptr<Decompressor> reader,
+                       uint64_t uncompressedOffset, bool retain)
+            : reader_(std::move(reader)), retain_(retain),
+              begin_(uncompressedOffset) { }
+
+    // Held while reading from the region.
+    std::mutex &mutex() { return mutex_; }
+    uint64_t begin() const { return begin_; }
+    uint64_t end() const { return begin_ + data_.size(); }
+    bool finished() const { return !reader_; }
+    const char *at(uint64_t offset) const {
+        return reinterpret_cast<const char *>(&data_[offset - begin_]);
+    }
+
+    size_t memoryUsed() const {
+        return data_.capacity() + (reader_ ? reader_->memoryUsed() : 0);
+    }
+
+    // Decompresses until offset is held, or the stream ends.
+    void extendTo(uint64_t offset) {
+        while (reader_ && end() < offset) {
+            auto toRead = std::max<uint64_t>(offset - end(), MinRegionRead);
+            auto oldSize = data_.size();
+            data_.resize(oldSize + toRead);
+            auto numRead = reader_->read(&data_[oldSize], toRead);
+            data_.resize(oldSize + numRead);
+            if (numRead < toRead) reader_.reset();
+        }
+    }
+
+    // Throws away data before offset, if this region isn't to be retained.
+    void discardBefore(uint64_t offset) {
+        if (retain_ || offset <= begin_) return;
+        if (offset >= end()) {
+            if (reader_) reader_->skip(offset - end());
+            data_.clear();
+            begin_ = offset;
+            return;
+        }
+        auto toDiscard = offset - begin_;
+        // Avoid shuffling the data down for every line passed.
+        if (toDiscard < MinRegionRead) return;
+        data_.erase(data_.begin(), data_.begin() + toDiscard);
+        begin_ += toDiscard;
+    }
+};
+
+struct IndexHandler {
     Log &log;
+    std::string name;
+    bool numeric;
+    bool unique;
     std::unique_ptr<LineIndexer> indexer;
-    uint64_t currentLine;
+    BulkInsert insert;
+    std::mutex indexerMutex;
+    // Keys for unique indices are sorted before insertion, so the key's
+    // B-tree is built in order.
+    std::unique_ptr<KeySorter> sorter;
 
-    IndexHandler(Log &log, std::unique_ptr<LineIndexer> indexer) :
-            log(log), indexer(std::move(indexer)), currentLine(0) { }
+    IndexHandler(Log &log, const std::string &name, bool numeric, bool unique,
+                 std::unique_ptr<LineIndexer> indexer, BulkInsert &&insert) :
+            log(log), name(name), numeric(numeric), unique(unique),
+            indexer(std::move(indexer)), insert(std::move(insert)) { }
 
     virtual ~IndexHandler() { }
 
-    void onLine(uint64_t lineNumber, const char *line, size_t length) {
+    // Called from the indexing threads: must not touch the database.
+    void index(uint64_t lineNumber, const char *line, size_t length,
+               IndexKeys &keys) {
+        struct Collector : IndexSink {
+            IndexHandler &handler;
+            uint64_t lineNumber;
+            IndexKeys &keys;
+
+            Collector(IndexHandler &handler, uint64_t lineNumber,
+                      IndexKeys &keys)
+                    : handler(handler), lineNumber(lineNumber), keys(keys) { }
+
+            void add(const char *index, size_t indexLength,
+                     size_t offset) override {
+                keys.emplace_back();
+                auto &key = keys.back();
+                key.line = lineNumber;
+                key.offset = offset;
+                handler.parse(key, index, indexLength);
+            }
+        } collector(*this, lineNumber, keys);
         try {
-            currentLine = lineNumber;
             StringView stringView(line, length);
             log.debug("Indexing line '", stringView, "'");
-            indexer->index(*this, stringView);
+            if (indexer->threadSafe()) {
+                indexer->index(collector, stringView);
+            } else {
+                std::lock_guard<std::mutex> lock(indexerMutex);
+                indexer->index(collector, stringView);
+            }
         } catch (const std::exception &e) {
             throw std::runtime_error(
-                    "Failed to index line " + std::to_string(currentLine)
+                    "Failed to index line " + std::to_string(lineNumber)
                     + ": '" + std::string(line, length) +
                     "' - " + e.what());
         }
     }
+
+    void write(const IndexKeys &keys) {
+        if (sorter)
+            sorter->add(keys);
+        else
+            insertKeys(keys);
+    }
+
+    void finish() {
+        if (!sorter) return;
+        log.info("Writing sorted keys for index '", name, "' (",
+                 sorter->numSpilledRuns(), " run(s) spilled to disk)");
+        IndexKey previous;
+        bool first = true;
+        sorter->finish([&](const IndexKeys &keys) {
+            for (auto &key : keys) {
+                if (!first && sameKey(previous, key))
+                    throw std::runtime_error(
+                            "Duplicate key '" + keyString(key)
+                            + "' in unique index '" + name + "' (lines "
+                            + std::to_string(previous.line) + " and "
+                            + std::to_string(key.line) + ")");
+                first = false;
+                previous = key;
+            }
+            insertKeys(keys);
+        });
+        sorter.reset();
+    }
+
+    bool sameKey(const IndexKey &lhs, const IndexKey &rhs) const {
+        return numeric ? lhs.numeric == rhs.numeric : lhs.alpha == rhs.alpha;
+    }
+
+    std::string keyString(const IndexKey &key) const {
+        return numeric ? std::to_string(key.numeric) : key.alpha;
+    }
+
+    virtual void parse(IndexKey &key, const char *index,
+                       size_t indexLength) = 0;
+    virtual void insertKeys(const IndexKeys &keys) = 0;
 };
 
 struct AlphaHandler : IndexHandler {
-    Sqlite::Statement insert;
-
-    AlphaHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
-                 Sqlite::Statement &&insert)
-            : IndexHandler(log, std::move(indexer)),
-              insert(std::move(insert)) { }
+    AlphaHandler(Log &log, const std::string &name, bool unique,
+                 std::unique_ptr<LineIndexer> indexer, BulkInsert &&insert)
+            : IndexHandler(log, name, false, unique, std::move(indexer),
+                           std::move(insert)) { }
+
+    void parse(IndexKey &key, const char *index, size_t indexLength) override {
+        key.alpha.assign(index, indexLength);
+        log.debug("Found key '", key.alpha, "'");
+    }
 
-    void add(const char *index, size_t indexLength, size_t offset) override {
-        auto key = std::string(index, indexLength);
-        log.debug("Found key '", key, "'");
-        insert
-                .reset()
-                .bindString(":key", key)
-                .bindInt64(":line", currentLine)
-                .bindInt64(":offset", offset)
-                .step();
+    void insertKeys(const IndexKeys &keys) override {
+        insert.insert(keys, [](Sqlite::Statement &stmt, int param,
+                               const IndexKey &key) {
+            stmt
+                    .bindString(param, key.alpha)
+                    .bindInt64(param + 1, key.line)
+                    .bindInt64(param + 2, key.offset);
+        });
     }
 };
 
 struct NumericHandler : IndexHandler {
-    Sqlite::Statement insert;
+    NumericHandler(Log &log, const std::string &name, bool unique,
+                   std::unique_ptr<LineIndexer> indexer, BulkInsert &&insert)
+            : IndexHandler(log, name, true, unique, std::move(indexer),
+                           std::move(insert)) { }
 
-    NumericHandler(Log &log, std::unique_ptr<LineIndexer> indexer,
-                   Sqlite::Statement &&insert)
-            : IndexHandler(log, std::move(indexer)),
-              insert(std::move(insert)) { }
-
-    void add(const char *index, size_t indexLength, size_t offset) override {
+    void parse(IndexKey &key, const char *index, size_t indexLength) override {
         auto initIndex = index;
         auto initLen = indexLength;
         int64_t val = 0;
@@ -165,33 +677,298 @@ struct NumericHandler : IndexHandler {
         }
         if (negative) val = -val;
         log.debug("Found key ", val);
-        insert
-                .reset()
-                .bindInt64(":key", val)
-                .bindInt64(":line", currentLine)
-                .bindInt64(":offset", offset)
-                .step();
+        key.numeric = val;
+    }
+
+    void insertKeys(const IndexKeys &keys) override {
+        insert.insert(keys, [](Sqlite::Statement &stmt, int param,
+                               const IndexKey &key) {
+            stmt
+                    .bindInt64(param, key.numeric)
+                    .bindInt64(param + 1, key.line)
+                    .bindInt64(param + 2, key.offset);
+        });
+    }
+};
+
+struct AccessPoint {
+    uint64_t uncompressedOffset;
+    uint64_t uncompressedEndOffset;
+    uint64_t compressedOffset;
+    int bitOffset;
+    std::vector<uint8_t> window;
+    // How long decompressing from here to the next access point took.
+    uint64_t decompressMicros;
+};
+
+// A run of consecutive members decompressed in one piece, with a checkpoint
+// (offset relative to the piece) at the start of each that isn't empty, and
+// where their compressed data ended.
+struct DecompressedRange {
+    std::vector<uint8_t> data;
+    std::vector<AccessPoint> accessPoints;
+    uint64_t compressedEnd;
+};
+
+// Inflates the members [begin, end), which need no dictionary.
+DecompressedRange inflateMembers(const RandomAccessFile &file,
+                                 const Frame *begin, const Frame *end) {
+    using Clock = std::chrono::steady_clock;
+    DecompressedRange result;
+    result.compressedEnd = end[-1].offset + end[-1].size;
+    ZStream zs(ZStream::Type::ZlibOrGzip);
+    std::vector<uint8_t> buffer;
+    for (auto member = begin; member != end; ++member) {
+        auto startTime = Clock::now();
+        X(inflateReset(&zs.stream));
+        buffer.resize(member->size);
+        const uint8_t *input;
+        if (file.read(member->offset, member->size, &buffer[0], input)
+            != member->size)
+            throw ZlibError(Z_DATA_ERROR);
+        // The trailer ends with the member's uncompressed size (mod 2^32).
+        auto sizeField = input + member->size - 4;
+        uint64_t expected = sizeField[0] | (sizeField[1] << 8)
+                            | (sizeField[2] << 16)
+                            | (static_cast<uint64_t>(sizeField[3]) << 24);
+        auto memberStart = result.data.size();
+        result.data.resize(memberStart + expected + 1);
+        zs.stream.next_in = const_cast<Bytef *>(input);
+        zs.stream.avail_in = member->size;
+        zs.stream.next_out = &result.data[memberStart];
+        zs.stream.avail_out = result.data.size() - memberStart;
+        // Just the header first, to see where the deflate data starts.
+        auto ret = inflate(&zs.stream, Z_BLOCK);
+        auto compressedOffset = member->offset + member->size
+                                - zs.stream.avail_in;
+        while (ret == Z_OK) {
+            if (zs.stream.avail_out == 0) {
+                auto produced = result.data.size();
+                result.data.resize(produced + ChunkSize);
+                zs.stream.next_out = &result.data[produced];
+                zs.stream.avail_out = ChunkSize;
+            }
+            ret = inflate(&zs.stream, Z_NO_FLUSH);
+        }
+        if (ret != Z_STREAM_END || zs.stream.avail_in != 0)
+            throw ZlibError(ret == Z_STREAM_END || ret == Z_BUF_ERROR
+                            ? Z_DATA_ERROR : ret);
+        result.data.resize(result.data.size() - zs.stream.avail_out);
+        if (result.data.size() == memberStart) continue;
+        AccessPoint ap;
+        ap.uncompressedOffset = memberStart;
+        ap.compressedOffset = compressedOffset;
+        ap.bitOffset = 0;
+        ap.decompressMicros = std::chrono::duration_cast<
+                std::chrono::microseconds>(Clock::now() - startTime).count();
+        result.accessPoints.push_back(std::move(ap));
+    }
+    return result;
+}
+
+// Inflates gzip members one after another from the first of [begin, end),
+// which are where members seemed to start, until one ends at or past the end
+// of the last (or no member follows). Checkpoints go at the start of each
+// member that isn't empty and, every indexEvery bytes, at the end of a block
+// within one, with the window before it encoded with windowCodec. Windows
+// don't reach back before the range (those bytes are zero), as members never
+// refer back that far.
+DecompressedRange inflateGzipMembers(const RandomAccessFile &file,
+                                     const Frame *begin, const Frame *end,
+                                     WindowCodec windowCodec,
+                                     uint64_t indexEvery) {
+    using Clock = std::chrono::steady_clock;
+    DecompressedRange result;
+    auto rangeEnd = end[-1].offset + end[-1].size;
+    auto offset = begin->offset;
+    ZStream zs(ZStream::Type::ZlibOrGzip);
+    std::vector<uint8_t> input(ReadAhead);
+    size_t produced = 0;
+    // Each checkpoint costs what inflating on to the next one took.
+    auto sinceAccessPoint = Clock::now();
+    auto costLast = [&]() {
+        auto now = Clock::now();
+        if (!result.accessPoints.empty())
+            result.accessPoints.back().decompressMicros =
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                            now - sinceAccessPoint).count();
+        sinceAccessPoint = now;
+    };
+    while (offset < rangeEnd) {
+        uint8_t magicBuffer[2];
+        const uint8_t *magic;
+        if (file.read(offset, sizeof(magicBuffer), magicBuffer, magic)
+            != sizeof(magicBuffer) || magic[0] != 0x1f || magic[1] != 0x8b)
+            break;
+        X(inflateReset(&zs.stream));
+        zs.stream.avail_in = 0;
+        auto position = offset;
+        auto memberStart = produced;
+        auto last = produced;
+        bool headerRead = false;
+        int ret;
+        do {
+            if (zs.stream.avail_in == 0) {
+                const uint8_t *data;
+                auto numRead = file.read(position, input.size(), &input[0],
+                                         data);
+                if (numRead == 0) throw ZlibError(Z_DATA_ERROR);
+                position += numRead;
+                zs.stream.next_in = const_cast<Bytef *>(data);
+                zs.stream.avail_in = numRead;
+            }
+            if (result.data.size() - produced < ChunkSize)
+                result.data.resize(produced + ReadAhead);
+            zs.stream.next_out = &result.data[produced];
+            zs.stream.avail_out = result.data.size() - produced;
+            ret = inflate(&zs.stream, Z_BLOCK);
+            produced = result.data.size() - zs.stream.avail_out;
+            if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
+            if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                throw ZlibError(ret);
+            // Just past the header, or the end of a block that isn't the
+            // last.
+            bool boundary = ret != Z_STREAM_END
+                            && (zs.stream.data_type & 0x80)
+                            && !(zs.stream.data_type & 0x40);
+            if (!boundary
+                || (headerRead
+                    && !(indexEvery && produced - last > indexEvery)))
+                continue;
+            AccessPoint ap;
+            ap.uncompressedOffset = produced;
+            ap.compressedOffset = position - zs.stream.avail_in;
+            ap.bitOffset = zs.stream.data_type & 0x7;
+            ap.decompressMicros = 0;
+            if (headerRead) {
+                uint8_t window[WindowSize] = {};
+                auto have = std::min<size_t>(produced, WindowSize);
+                memcpy(window + WindowSize - have,
+                       &result.data[produced - have], have);
+                ap.window = encodeWindow(windowCodec, window, WindowSize);
+            }
+            costLast();
+            result.accessPoints.push_back(std::move(ap));
+            headerRead = true;
+            last = produced;
+        } while (ret != Z_STREAM_END);
+        // An empty member's checkpoint would be where the next one's is.
+        if (produced == memberStart) result.accessPoints.pop_back();
+        offset = position - zs.stream.avail_in;
+    }
+    costLast();
+    result.data.resize(produced);
+    result.compressedEnd = offset;
+    return result;
+}
+
+// Decompresses the frames [begin, end) of a file in some other format.
+DecompressedRange decompressFrames(const Codec &codec,
+                                   const RandomAccessFile &file,
+                                   const Frame *begin, const Frame *end) {
+    using Clock = std::chrono::steady_clock;
+    DecompressedRange result;
+    result.compressedEnd = end[-1].offset + end[-1].size;
+    for (auto frame = begin; frame != end; ++frame) {
+        auto startTime = Clock::now();
+        auto frameStart = result.data.size();
+        codec.decompressFrame(file, *frame, result.data);
+        if (result.data.size() == frameStart) continue;
+        AccessPoint ap;
+        ap.uncompressedOffset = frameStart;
+        ap.compressedOffset = frame->offset;
+        ap.bitOffset = frame->bitOffset;
+        ap.decompressMicros = std::chrono::duration_cast<
+                std::chrono::microseconds>(Clock::now() - startTime).count();
+        result.accessPoints.push_back(std::move(ap));
     }
+    return result;
+}
+
+// Data compressed as BGZF members, with a checkpoint at each one's deflate
+// data (with offsets relative to the piece).
+struct BgzfPiece {
+    DecompressedRange range;
+    std::vector<uint8_t> compressed;
 };
 
+BgzfPiece compressBgzf(std::vector<uint8_t> data) {
+    BgzfPiece piece;
+    DeflateStream ds;
+    for (size_t offset = 0; offset < data.size(); offset += BgzfMemberData) {
+        AccessPoint ap;
+        ap.uncompressedOffset = offset;
+        ap.compressedOffset = piece.compressed.size() + BgzfHeaderSize;
+        ap.bitOffset = 0;
+        ap.decompressMicros = 0;
+        piece.range.accessPoints.push_back(std::move(ap));
+        appendBgzfMember(ds, &data[offset],
+                         std::min<size_t>(BgzfMemberData,
+                                          data.size() - offset),
+                         piece.compressed);
+    }
+    piece.range.data = std::move(data);
+    return piece;
+}
+
+// The checkpoints found by refining the span following an existing one: the
+// existing checkpoint (without its window, and with its new end and cost)
+// followed by those to add, and with sparse line offsets the first line in
+// each new one.
+struct RefinedSpan {
+    std::vector<AccessPoint> accessPoints;
+    std::vector<std::pair<uint64_t, uint64_t>> samples;
+};
+
+// A run of consecutive lines, copied out of the decompression buffers so they
+// can be indexed away from the decompressing thread. Once indexed, the lines'
+// offsets and the keys for each index (in the order of the builder's
+// handlers) are written, along with any access points completed while the
+// lines were read. Lines that won't be indexed have no text copied.
+struct LineBatch {
+    struct Line {
+        uint64_t number;
+        uint64_t fileOffset;
+        size_t begin;
+        size_t length;
+        bool indexed;
+    };
+    // Lines whose offsets are stored (all lines, unless sparse).
+    std::vector<Line> recorded;
+    std::vector<char> text;
+    std::vector<Line> lines;
+    std::vector<AccessPoint> accessPoints;
+    std::vector<IndexKeys> keys;
+
+    bool full() const {
+        return lines.size() >= BatchMaxLines || text.size() >= BatchMaxBytes;
+    }
+};
 }
 
 struct Index::Impl {
     Log &log_;
-    File compressed_;
+    RandomAccessFile compressed_;
     Sqlite db_;
     Sqlite::Statement lineQuery_;
+    Sqlite::Statement sampleQuery_;
+    Sqlite::Statement accessPointQuery_;
     Index::Metadata metadata_;
+    bool sparse_;
+    WindowCodec windowCodec_;
+    // Unless the file's gzip.
+    std::unique_ptr<Codec> codec_;
+    LruCache<uint64_t, DecompressedRegion> cache_;
+    std::unique_ptr<ThreadPool> pool_;
+    // Guards the prepared statements and the cache, so that several threads
+    // may look up lines at once.
+    mutable std::mutex mutex_;
 
     Impl(Log &log, File &&fromCompressed, Sqlite &&db)
             : log_(log), compressed_(std::move(fromCompressed)),
-              db_(std::move(db)),
-              lineQuery_(db_.prepare(R"(
-SELECT line, offset, compressedOffset, uncompressedOffset, length, bitOffset, window
-FROM LineOffsets, AccessPoints
-WHERE offset >= uncompressedOffset AND offset <= uncompressedEndOffset
-AND line = :line
-LIMIT 1)")) {
+              db_(std::move(db)), lineQuery_(log), sampleQuery_(log),
+              accessPointQuery_(log), sparse_(false),
+              windowCodec_(WindowCodec::Zlib), cache_(0) {
         try {
             auto queryMeta = db_.prepare("SELECT key, value FROM Metadata");
             for (; ;) {
@@ -204,11 +981,38 @@ LIMIT 1)")) {
         } catch (const std::exception &e) {
             log.warn("Caught exception reading metadata: ", e.what());
         }
+        auto lineOffsets = metadata_.find("lineOffsets");
+        sparse_ = lineOffsets != metadata_.end()
+                  && lineOffsets->second == "sparse";
+        // Indices from before windows could be stored otherwise have no
+        // windowCodec, and are zlib compressed.
+        auto windowCodec = metadata_.find("windowCodec");
+        if (windowCodec != metadata_.end())
+            windowCodec_ = parseWindowCodec(windowCodec->second);
+        auto compression = metadata_.find("compression");
+        if (compression != metadata_.end())
+            codec_ = makeCodec(compression->second);
+        if (sparse_) {
+            sampleQuery_ = db_.prepare(R"(
+SELECT line, offset FROM LineSamples
+WHERE line <= :line
+ORDER BY line DESC
+LIMIT 1)");
+        } else {
+            lineQuery_ = db_.prepare(R"(
+SELECT offset FROM LineOffsets WHERE line = :line)");
+        }
+        accessPointQuery_ = db_.prepare(R"(
+SELECT uncompressedOffset, compressedOffset, bitOffset, window
+FROM AccessPoints
+WHERE uncompressedOffset <= :offset
+ORDER BY uncompressedOffset DESC
+LIMIT 1)");
     }
 
     void init(bool force) {
         struct stat stats;
-        if (fstat(fileno(compressed_.get()), &stats) != 0) {
+        if (fstat(compressed_.fd(), &stats) != 0) {
             throw std::runtime_error("Unable to get file stats"); // todo errno
         }
         auto sizeStr = std::to_string(stats.st_size);
@@ -238,92 +1042,575 @@ LIMIT 1)")) {
         }
     }
 
-    void getLine(uint64_t line, LineSink &sink) {
-        lineQuery_.reset();
-        lineQuery_.bindInt64(":line", line);
-        if (lineQuery_.step()) return;
-        print(lineQuery_, sink);
+    void getLines(const std::vector<uint64_t> &lines, LineSink &sink,
+                  LineOrder order) {
+        std::vector<uint64_t> sorted(lines);
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<LineLocation> locations;
+        locations.reserve(sorted.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto line : sorted) {
+                if (!locations.empty() && locations.back().line == line) {
+                    ++locations.back().repeats;
+                    continue;
+                }
+                LineLocation location;
+                if (locate(line, location)) locations.push_back(location);
+            }
+        }
+        if (order == LineOrder::File) {
+            fetch(locations, sink);
+            return;
+        }
+        struct BufferSink : LineSink {
+            std::unordered_map<uint64_t, std::pair<size_t, std::string>> lines;
+            void onLine(size_t lineNumber, size_t fileOffset, const char *line,
+                        size_t length) override {
+                lines.emplace(lineNumber, std::make_pair(
+                        fileOffset, std::string(line, length)));
+            }
+        } buffer;
+        fetch(locations, buffer);
+        for (auto line : lines) {
+            auto it = buffer.lines.find(line);
+            if (it == buffer.lines.end()) continue;
+            sink.onLine(line, it->second.first, it->second.second.data(),
+                        it->second.second.size());
+        }
+    }
+
+    double estimateFetchSeconds(const std::vector<uint64_t> &lines) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Sqlite::Statement costQuery(log_);
+        try {
+            costQuery = db_.prepare(R"(
+SELECT uncompressedEndOffset, decompressMicros FROM AccessPoints
+WHERE uncompressedOffset = :offset)");
+        } catch (const std::exception &e) {
+            log_.debug("No checkpoint costs recorded: ", e.what());
+            return -1;
+        }
+        // With sparse line offsets, guess where lines are by interpolating
+        // between the samples either side.
+        Sqlite::Statement nextSampleQuery(log_);
+        if (sparse_) {
+            nextSampleQuery = db_.prepare(R"(
+SELECT line, offset FROM LineSamples
+WHERE line > :line
+ORDER BY line
+LIMIT 1)");
+        }
+        // Without the cache, each access point is decompressed as far as
+        // the furthest line wanted from it.
+        std::map<uint64_t, uint64_t> furthest;
+        for (auto line : lines) {
+            LineLocation location;
+            if (!locate(line, location)) continue;
+            auto offset = location.known.offset;
+            if (sparse_ && line > location.known.line) {
+                nextSampleQuery.reset();
+                nextSampleQuery.bindInt64(":line", line);
+                if (!nextSampleQuery.step()) {
+                    auto nextLine = nextSampleQuery.columnInt64(0);
+                    auto nextOffset = nextSampleQuery.columnInt64(1);
+                    offset += (nextOffset - offset)
+                              * (line - location.known.line)
+                              / (nextLine - location.known.line);
+                } else {
+                    // Beyond the last sample: assume the worst.
+                    offset = std::numeric_limits<uint64_t>::max();
+                }
+            }
+            auto &furthestOffset = furthest[location.accessPoint];
+            furthestOffset = std::max(furthestOffset, offset);
+        }
+        double micros = 0;
+        for (auto &ap : furthest) {
+            costQuery.reset();
+            costQuery.bindInt64(":offset", ap.first);
+            if (costQuery.step()) continue;
+            auto length = costQuery.columnInt64(0) - ap.first + 1;
+            auto distance = std::min<uint64_t>(ap.second - ap.first, length);
+            micros += costQuery.columnInt64(1)
+                      * static_cast<double>(distance) / length;
+        }
+        return micros / 1e6;
     }
 
-    void queryIndex(const std::string &index, const std::string &query,
+    void queryIndex(const std::string &index,
+                    const std::vector<std::string> &queries,
                     LineFunction lineFunc) {
+        checkIndexExists(index);
         auto stmt = db_.prepare(R"(
 SELECT line FROM index_)" + index + R"(
 WHERE key = :query
 )");
-        stmt.bindString(":query", query);
-        for (; ;) {
-            if (stmt.step()) return;
-            lineFunc(stmt.columnInt64(0));
+        for (auto &query : queries) {
+            stmt.reset();
+            stmt.bindString(":query", query);
+            for (; ;) {
+                if (stmt.step()) break;
+                lineFunc(stmt.columnInt64(0));
+            }
         }
     }
 
     size_t indexSize(const std::string &index) const {
+        checkIndexExists(index);
         auto stmt = db_.prepare("SELECT COUNT(*) FROM index_" + index);
         if (stmt.step()) return 0;
         return stmt.columnInt64(0);
     }
 
-    void print(Sqlite::Statement &q, LineSink &sink) {
-        auto line = q.columnInt64(0);
-        auto offset = q.columnInt64(1);
-        auto compressedOffset = q.columnInt64(2);
-        auto uncompressedOffset = q.columnInt64(3);
-        auto length = q.columnInt64(4);
-        auto bitOffset = q.columnInt64(5);
-        uint8_t window[WindowSize];
-        uncompress(q.columnBlob(6), window, WindowSize);
+    void checkIndexExists(const std::string &index) const {
+        auto stmt = db_.prepare("SELECT name FROM Indexes WHERE name = :name");
+        stmt.bindString(":name", index);
+        if (stmt.step())
+            throw std::runtime_error("No index named '" + index + "'");
+    }
 
-        ZStream zs(ZStream::Type::Raw);
-        uint8_t input[ChunkSize];
-        uint8_t discardBuffer[WindowSize];
+    // The start of a line in the decompressed file.
+    struct LinePosition {
+        uint64_t line;
+        uint64_t offset;
+    };
 
-        seek(compressed_, bitOffset ? compressedOffset - 1 : compressedOffset);
-        if (bitOffset) {
-            auto c = fgetc(compressed_.get());
-            if (c == -1)
-                throw ZlibError(ferror(compressed_.get()) ?
-                                Z_ERRNO : Z_DATA_ERROR);
-            X(inflatePrime(&zs.stream, bitOffset, c >> (8 - bitOffset)));
+    struct LineLocation {
+        uint64_t line;
+        // The nearest line at or before it whose offset we know.
+        LinePosition known;
+        // The access point to decompress from to reach it.
+        uint64_t accessPoint;
+        // How many times it was asked for.
+        size_t repeats;
+    };
+
+    bool locate(uint64_t line, LineLocation &location) {
+        location.line = line;
+        location.repeats = 1;
+        if (sparse_) {
+            // With sparse line offsets, we count newlines from the nearest
+            // sampled line.
+            sampleQuery_.reset();
+            sampleQuery_.bindInt64(":line", line);
+            if (sampleQuery_.step()) return false;
+            location.known.line = sampleQuery_.columnInt64(0);
+            location.known.offset = sampleQuery_.columnInt64(1);
+        } else {
+            lineQuery_.reset();
+            lineQuery_.bindInt64(":line", line);
+            if (lineQuery_.step()) return false;
+            location.known.line = line;
+            location.known.offset = lineQuery_.columnInt64(0);
         }
-        X(inflateSetDictionary(&zs.stream, &window[0], WindowSize));
+        accessPointQuery_.reset();
+        accessPointQuery_.bindInt64(":offset", location.known.offset);
+        if (accessPointQuery_.step())
+            throw std::runtime_error("No access point found for offset "
+                                     + std::to_string(location.known.offset));
+        location.accessPoint = accessPointQuery_.columnInt64(0);
+        return true;
+    }
 
-        uint8_t lineBuf[length];
-        auto numToSkip = offset - uncompressedOffset;
-        bool skipping = true;
-        zs.stream.avail_in = 0;
-        do {
-            if (numToSkip == 0 && skipping) {
-                zs.stream.avail_out = length;
-                zs.stream.next_out = lineBuf;
-                skipping = false;
-            }
-            if (numToSkip > WindowSize) {
-                zs.stream.avail_out = WindowSize;
-                zs.stream.next_out = discardBuffer;
-                numToSkip -= WindowSize;
-            } else if (numToSkip) {
-                zs.stream.avail_out = (uInt)numToSkip;
-                zs.stream.next_out = discardBuffer;
-                numToSkip = 0;
+    // Fetches the lines at the given locations, which must be in line order.
+    // Lines are grouped by access point, and each access point decompressed
+    // forwards just once to find all the lines following it. With a thread
+    // pool, access points are decompressed in parallel and the lines passed
+    // to the sink in order as each finishes.
+    void fetch(const std::vector<LineLocation> &locations, LineSink &sink) {
+        auto groupEnd = [&locations](size_t begin) {
+            auto end = begin;
+            while (end < locations.size()
+                   && locations[end].accessPoint
+                      == locations[begin].accessPoint)
+                ++end;
+            return end;
+        };
+        if (!pool_) {
+            for (size_t begin = 0; begin < locations.size();) {
+                auto end = groupEnd(begin);
+                auto accessPoint = locations[begin].accessPoint;
+                auto region = regionFor(accessPoint);
+                cacheUpdated(accessPoint, fetchGroup(
+                        *region, &locations[begin], &locations[end], sink));
+                begin = end;
             }
-            do {
-                if (zs.stream.avail_in == 0) {
-                    zs.stream.avail_in = ::fread(input, 1, sizeof(input),
-                                                 compressed_.get());
-                    if (ferror(compressed_.get())) throw ZlibError(Z_ERRNO);
-                    if (zs.stream.avail_in == 0) throw ZlibError(Z_DATA_ERROR);
-                    zs.stream.next_in = input;
+            return;
+        }
+
+        struct FetchedLines : LineSink {
+            struct Line {
+                size_t number;
+                size_t fileOffset;
+                size_t length;
+            };
+            std::vector<Line> lines;
+            std::string text;
+            size_t regionMemory;
+            void onLine(size_t lineNumber, size_t fileOffset, const char *line,
+                        size_t length) override {
+                lines.push_back(Line{lineNumber, fileOffset, length});
+                text.append(line, length);
+            }
+        };
+        using Fetch = std::pair<uint64_t,
+                std::future<std::unique_ptr<FetchedLines>>>;
+        std::deque<Fetch> inFlight;
+        auto emitNext = [&]() {
+            // Off the queue first: a spent future can't be waited for.
+            auto next = std::move(inFlight.front());
+            inFlight.pop_front();
+            auto fetched = next.second.get();
+            auto text = fetched->text.data();
+            for (auto &line : fetched->lines) {
+                sink.onLine(line.number, line.fileOffset, text, line.length);
+                text += line.length;
+            }
+            cacheUpdated(next.first, fetched->regionMemory);
+        };
+        try {
+            for (size_t begin = 0; begin < locations.size();) {
+                auto end = groupEnd(begin);
+                if (inFlight.size() >= FetchesInFlightPerThread * pool_->size())
+                    emitNext();
+                auto accessPoint = locations[begin].accessPoint;
+                auto region = regionFor(accessPoint);
+                auto first = &locations[begin];
+                auto last = &locations[end];
+                inFlight.emplace_back(accessPoint, pool_->submit(
+                        [region, first, last]() {
+                            std::unique_ptr<FetchedLines> fetched(
+                                    new FetchedLines);
+                            fetched->regionMemory = fetchGroup(
+                                    *region, first, last, *fetched);
+                            return fetched;
+                        }));
+                begin = end;
+            }
+            while (!inFlight.empty()) emitNext();
+        } catch (...) {
+            // The fetches refer to locations, so must finish before we leave.
+            for (auto &fetch : inFlight) fetch.second.wait();
+            throw;
+        }
+    }
+
+    // Finds and emits the lines at [begin, end), which all follow the access
+    // point the region starts at. Returns the memory the region now uses.
+    static size_t fetchGroup(DecompressedRegion &region,
+                             const LineLocation *begin,
+                             const LineLocation *end, LineSink &sink) {
+        std::lock_guard<std::mutex> lock(region.mutex());
+        auto position = begin->known;
+        region.discardBefore(position.offset);
+        for (auto location = begin; location != end; ++location) {
+            if (location->known.line > position.line)
+                position = location->known;
+            position = emitLine(region, position, location->line,
+                                location->repeats, sink);
+        }
+        return region.memoryUsed();
+    }
+
+    std::unique_ptr<Decompressor> readerAt(uint64_t uncompressedOffset) {
+        accessPointQuery_.reset();
+        accessPointQuery_.bindInt64(":offset", uncompressedOffset);
+        if (accessPointQuery_.step())
+            throw std::runtime_error("No access point found for offset "
+                                     + std::to_string(uncompressedOffset));
+        if (codec_)
+            return codec_->decompressorAt(compressed_,
+                                          accessPointQuery_.columnInt64(1),
+                                          accessPointQuery_.columnInt64(2));
+        return std::unique_ptr<Decompressor>(new AccessPointReader(
+                compressed_, accessPointQuery_.columnInt64(1),
+                accessPointQuery_.columnInt64(2), windowCodec_,
+                accessPointQuery_.columnBlob(3)));
+    }
+
+    // Finds the region of decompressed data from the access point at
+    // uncompressedOffset, either from the cache or by making a new reader.
+    std::shared_ptr<DecompressedRegion> regionFor(uint64_t uncompressedOffset) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cache_.capacity() == 0) {
+            return std::make_shared<DecompressedRegion>(
+                    readerAt(uncompressedOffset), uncompressedOffset, false);
+        }
+        auto region = cache_.get(uncompressedOffset);
+        if (!region) {
+            log_.debug("Cache miss for access point at ", uncompressedOffset);
+            region = std::make_shared<DecompressedRegion>(
+                    readerAt(uncompressedOffset), uncompressedOffset, true);
+            cache_.put(uncompressedOffset, region, region->memoryUsed());
+        }
+        return region;
+    }
+
+    void cacheUpdated(uint64_t accessPoint, size_t memoryUsed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cache_.capacity()) cache_.updateCost(accessPoint, memoryUsed);
+    }
+
+    // Starting from a known line position, finds the line numbered line by
+    // counting newlines, and passes it to the sink (repeats times). Returns
+    // the position of the line after it.
+    static LinePosition emitLine(DecompressedRegion &region,
+                                 LinePosition from, uint64_t line,
+                                 size_t repeats, LineSink &sink) {
+        auto currentLine = from.line;
+        auto lineStart = from.offset;
+        auto position = from.offset;
+        for (; ;) {
+            if (position >= region.end()) {
+                if (region.finished()) break;
+                region.extendTo(position + 1);
+                continue;
+            }
+            auto ptr = region.at(position);
+            auto newline = static_cast<const char *>(
+                    memchr(ptr, '\n', region.end() - position));
+            if (!newline) {
+                position = region.end();
+                continue;
+            }
+            auto lineEnd = position + (newline - ptr);
+            if (currentLine == line) {
+                for (size_t i = 0; i < repeats; ++i)
+                    sink.onLine(line, lineStart, region.at(lineStart),
+                                lineEnd - lineStart);
+                return LinePosition{line + 1, lineEnd + 1};
+            }
+            position = lineStart = lineEnd + 1;
+            ++currentLine;
+            region.discardBefore(lineStart);
+        }
+        // The last line of a file may not have a newline.
+        if (currentLine == line && region.end() > lineStart) {
+            for (size_t i = 0; i < repeats; ++i)
+                sink.onLine(line, lineStart, region.at(lineStart),
+                            region.end() - lineStart);
+        }
+        return LinePosition{currentLine, lineStart};
+    }
+
+    // Adds checkpoints so that no more than every bytes lie between any two,
+    // leaving the line offsets and indices be. The spans between the existing
+    // access points are each decompressed independently (in parallel, given a
+    // pool), and the new checkpoints written in order as each finishes.
+    void refineCheckpoints(uint64_t every) {
+        if (codec_)
+            throw std::runtime_error(
+                    "Only gzip files' checkpoints can be refined; "
+                    + codec_->name() + " files are checkpointed every frame");
+        std::vector<AccessPoint> existing;
+        auto accessPoints = db_.prepare(R"(
+SELECT uncompressedOffset, uncompressedEndOffset, compressedOffset, bitOffset,
+    window
+FROM AccessPoints
+ORDER BY uncompressedOffset)");
+        while (!accessPoints.step()) {
+            AccessPoint ap;
+            ap.uncompressedOffset = accessPoints.columnInt64(0);
+            ap.uncompressedEndOffset = accessPoints.columnInt64(1);
+            ap.compressedOffset = accessPoints.columnInt64(2);
+            ap.bitOffset = accessPoints.columnInt64(3);
+            ap.window = accessPoints.columnBlob(4);
+            ap.decompressMicros = 0;
+            existing.push_back(std::move(ap));
+        }
+        // With sparse line offsets, newlines are counted from the first line
+        // sampled in each span, so the new checkpoints can be sampled too.
+        std::vector<LinePosition> anchors(existing.size(), LinePosition{0, 0});
+        if (sparse_) {
+            auto samples = db_.prepare(
+                    "SELECT line, offset FROM LineSamples ORDER BY line");
+            size_t span = 0;
+            while (span < existing.size() && !samples.step()) {
+                uint64_t offset = samples.columnInt64(1);
+                while (span < existing.size()
+                       && existing[span].uncompressedEndOffset < offset)
+                    ++span;
+                if (span < existing.size() && anchors[span].line == 0
+                    && offset >= existing[span].uncompressedOffset)
+                    anchors[span] = LinePosition{
+                            static_cast<uint64_t>(samples.columnInt64(0)),
+                            offset};
+            }
+        }
+        log_.info("Refining ", existing.size(), " checkpoints to one every ",
+                  PrettyBytes(every));
+
+        addCostColumnIfMissing(db_);
+        db_.exec(R"(BEGIN TRANSACTION)");
+        auto updateAccessPoint = db_.prepare(R"(
+UPDATE AccessPoints
+SET uncompressedEndOffset = :uncompressedEndOffset,
+    decompressMicros = :decompressMicros
+WHERE uncompressedOffset = :uncompressedOffset)");
+        auto addAccessPoint = db_.prepare(R"(
+INSERT INTO AccessPoints(
+    uncompressedOffset, uncompressedEndOffset, compressedOffset, bitOffset,
+    window, decompressMicros)
+VALUES(
+:uncompressedOffset, :uncompressedEndOffset,
+:compressedOffset, :bitOffset, :window, :decompressMicros))");
+        Sqlite::Statement addSample(log_);
+        if (sparse_)
+            addSample = db_.prepare(
+                    "INSERT OR IGNORE INTO LineSamples VALUES(:line, :offset)");
+        uint64_t numAdded = 0;
+        auto write = [&](const RefinedSpan &refined) {
+            auto &first = refined.accessPoints.front();
+            updateAccessPoint
+                    .reset()
+                    .bindInt64(":uncompressedOffset", first.uncompressedOffset)
+                    .bindInt64(":uncompressedEndOffset",
+                               first.uncompressedEndOffset)
+                    .bindInt64(":decompressMicros", first.decompressMicros)
+                    .step();
+            for (size_t i = 1; i < refined.accessPoints.size(); ++i) {
+                auto &ap = refined.accessPoints[i];
+                addAccessPoint
+                        .reset()
+                        .bindInt64(":uncompressedOffset", ap.uncompressedOffset)
+                        .bindInt64(":uncompressedEndOffset",
+                                   ap.uncompressedEndOffset)
+                        .bindInt64(":compressedOffset", ap.compressedOffset)
+                        .bindInt64(":bitOffset", ap.bitOffset)
+                        .bindBlob(":window", ap.window.data(), ap.window.size())
+                        .bindInt64(":decompressMicros", ap.decompressMicros)
+                        .step();
+                ++numAdded;
+            }
+            for (auto &sample : refined.samples) {
+                addSample
+                        .reset()
+                        .bindInt64(":line", sample.first)
+                        .bindInt64(":offset", sample.second)
+                        .step();
+            }
+        };
+
+        if (!pool_) {
+            for (size_t span = 0; span < existing.size(); ++span)
+                write(refineSpan(existing[span], anchors[span], every));
+        } else {
+            std::deque<std::future<RefinedSpan>> inFlight;
+            auto writeNext = [&]() {
+                // Off the queue first: a spent future can't be waited for.
+                auto next = std::move(inFlight.front());
+                inFlight.pop_front();
+                write(next.get());
+            };
+            try {
+                for (size_t span = 0; span < existing.size(); ++span) {
+                    if (inFlight.size()
+                        >= FetchesInFlightPerThread * pool_->size())
+                        writeNext();
+                    auto from = &existing[span];
+                    auto anchor = anchors[span];
+                    inFlight.emplace_back(pool_->submit(
+                            [this, from, anchor, every]() {
+                                return refineSpan(*from, anchor, every);
+                            }));
                 }
-                auto ret = inflate(&zs.stream, Z_NO_FLUSH);
-                if (ret == Z_NEED_DICT) throw ZlibError(Z_DATA_ERROR);
-                if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
-                    throw ZlibError(ret);
-                if (ret == Z_STREAM_END) break;
-            } while (zs.stream.avail_out);
-        } while (skipping);
-        sink.onLine(line, offset, reinterpret_cast<const char *>(lineBuf),
-                    length - 1);
+                while (!inFlight.empty()) writeNext();
+            } catch (...) {
+                // The spans refer to existing, so must finish before we
+                // leave. What was written is discarded with the transaction.
+                for (auto &refined : inFlight) refined.wait();
+                throw;
+            }
+        }
+        db_.exec(R"(END TRANSACTION)");
+        log_.info("Added ", numAdded, " checkpoints");
+    }
+
+    // Decompresses the span following an existing access point, placing new
+    // checkpoints at the first block boundary every bytes on from the last.
+    // None are placed in the first window's worth of data, where (should the
+    // existing window be masked) we'd not know the whole window. Given the
+    // first line in the span, also finds the first line in each new
+    // checkpoint.
+    RefinedSpan refineSpan(const AccessPoint &from, LinePosition anchor,
+                           uint64_t every) const {
+        using Clock = std::chrono::steady_clock;
+        uint8_t window[WindowSize];
+        auto initial = decodeWindow(windowCodec_, from.window, window,
+                                    WindowSize);
+        if (initial != window) memcpy(window, initial, WindowSize);
+        AccessPointReader reader(compressed_, from.compressedOffset,
+                                 from.bitOffset, window);
+
+        RefinedSpan result;
+        result.accessPoints.emplace_back();
+        auto *current = &result.accessPoints.back();
+        current->uncompressedOffset = from.uncompressedOffset;
+        auto end = from.uncompressedEndOffset + 1;
+        auto position = from.uncompressedOffset;
+        auto last = position;
+        auto currentStart = Clock::now();
+        // The latest line start we know of, and the checkpoint (if any)
+        // waiting for a line to start after it.
+        auto line = anchor;
+        uint64_t unsampled = 0;
+        // The window is a circular buffer, written to left bytes from its end.
+        size_t left = WindowSize;
+        while (position < end) {
+            auto out = window + WindowSize - left;
+            bool blockEnd;
+            auto numRead = reader.readBlock(
+                    out, std::min<uint64_t>(left, end - position), blockEnd);
+            if (numRead == 0 && !blockEnd)
+                throw std::runtime_error("Compressed data ended early at "
+                                         + std::to_string(position));
+            if (anchor.line) {
+                for (auto ptr = out; ptr != out + numRead; ++ptr) {
+                    ptr = static_cast<uint8_t *>(
+                            memchr(ptr, '\n', out + numRead - ptr));
+                    if (!ptr) break;
+                    auto lineStart = position + (ptr - out) + 1;
+                    if (lineStart <= anchor.offset) continue;
+                    line = LinePosition{line.line + 1, lineStart};
+                    if (unsampled && lineStart < end) {
+                        result.samples.emplace_back(line.line, line.offset);
+                        unsampled = 0;
+                    }
+                }
+            }
+            position += numRead;
+            left -= numRead;
+            if (left == 0) left = WindowSize;
+            if (!blockEnd || position >= end || position - last <= every
+                || position - from.uncompressedOffset < WindowSize)
+                continue;
+
+            auto now = Clock::now();
+            current->uncompressedEndOffset = position - 1;
+            current->decompressMicros = std::chrono::duration_cast<
+                    std::chrono::microseconds>(now - currentStart).count();
+            currentStart = now;
+            result.accessPoints.emplace_back();
+            current = &result.accessPoints.back();
+            current->uncompressedOffset = position;
+            current->compressedOffset = reader.compressedOffset();
+            current->bitOffset = reader.bitOffset();
+            uint8_t apWindow[WindowSize];
+            unwrapWindow(window, left, apWindow);
+            current->window = encodeWindow(windowCodec_, apWindow, WindowSize);
+            last = position;
+            if (anchor.line) {
+                if (line.offset >= position)
+                    result.samples.emplace_back(line.line, line.offset);
+                else
+                    unsampled = position;
+            }
+        }
+        current->uncompressedEndOffset = from.uncompressedEndOffset;
+        current->decompressMicros = std::chrono::duration_cast<
+                std::chrono::microseconds>(Clock::now() - currentStart).count();
+        return result;
     }
 };
 
@@ -341,19 +1628,74 @@ struct Index::Builder::Impl : LineSink {
     std::string fromPath;
     std::string indexFilename;
     uint64_t skipFirst;
+    bool appending;
+    bool addingIndices;
     Sqlite db;
     Sqlite::Statement addIndexSql;
     Sqlite::Statement addMetaSql;
+    Sqlite::Statement addAccessPointSql;
+    std::unique_ptr<BulkInsert> addLineSql;
     uint64_t indexEvery = DefaultIndexEvery;
+    double indexEverySeconds = 0;
+    uint64_t indexEveryKeys = 0;
+    uint64_t checkpointBudget = 0;
+    // Keys found per byte of the most recently indexed batch, used to
+    // estimate the keys decompressed since the last checkpoint.
+    std::atomic<double> keysPerByte;
+    uint64_t numCheckpoints = 0;
+    uint64_t slowestCheckpointMicros = 0;
+    size_t numThreads = 1;
+    uint64_t sortMemory = DefaultSortMemory;
+    bool sparseLines = false;
+    WindowCodec windowCodec = WindowCodec::Zlib;
+    // Set for files in formats other than gzip.
+    std::unique_ptr<Codec> codec;
+    // Where to rewrite the file as BGZF, if anywhere.
+    std::string rewritePath;
+    uint64_t restartEvery = 0;
+    std::unique_ptr<RandomAccessFile> restartFile;
+    uint64_t speculativePieceBytes = 0;
+    uint64_t sampleLinesEvery = 0;
+    // Checkpoint offsets which don't yet have a sampled line (with sparse
+    // line offsets only).
+    std::deque<uint64_t> unsampledCheckpoints;
     std::unordered_map<std::string, std::unique_ptr<IndexHandler>> indexers;
+    std::vector<IndexHandler *> handlers;
+
+    // State shared between the decompressing thread and the writer.
+    std::unique_ptr<ThreadPool> pool;
+    std::mutex pipelineMutex;
+    std::condition_variable pipelineChanged;
+    std::deque<std::pair<std::shared_ptr<LineBatch>, std::future<void>>>
+            pipeline;
+    bool pipelineFinished = false;
+    std::exception_ptr writerError;
+    std::shared_ptr<LineBatch> batch;
+    std::unique_ptr<LineFinder> lineFinder;
+
+    // When appending, where to pick up from: the last line in the index,
+    // and the access point before it.
+    struct ResumePoint {
+        AccessPoint accessPoint;
+        uint64_t line;
+        uint64_t offset;
+    };
+    std::unique_ptr<ResumePoint> resumeFrom;
 
     Impl(Log &log, File &&from, const std::string &fromPath,
-         const std::string &indexFilename, uint64_t skipFirst)
+         const std::string &indexFilename, uint64_t skipFirst, Mode mode)
             : log(log), from(std::move(from)), fromPath(fromPath),
               indexFilename(indexFilename), skipFirst(skipFirst),
-              db(log), addIndexSql(log), addMetaSql(log) { }
+              appending(mode == Mode::Append),
+              addingIndices(mode == Mode::AddIndices), db(log),
+              addIndexSql(log), addMetaSql(log), addAccessPointSql(log),
+              keysPerByte(0) { }
 
     void init() {
+        if (appending || addingIndices) {
+            openExisting();
+            return;
+        }
         if (unlink(indexFilename.c_str()) == 0) {
             log.warn("Rebuilding existing index ", indexFilename);
         }
@@ -369,7 +1711,8 @@ CREATE TABLE AccessPoints(
     uncompressedEndOffset INTEGER,
     compressedOffset INTEGER,
     bitOffset INTEGER,
-    window BLOB
+    window BLOB,
+    decompressMicros INTEGER
 ))");
 
         db.exec(R"(
@@ -377,7 +1720,8 @@ CREATE TABLE Metadata(
     key TEXT PRIMARY KEY,
     value TEXT
 ))");
-        addMetaSql = db.prepare("INSERT INTO Metadata VALUES(:key, :value)");
+        addMetaSql = db.prepare(
+                "INSERT OR REPLACE INTO Metadata VALUES(:key, :value)");
         addMeta("version", std::to_string(Version));
         addMeta("compressedFile", fromPath);
         struct stat stats;
@@ -386,13 +1730,7 @@ CREATE TABLE Metadata(
         }
         addMeta("compressedSize", std::to_string(stats.st_size));
         addMeta("compressedModTime", std::to_string(stats.st_mtime));
-
-        db.exec(R"(
-CREATE TABLE LineOffsets(
-    line INTEGER PRIMARY KEY,
-    offset INTEGER,
-    length INTEGER
-))");
+        addMeta("skipFirst", std::to_string(skipFirst));
 
         db.exec(R"(
 CREATE TABLE Indexes(
@@ -405,23 +1743,944 @@ INSERT INTO Indexes VALUES(:name, :creationString, :isNumeric)
 )");
     }
 
+    void openExisting() {
+        // Opening read-write would otherwise create an empty index.
+        if (access(indexFilename.c_str(), F_OK) != 0)
+            throw std::runtime_error(
+                    "No index " + indexFilename + " to "
+                    + (appending ? "append" : "add indices") + " to");
+        db.open(indexFilename, false);
+
+        db.exec(R"(PRAGMA synchronous = OFF)");
+        db.exec(R"(PRAGMA journal_mode = MEMORY)");
+        addMetaSql = db.prepare(
+                "INSERT OR REPLACE INTO Metadata VALUES(:key, :value)");
+        adoptSkipFirst();
+        if (addingIndices) {
+            // The new indices' tables are created in the same transaction as
+            // they're filled, so they're discarded should that fail.
+            db.exec(R"(BEGIN TRANSACTION)");
+            addIndexSql = db.prepare(R"(
+INSERT INTO Indexes VALUES(:name, :creationString, :isNumeric)
+)");
+        }
+    }
+
+    std::string existingMeta(const std::string &key) const {
+        auto query = db.prepare("SELECT value FROM Metadata WHERE key = :key");
+        query.bindString(":key", key);
+        return query.step() ? "" : query.columnString(0);
+    }
+
+    // Lines skipped when the index was built must be skipped now too, or
+    // they'd be indexed after all. (Indices built before this was recorded
+    // just use what they're given.)
+    void adoptSkipFirst() {
+        auto saved = existingMeta("skipFirst");
+        if (saved.empty()) return;
+        auto savedSkipFirst = std::stoull(saved);
+        if (skipFirst && skipFirst != savedSkipFirst)
+            throw std::runtime_error(
+                    "The index was built skipping the first " + saved
+                    + " lines, not " + std::to_string(skipFirst));
+        skipFirst = savedSkipFirst;
+    }
+
+    // Lines must be stored, and windows encoded, as they were before.
+    void adoptExistingLayout() {
+        auto codec = existingMeta("windowCodec");
+        windowCodec = codec.empty() ? WindowCodec::Zlib
+                                    : parseWindowCodec(codec);
+        sparseLines = existingMeta("lineOffsets") == "sparse";
+        if (sparseLines)
+            sampleLinesEvery = std::stoull(existingMeta("sampleLinesEvery"));
+        auto restart = existingMeta("restartEvery");
+        if (!restartEvery && !restart.empty())
+            restartEvery = std::stoull(restart);
+        if (!appending) return;
+        auto numIndexes = db.prepare("SELECT COUNT(*) FROM Indexes");
+        numIndexes.step();
+        if (static_cast<size_t>(numIndexes.columnInt64(0)) != indexers.size())
+            throw std::runtime_error(
+                    "Appending needs the same indices as the index was "
+                            "built with");
+    }
+
+    // Picks up from the last line in the index: everything stored about it
+    // is removed (it may since have grown), and it and everything after it
+    // indexed afresh from the access point before it.
+    void resume(const struct stat &compressedStat) {
+        auto sizeBefore = existingMeta("compressedSize");
+        if (!sizeBefore.empty()
+            && static_cast<uint64_t>(compressedStat.st_size)
+               < std::stoull(sizeBefore))
+            throw std::runtime_error(
+                    "Compressed file has shrunk since the index was built");
+        addCostColumnIfMissing(db);
+        std::string lineTable = sparseLines ? "LineSamples" : "LineOffsets";
+        resumeFrom.reset(new ResumePoint);
+        resumeFrom->line = 1;
+        resumeFrom->offset = 0;
+        auto lastLine = db.prepare(
+                "SELECT line, offset FROM " + lineTable
+                + " ORDER BY line DESC LIMIT 1");
+        if (!lastLine.step()) {
+            resumeFrom->line = lastLine.columnInt64(0);
+            resumeFrom->offset = lastLine.columnInt64(1);
+        }
+        auto accessPointQuery = db.prepare(R"(
+SELECT uncompressedOffset, compressedOffset, bitOffset, window
+FROM AccessPoints
+WHERE uncompressedOffset <= :offset
+ORDER BY uncompressedOffset DESC
+LIMIT 1)");
+        accessPointQuery.bindInt64(":offset", resumeFrom->offset);
+        if (accessPointQuery.step())
+            throw std::runtime_error("No access point to append from");
+        auto &ap = resumeFrom->accessPoint;
+        ap.uncompressedOffset = accessPointQuery.columnInt64(0);
+        ap.compressedOffset = accessPointQuery.columnInt64(1);
+        ap.bitOffset = accessPointQuery.columnInt64(2);
+        ap.window = accessPointQuery.columnBlob(3);
+        log.info("Appending from line ", resumeFrom->line, " (checkpoint at ",
+                 PrettyBytes(ap.uncompressedOffset), ")");
+
+        db.prepare("DELETE FROM AccessPoints WHERE uncompressedOffset > :offset")
+                .bindInt64(":offset", ap.uncompressedOffset)
+                .step();
+        db.prepare("DELETE FROM " + lineTable + " WHERE line >= :line")
+                .bindInt64(":line", resumeFrom->line)
+                .step();
+        for (auto handler : handlers) {
+            db.prepare("DELETE FROM index_" + handler->name
+                       + " WHERE line >= :line")
+                    .bindInt64(":line", resumeFrom->line)
+                    .step();
+        }
+        // The line we resume from was sampled; it should be again.
+        if (sparseLines) unsampledCheckpoints.push_back(resumeFrom->offset);
+        addMeta("compressedSize", std::to_string(compressedStat.st_size));
+        addMeta("compressedModTime", std::to_string(compressedStat.st_mtime));
+    }
+
     void build() {
-        log.info("Building index, generating a checkpoint every ",
-                 PrettyBytes(indexEvery));
+        if (addingIndices) {
+            fillNewIndices();
+            return;
+        }
+        auto compression = detectCompression(*randomAccessCompressed());
+        if (!compression.empty()) {
+            codec = makeCodec(compression);
+            if (appending)
+                throw std::runtime_error("Can't append to an index of a "
+                                         + compression + " file");
+            log.info("Compressed with ", compression,
+                     ": checkpointing at each frame");
+        }
+        if (appending && !rewritePath.empty())
+            throw std::runtime_error("Can't rewrite a file while appending");
+        if (appending) adoptExistingLayout();
+        log.info("Building index using ", numThreads, " indexing thread(s)");
+        if (indexEvery)
+            log.info("Generating a checkpoint every ", PrettyBytes(indexEvery));
+        if (indexEverySeconds > 0)
+            log.info("Generating a checkpoint every ",
+                     indexEverySeconds * 1000, "ms of decompression");
+        if (indexEveryKeys)
+            log.info("Generating a checkpoint every ", indexEveryKeys,
+                     " keys (estimated)");
+        if (checkpointBudget)
+            log.info("Keeping checkpoints to around ",
+                     PrettyBytes(checkpointBudget));
+        if (!appending) createLineTables();
         struct stat compressedStat;
         if (fstat(fileno(from.get()), &compressedStat) != 0)
             throw ZlibError(Z_DATA_ERROR);
 
         db.exec(R"(BEGIN TRANSACTION)");
 
-        auto addIndex = db.prepare(R"(
-INSERT INTO AccessPoints VALUES(
+        setUpHandlers();
+        if (appending) resume(compressedStat);
+        addAccessPointSql = db.prepare(std::string(
+                appending ? "INSERT OR REPLACE" : "INSERT") + R"( INTO
+AccessPoints(
+    uncompressedOffset, uncompressedEndOffset, compressedOffset, bitOffset,
+    window, decompressMicros)
+VALUES(
 :uncompressedOffset, :uncompressedEndOffset,
-:compressedOffset, :bitOffset, :window))");
-        auto addLine = db.prepare(R"(
-INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
+:compressedOffset, :bitOffset, :window, :decompressMicros))");
+        if (sparseLines)
+            addLineSql.reset(new BulkInsert(db, "LineSamples", 2));
+        else
+            addLineSql.reset(new BulkInsert(db, "LineOffsets", 3));
+
+        batch = newBatch();
+        std::thread writer;
+        if (numThreads > 1) {
+            pool.reset(new ThreadPool(numThreads));
+            pipelineFinished = false;
+            writerError = nullptr;
+            writer = std::thread([this]() { writeBatches(); });
+        }
+        try {
+            if (!rewritePath.empty())
+                rewriteAsBgzf();
+            else if (codec)
+                decompressWithCodec(compressedStat);
+            else if (!decompressMembers(compressedStat)
+                     && !inflateSpeculatively(compressedStat))
+                decompress(compressedStat);
+            dispatch();
+        } catch (...) {
+            if (writer.joinable()) {
+                finishPipeline(true);
+                writer.join();
+            }
+            pool.reset();
+            throw;
+        }
+        if (writer.joinable()) {
+            finishPipeline(false);
+            writer.join();
+            pool.reset();
+            if (writerError) std::rethrow_exception(writerError);
+        }
+
+        log.info("Index reading complete");
+
+        for (auto handler : handlers) handler->finish();
+
+        log.info("Found ", lineFinder->numLines(), " lines");
+        lineFinder.reset();
+
+        log.info("Flushing");
+        db.exec(R"(END TRANSACTION)");
+        log.info("Done");
+    }
+
+    void setUpHandlers() {
+        handlers.clear();
+        size_t numSorted = 0;
+        for (auto &&pair : indexers) {
+            handlers.push_back(pair.second.get());
+            if (pair.second->unique) numSorted++;
+        }
+        for (auto handler : handlers) {
+            if (handler->unique)
+                handler->sorter.reset(new KeySorter(
+                        handler->numeric,
+                        std::max<uint64_t>(MinSortMemoryPerIndex,
+                                           sortMemory / numSorted)));
+        }
+    }
+
+    // The lines starting after an existing access point, up to the next.
+    struct Span {
+        AccessPoint accessPoint;
+        uint64_t firstLine;
+        uint64_t firstOffset;
+    };
+
+    // Fills the indices being added from the existing access points, each of
+    // whose spans is decompressed and indexed independently (in parallel,
+    // given a thread pool) and its keys written in order. The first line in
+    // each span is found from the line offsets, which (sparse or not) have
+    // the first line starting after every access point.
+    void fillNewIndices() {
+        if (!rewritePath.empty())
+            throw std::runtime_error("Can't rewrite a file while adding "
+                                     "indices");
+        if (indexers.empty())
+            throw std::runtime_error("No indices to add");
+        struct stat compressedStat;
+        if (fstat(fileno(from.get()), &compressedStat) != 0)
+            throw ZlibError(Z_DATA_ERROR);
+        if (existingMeta("compressedSize")
+            != std::to_string(compressedStat.st_size)
+            || existingMeta("compressedModTime")
+               != std::to_string(compressedStat.st_mtime))
+            throw std::runtime_error(
+                    "Compressed file has changed since the index was built");
+        adoptExistingLayout();
+        auto compression = existingMeta("compression");
+        if (!compression.empty()) codec = makeCodec(compression);
+
+        std::vector<Span> spans;
+        auto accessPoints = db.prepare(R"(
+SELECT uncompressedOffset, uncompressedEndOffset, compressedOffset, bitOffset,
+    window
+FROM AccessPoints
+ORDER BY uncompressedOffset)");
+        auto firstLine = db.prepare(
+                "SELECT line, offset FROM "
+                + std::string(sparseLines ? "LineSamples" : "LineOffsets")
+                + " WHERE line >= :line AND offset >= :offset"
+                  " ORDER BY line LIMIT 1");
+        uint64_t line = 1;
+        while (!accessPoints.step()) {
+            Span span;
+            auto &ap = span.accessPoint;
+            ap.uncompressedOffset = accessPoints.columnInt64(0);
+            ap.uncompressedEndOffset = accessPoints.columnInt64(1);
+            ap.compressedOffset = accessPoints.columnInt64(2);
+            ap.bitOffset = accessPoints.columnInt64(3);
+            ap.window = accessPoints.columnBlob(4);
+            ap.decompressMicros = 0;
+            firstLine
+                    .reset()
+                    .bindInt64(":line", line)
+                    .bindInt64(":offset", ap.uncompressedOffset);
+            // Long lines may span access points without a line in between.
+            if (firstLine.step()) break;
+            span.firstLine = line = firstLine.columnInt64(0);
+            span.firstOffset = firstLine.columnInt64(1);
+            if (span.firstOffset <= ap.uncompressedEndOffset)
+                spans.push_back(std::move(span));
+        }
+        log.info("Adding ", indexers.size(), " index(es) from ", spans.size(),
+                 " checkpoints using ", numThreads, " thread(s)");
 
-        ZStream zs(ZStream::Type::ZlibOrGzip);
+        setUpHandlers();
+        auto file = randomAccessCompressed();
+        time_t nextProgress = 0;
+        auto write = [&](const std::vector<IndexKeys> &keys,
+                         const Span &span) {
+            for (size_t i = 0; i < handlers.size(); ++i)
+                handlers[i]->write(keys[i]);
+            auto now = time(nullptr);
+            if (now >= nextProgress) {
+                log.info("Progress: ",
+                         PrettyBytes(span.accessPoint.uncompressedEndOffset
+                                     + 1), " of ",
+                         PrettyBytes(spans.back().accessPoint
+                                             .uncompressedEndOffset + 1));
+                nextProgress = now + LogProgressEverySecs;
+            }
+        };
+        if (numThreads <= 1) {
+            for (auto &span : spans) write(indexSpan(*file, span), span);
+        } else {
+            pool.reset(new ThreadPool(numThreads));
+            using Keys = std::pair<const Span *,
+                                   std::future<std::vector<IndexKeys>>>;
+            std::deque<Keys> inFlight;
+            auto writeNext = [&]() {
+                auto next = std::move(inFlight.front());
+                inFlight.pop_front();
+                write(next.second.get(), *next.first);
+            };
+            try {
+                for (auto &span : spans) {
+                    if (inFlight.size()
+                        >= RangesInFlightPerThread * pool->size())
+                        writeNext();
+                    auto spanFile = file.get();
+                    auto from = &span;
+                    inFlight.emplace_back(from, pool->submit(
+                            [this, spanFile, from]() {
+                                return indexSpan(*spanFile, *from);
+                            }));
+                }
+                while (!inFlight.empty()) writeNext();
+            } catch (...) {
+                // The spans are read from file, so must finish before we
+                // leave. What was written is discarded with the transaction.
+                for (auto &keys : inFlight) keys.second.wait();
+                pool.reset();
+                throw;
+            }
+            pool.reset();
+        }
+        log.info("Index reading complete");
+        for (auto handler : handlers) handler->finish();
+        log.info("Flushing");
+        db.exec(R"(END TRANSACTION)");
+        log.info("Done");
+    }
+
+    // Decompresses a span from its access point, indexing the lines that
+    // start in it, and returns their keys for each handler.
+    std::vector<IndexKeys> indexSpan(const RandomAccessFile &file,
+                                     const Span &span) const {
+        auto &ap = span.accessPoint;
+        std::unique_ptr<Decompressor> reader;
+        if (codec)
+            reader = codec->decompressorAt(file, ap.compressedOffset,
+                                           ap.bitOffset);
+        else
+            reader.reset(new AccessPointReader(file, ap.compressedOffset,
+                                               ap.bitOffset, windowCodec,
+                                               ap.window));
+        reader->skip(span.firstOffset - ap.uncompressedOffset);
+
+        struct SpanSink : LineSink {
+            const Impl &builder;
+            uint64_t endOffset;
+            bool finished = false;
+            std::vector<IndexKeys> keys;
+
+            SpanSink(const Impl &builder, uint64_t endOffset)
+                    : builder(builder), endOffset(endOffset),
+                      keys(builder.handlers.size()) { }
+
+            void onLine(size_t lineNumber, size_t fileOffset,
+                        const char *line, size_t length) override {
+                if (fileOffset > endOffset) {
+                    finished = true;
+                    return;
+                }
+                if (lineNumber <= builder.skipFirst) return;
+                for (size_t i = 0; i < builder.handlers.size(); ++i)
+                    builder.handlers[i]->index(lineNumber, line, length,
+                                               keys[i]);
+            }
+        } sink(*this, ap.uncompressedEndOffset);
+        LineFinder lineFinder(sink, span.firstLine, span.firstOffset);
+        std::vector<uint8_t> buffer(MinRegionRead);
+        while (!sink.finished) {
+            auto numRead = reader->read(&buffer[0], buffer.size());
+            lineFinder.add(buffer.data(), numRead, numRead == 0);
+            if (numRead == 0) break;
+        }
+        return std::move(sink.keys);
+    }
+
+    void createLineTables() {
+        if (codec && rewritePath.empty())
+            addMeta("compression", codec->name());
+        addMeta("windowCodec", windowCodecName(windowCodec));
+        if (restartEvery)
+            addMeta("restartEvery", std::to_string(restartEvery));
+        if (sparseLines) {
+            addMeta("lineOffsets", "sparse");
+            addMeta("sampleLinesEvery", std::to_string(sampleLinesEvery));
+            db.exec(R"(
+CREATE TABLE LineSamples(
+    line INTEGER PRIMARY KEY,
+    offset INTEGER
+))");
+        } else {
+            db.exec(R"(
+CREATE TABLE LineOffsets(
+    line INTEGER PRIMARY KEY,
+    offset INTEGER,
+    length INTEGER
+))");
+        }
+    }
+
+    // The compressed file opened again, to be read from anywhere.
+    std::unique_ptr<RandomAccessFile> randomAccessCompressed() const {
+        auto fd = dup(fileno(from.get()));
+        File file(fd == -1 ? nullptr : fdopen(fd, "rb"));
+        if (!file) {
+            if (fd != -1) ::close(fd);
+            throw std::runtime_error("Unable to reopen compressed file");
+        }
+        return std::unique_ptr<RandomAccessFile>(
+                new RandomAccessFile(std::move(file)));
+    }
+
+    // BGZF files' members are decompressed in parallel a range at a time,
+    // each member start a checkpoint. So are those of other gzip files of
+    // several members (unless inflating speculatively, which handles them
+    // anyway), found by their headers, with checkpoints every indexEvery
+    // bytes within members too. Returns false, having done nothing, for other
+    // files (or without a thread pool).
+    bool decompressMembers(const struct stat &compressedStat) {
+        if (!pool || appending) return false;
+        auto file = randomAccessCompressed();
+        auto members = findBgzfMembers(*file);
+        if (!members.empty()) {
+            log.info("Indexing ", members.size(), " BGZF members in parallel");
+            decompressRanges(compressedStat, members,
+                             [&file](const Frame *first, const Frame *last) {
+                                 return inflateMembers(*file, first, last);
+                             });
+            return true;
+        }
+        if (speculativePieceBytes) return false;
+        members = findGzipMembers(*file);
+        if (members.empty()) return false;
+        log.info("Indexing up to ", members.size(),
+                 " gzip members in parallel");
+        decompressRanges(
+                compressedStat, members,
+                [this, &file](const Frame *first, const Frame *last) {
+                    return inflateGzipMembers(*file, first, last, windowCodec,
+                                              indexEvery);
+                });
+        return true;
+    }
+
+    // Files in formats other than gzip are decompressed likewise (in
+    // parallel given a thread pool), each frame start a checkpoint. The
+    // other checkpoint criteria don't apply.
+    void decompressWithCodec(const struct stat &compressedStat) {
+        auto file = randomAccessCompressed();
+        auto frames = codec->findFrames(*file);
+        log.info("Indexing ", frames.size(), " ", codec->name(), " frames");
+        auto &frameCodec = *codec;
+        decompressRanges(
+                compressedStat, frames,
+                [&file, &frameCodec](const Frame *first, const Frame *last) {
+                    return decompressFrames(frameCodec, *file, first, last);
+                });
+    }
+
+    using RangeDecompressor = std::function<DecompressedRange(
+            const Frame *, const Frame *)>;
+    // Decompresses the frames (with decompress) a range at a time, on the
+    // thread pool if there is one. The ranges are then passed through the
+    // line finder in order, which numbers the lines.
+    //
+    // A range normally starts where the one before ended, but gzip members
+    // may run on past frames that only seemed to start one: a range starting
+    // within what came before is then decompressed again from where that
+    // ended (if it has any more), whatever came of it, failure included.
+    // Once a range ends short, as no member followed, the rest are ignored.
+    void decompressRanges(const struct stat &compressedStat,
+                          const std::vector<Frame> &frames,
+                          const RangeDecompressor &decompress) {
+        lineFinder.reset(new LineFinder(*this));
+        std::unique_ptr<AccessPoint> accessPoint;
+        uint64_t totalIn = 0;
+        uint64_t totalOut = 0;
+        time_t nextProgress = 0;
+        auto consumedTo = frames.empty() ? 0 : frames[0].offset;
+        bool finished = false;
+        auto consume = [&](DecompressedRange range) {
+            for (auto &ap : range.accessPoints) {
+                ap.uncompressedOffset += totalOut;
+                if (accessPoint) {
+                    accessPoint->uncompressedEndOffset =
+                            ap.uncompressedOffset - 1;
+                    flushAccessPoint(*accessPoint, std::chrono::microseconds(
+                            accessPoint->decompressMicros));
+                }
+                if (sparseLines)
+                    unsampledCheckpoints.push_back(ap.uncompressedOffset);
+                accessPoint.reset(new AccessPoint(std::move(ap)));
+                ++numCheckpoints;
+            }
+            lineFinder->add(range.data.data(), range.data.size(), false);
+            totalOut += range.data.size();
+            totalIn = range.compressedEnd;
+            auto now = time(nullptr);
+            if (now >= nextProgress) {
+                log.info("Progress: ", PrettyBytes(totalIn), " of ",
+                         PrettyBytes(compressedStat.st_size));
+                nextProgress = now + LogProgressEverySecs;
+            }
+        };
+        auto take = [&](const Frame *first, const Frame *last,
+                        const std::function<DecompressedRange()> &result) {
+            auto rangeEnd = last[-1].offset + last[-1].size;
+            if (finished || consumedTo >= rangeEnd) return;
+            DecompressedRange range;
+            if (first->offset < consumedTo) {
+                Frame rest{consumedTo, rangeEnd - consumedTo, 0};
+                range = decompress(&rest, &rest + 1);
+            } else {
+                range = result();
+            }
+            finished = range.compressedEnd < rangeEnd;
+            consumedTo = range.compressedEnd;
+            consume(std::move(range));
+        };
+        struct Range {
+            const Frame *first;
+            const Frame *last;
+            std::future<DecompressedRange> result;
+        };
+        std::deque<Range> inFlight;
+        auto consumeNext = [&]() {
+            // Off the queue first: a spent future can't be waited for.
+            auto next = std::move(inFlight.front());
+            inFlight.pop_front();
+            // Even if it's not to be used: it refers to the frames.
+            next.result.wait();
+            take(next.first, next.last, [&next]() {
+                return next.result.get();
+            });
+        };
+        try {
+            for (size_t begin = 0; begin < frames.size();) {
+                auto end = begin;
+                uint64_t rangeBytes = 0;
+                while (end < frames.size() && rangeBytes < MemberRangeBytes)
+                    rangeBytes += frames[end++].size;
+                auto first = &frames[begin];
+                auto last = &frames[end];
+                begin = end;
+                if (!pool) {
+                    take(first, last, [&]() {
+                        return decompress(first, last);
+                    });
+                    continue;
+                }
+                if (inFlight.size() >= RangesInFlightPerThread * pool->size())
+                    consumeNext();
+                inFlight.push_back(Range{
+                        first, last, pool->submit([&decompress, first, last]() {
+                            return decompress(first, last);
+                        })});
+            }
+            while (!inFlight.empty()) consumeNext();
+        } catch (...) {
+            // The ranges refer to the frames, so must finish before we leave.
+            for (auto &range : inFlight) range.result.wait();
+            throw;
+        }
+        if (accessPoint) {
+            accessPoint->uncompressedEndOffset = totalOut - 1;
+            flushAccessPoint(*accessPoint, std::chrono::microseconds(
+                    accessPoint->decompressMicros));
+        }
+        lineFinder->add(nullptr, 0, true);
+        log.info("Created ", numCheckpoints, " checkpoints; the slowest access "
+                "point takes ", slowestCheckpointMicros / 1000.0,
+                 "ms to decompress");
+    }
+
+    // Rewrites the file as BGZF (compressing on the thread pool, if there is
+    // one) while indexing it, and indexes the new file instead: each member
+    // starts a checkpoint needing no window.
+    void rewriteAsBgzf() {
+        auto file = randomAccessCompressed();
+        std::unique_ptr<Decompressor> input;
+        if (codec) {
+            auto frames = codec->findFrames(*file);
+            if (!frames.empty())
+                input = codec->decompressorAt(*file, frames[0].offset,
+                                              frames[0].bitOffset);
+        } else {
+            input.reset(new AccessPointReader(*file));
+        }
+        struct stat fromStats, outStats;
+        if (fstat(fileno(from.get()), &fromStats) == 0
+            && stat(rewritePath.c_str(), &outStats) == 0
+            && fromStats.st_dev == outStats.st_dev
+            && fromStats.st_ino == outStats.st_ino)
+            throw std::runtime_error("Can't rewrite a file over itself");
+        File out(fopen(rewritePath.c_str(), "wb"));
+        if (!out)
+            throw std::runtime_error("Unable to open " + rewritePath
+                                     + " for writing");
+        log.info("Rewriting as BGZF to ", rewritePath);
+        lineFinder.reset(new LineFinder(*this));
+        std::unique_ptr<AccessPoint> accessPoint;
+        uint64_t totalOut = 0;
+        uint64_t written = 0;
+        uint64_t numMembers = 0;
+        time_t nextProgress = 0;
+        auto write = [&](const std::vector<uint8_t> &compressed) {
+            if (fwrite(compressed.data(), 1, compressed.size(), out.get())
+                != compressed.size())
+                throw std::runtime_error("Unable to write to "
+                                         + rewritePath);
+        };
+        auto consume = [&](BgzfPiece piece) {
+            write(piece.compressed);
+            for (auto &ap : piece.range.accessPoints) {
+                ap.uncompressedOffset += totalOut;
+                ap.compressedOffset += written;
+                if (accessPoint) {
+                    accessPoint->uncompressedEndOffset =
+                            ap.uncompressedOffset - 1;
+                    flushAccessPoint(*accessPoint, {});
+                }
+                if (sparseLines)
+                    unsampledCheckpoints.push_back(ap.uncompressedOffset);
+                accessPoint.reset(new AccessPoint(std::move(ap)));
+                ++numCheckpoints;
+                ++numMembers;
+            }
+            lineFinder->add(piece.range.data.data(), piece.range.data.size(),
+                            false);
+            totalOut += piece.range.data.size();
+            written += piece.compressed.size();
+            auto now = time(nullptr);
+            if (now >= nextProgress) {
+                log.info("Progress: ", PrettyBytes(totalOut),
+                         " decompressed, ", PrettyBytes(written), " written");
+                nextProgress = now + LogProgressEverySecs;
+            }
+        };
+        std::deque<std::future<BgzfPiece>> inFlight;
+        auto consumeNext = [&]() {
+            auto next = std::move(inFlight.front());
+            inFlight.pop_front();
+            consume(next.get());
+        };
+        try {
+            for (;;) {
+                std::vector<uint8_t> data(
+                        input ? RewriteMembersPerPiece * BgzfMemberData : 0);
+                if (input) data.resize(input->read(&data[0], data.size()));
+                if (data.empty()) break;
+                if (!pool) {
+                    consume(compressBgzf(std::move(data)));
+                    continue;
+                }
+                if (inFlight.size() >= RangesInFlightPerThread * pool->size())
+                    consumeNext();
+                auto shared = std::make_shared<std::vector<uint8_t>>(
+                        std::move(data));
+                inFlight.push_back(pool->submit([shared]() {
+                    return compressBgzf(std::move(*shared));
+                }));
+            }
+            while (!inFlight.empty()) consumeNext();
+        } catch (...) {
+            for (auto &piece : inFlight) piece.wait();
+            throw;
+        }
+        // BGZF ends with an empty member.
+        std::vector<uint8_t> end;
+        DeflateStream ds;
+        appendBgzfMember(ds, nullptr, 0, end);
+        write(end);
+        if (accessPoint) {
+            accessPoint->uncompressedEndOffset = totalOut - 1;
+            flushAccessPoint(*accessPoint, {});
+        }
+        lineFinder->add(nullptr, 0, true);
+
+        if (fflush(out.get()) != 0 || fstat(fileno(out.get()), &outStats) != 0)
+            throw std::runtime_error("Unable to write to " + rewritePath);
+        addMeta("compressedFile", rewritePath);
+        addMeta("compressedSize", std::to_string(outStats.st_size));
+        addMeta("compressedModTime", std::to_string(outStats.st_mtime));
+        log.info("Wrote ", numMembers, " BGZF members (",
+                 PrettyBytes(outStats.st_size), ")");
+    }
+
+    // Experimentally, a single gzip stream can be inflated in parallel too.
+    // The file is split into pieces, each inflated from the first block
+    // that seems to start in it without knowing the window before, which is
+    // filled in once the piece before is done. Where a guess turns out
+    // wrong, that piece is inflated again from where the last one stopped.
+    // Checkpoints are placed at block boundaries every indexEvery bytes (the
+    // other criteria don't apply) and at each member start. Returns false,
+    // having done nothing, unless asked to with a thread pool and the file's
+    // gzip and can be mapped.
+    bool inflateSpeculatively(const struct stat &compressedStat) {
+        if (!speculativePieceBytes || !pool || appending) return false;
+        auto file = randomAccessCompressed();
+        if (!file->mapped() || file->size() < 2) return false;
+        const uint8_t *data;
+        auto size = file->size();
+        file->read(0, size, nullptr, data);
+        if (data[0] != 0x1f || data[1] != 0x8b) return false;
+        auto firstBit = gzipDataStart(data, size, 0);
+        auto pieceBits = speculativePieceBytes * 8;
+        auto numPieces = (size * 8 - firstBit + pieceBits - 1) / pieceBits;
+        log.info("Inflating ", numPieces, " pieces speculatively");
+        auto pieceStart = [&](uint64_t piece) {
+            return std::min(firstBit + piece * pieceBits, size * 8);
+        };
+
+        lineFinder.reset(new LineFinder(*this));
+        // The window before the next piece, and where that piece starts.
+        std::vector<uint8_t> window(WindowSize);
+        uint64_t position = firstBit;
+        bool finished = false;
+        std::unique_ptr<AccessPoint> accessPoint;
+        double accessPointMicros = 0;
+        uint64_t totalOut = 0;
+        uint64_t last = 0;
+        auto crc = crc32(0, nullptr, 0);
+        uint64_t memberSize = 0;
+        time_t nextProgress = 0;
+        uint8_t apWindow[WindowSize];
+        auto consume = [&](const InflatedPiece &piece, double micros) {
+            auto &bytes = piece.data;
+            auto microsPerByte = bytes.empty() ? 0 : micros / bytes.size();
+            uint64_t costedTo = 0;
+            for (auto &boundary : piece.boundaries) {
+                auto offset = totalOut + boundary.offset;
+                accessPointMicros += (boundary.offset - costedTo)
+                                     * microsPerByte;
+                costedTo = boundary.offset;
+                if (!boundary.memberStart
+                    && !(indexEvery && offset - last > indexEvery))
+                    continue;
+                // After an empty member, the access point at its start is
+                // replaced by this one.
+                if (!accessPoint || accessPoint->uncompressedOffset != offset) {
+                    if (accessPoint) {
+                        accessPoint->uncompressedEndOffset = offset - 1;
+                        flushAccessPoint(*accessPoint,
+                                         std::chrono::microseconds(
+                                                 static_cast<uint64_t>(
+                                                         accessPointMicros)));
+                    }
+                    if (sparseLines) unsampledCheckpoints.push_back(offset);
+                    ++numCheckpoints;
+                }
+                accessPointMicros = 0;
+                accessPoint.reset(new AccessPoint);
+                accessPoint->uncompressedOffset = offset;
+                accessPoint->compressedOffset = (boundary.bit + 7) / 8;
+                accessPoint->bitOffset = (8 - boundary.bit % 8) % 8;
+                if (!boundary.memberStart) {
+                    auto inPiece = boundary.offset;
+                    if (inPiece >= WindowSize) {
+                        memcpy(apWindow, &bytes[inPiece - WindowSize],
+                               WindowSize);
+                    } else {
+                        memcpy(apWindow, &window[inPiece],
+                               WindowSize - inPiece);
+                        memcpy(apWindow + WindowSize - inPiece, bytes.data(),
+                               inPiece);
+                    }
+                    accessPoint->window = encodeWindow(windowCodec, apWindow,
+                                                       WindowSize);
+                }
+                last = offset;
+            }
+            accessPointMicros += (bytes.size() - costedTo) * microsPerByte;
+
+            uint64_t crcFrom = 0;
+            auto addToCrc = [&](uint64_t to) {
+                // (Given no data at all, crc32() would start again.)
+                if (to > crcFrom)
+                    crc = crc32(crc, bytes.data() + crcFrom,
+                                static_cast<uInt>(to - crcFrom));
+                memberSize += to - crcFrom;
+                crcFrom = to;
+            };
+            for (auto &end : piece.memberEnds) {
+                addToCrc(end.offset);
+                if (crc != end.crc
+                    || static_cast<uint32_t>(memberSize) != end.size)
+                    throw DeflateError("Inflated data doesn't match its "
+                                       "gzip trailer");
+                crc = crc32(0, nullptr, 0);
+                memberSize = 0;
+            }
+            addToCrc(bytes.size());
+
+            lineFinder->add(bytes.data(), bytes.size(), false);
+            totalOut += bytes.size();
+            if (bytes.size() >= WindowSize) {
+                memcpy(window.data(), &bytes[bytes.size() - WindowSize],
+                       WindowSize);
+            } else {
+                memmove(window.data(), &window[bytes.size()],
+                        WindowSize - bytes.size());
+                memcpy(&window[WindowSize - bytes.size()], bytes.data(),
+                       bytes.size());
+            }
+            position = piece.endBit;
+            finished = piece.finished;
+            auto now = time(nullptr);
+            if (now >= nextProgress) {
+                log.info("Progress: ", PrettyBytes(position / 8), " of ",
+                         PrettyBytes(compressedStat.st_size));
+                nextProgress = now + LogProgressEverySecs;
+            }
+        };
+        using Clock = std::chrono::steady_clock;
+        auto inflateSerially = [&](uint64_t stopBit) {
+            auto startTime = Clock::now();
+            auto piece = inflatePiece(data, size, position, stopBit,
+                                      window.data(), position == firstBit);
+            consume(piece, std::chrono::duration<double, std::micro>(
+                    Clock::now() - startTime).count());
+        };
+
+        // What each piece's worker found: nothing, if no block seemed to
+        // start in it.
+        struct Guess {
+            bool found;
+            InflatedPiece piece;
+            double micros;
+        };
+        std::deque<std::future<Guess>> inFlight;
+        uint64_t numGuessesUsed = 0;
+        auto consumeNext = [&](uint64_t piece) {
+            // Off the queue first: a spent future can't be waited for.
+            auto next = std::move(inFlight.front());
+            inFlight.pop_front();
+            auto guess = next.get();
+            if (finished) return;
+            auto &guessed = guess.piece;
+            if (guess.found && guessed.startBit > position)
+                inflateSerially(guessed.startBit);
+            if (finished) return;
+            if (guess.found && guessed.startBit == position) {
+                resolvePiece(guessed, window.data());
+                consume(guessed, guess.micros);
+                ++numGuessesUsed;
+            } else if (position < pieceStart(piece + 1)) {
+                log.debug("Inflating piece ", piece, " again serially");
+                inflateSerially(pieceStart(piece + 1));
+            }
+        };
+        try {
+            uint64_t consumed = 0;
+            for (uint64_t piece = 0; piece < numPieces; ++piece) {
+                if (inFlight.size() >= RangesInFlightPerThread * pool->size())
+                    consumeNext(consumed++);
+                auto from = pieceStart(piece);
+                auto to = pieceStart(piece + 1);
+                inFlight.emplace_back(pool->submit(
+                        [data, size, firstBit, from, to]() {
+                            auto startTime = Clock::now();
+                            Guess guess;
+                            guess.found = false;
+                            // The first piece's start is known, and has no
+                            // window before it.
+                            bool known = from == firstBit;
+                            for (auto start = from;; ++start) {
+                                if (!known)
+                                    start = findBlockStart(data, size, start,
+                                                           to);
+                                if (start == to) break;
+                                try {
+                                    guess.piece = inflatePiece(
+                                            data, size, start, to, nullptr,
+                                            known);
+                                    guess.found = true;
+                                    break;
+                                } catch (const DeflateError &) {
+                                    if (known) throw;
+                                }
+                            }
+                            guess.micros = std::chrono::duration<
+                                    double, std::micro>(
+                                    Clock::now() - startTime).count();
+                            return guess;
+                        }));
+            }
+            while (!inFlight.empty()) consumeNext(consumed++);
+        } catch (...) {
+            // The pieces refer to the mapped file, so must finish before we
+            // leave.
+            for (auto &piece : inFlight) piece.wait();
+            throw;
+        }
+        if (!finished) throw DeflateError("Unexpected end of gzip data");
+        // (Unless it's at the start of an empty member at the very end.)
+        if (accessPoint && accessPoint->uncompressedOffset < totalOut) {
+            accessPoint->uncompressedEndOffset = totalOut - 1;
+            flushAccessPoint(*accessPoint, std::chrono::microseconds(
+                    static_cast<uint64_t>(accessPointMicros)));
+        }
+        lineFinder->add(nullptr, 0, true);
+        log.info("Used ", numGuessesUsed, " of ", numPieces,
+                 " speculatively inflated pieces");
+        log.info("Created ", numCheckpoints, " checkpoints; the slowest access "
+                "point takes ", slowestCheckpointMicros / 1000.0,
+                 "ms to decompress");
+        return true;
+    }
+
+    void decompress(const struct stat &compressedStat) {
+        bool raw = resumeFrom != nullptr;
+        ZStream zs(raw ? ZStream::Type::Raw : ZStream::Type::ZlibOrGzip);
         uint8_t input[ChunkSize];
         uint8_t window[WindowSize];
 
@@ -430,8 +2689,56 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
         uint64_t totalIn = 0;
         uint64_t totalOut = 0;
         uint64_t last = 0;
+        uint64_t lastRestart = 0;
+        uint64_t lastCompressed = 0;
+        // Costs since the last checkpoint, or access point.
+        std::chrono::steady_clock::duration sinceLastTime{};
+        std::chrono::steady_clock::duration sinceAccessPointTime{};
+        double sinceLastKeys = 0;
+        // Checkpoints with windows, and what they've cost.
+        uint64_t numWindows = 0;
+        uint64_t storedCheckpointBytes = 0;
         bool first = true;
-        LineFinder finder(*this);
+        // Members are inflated without a dictionary, so the start of each
+        // is a checkpoint needing no window.
+        bool memberStart = !resumeFrom;
+        // Decompressed bytes to pass over before lines are looked for.
+        uint64_t skipLineData = 0;
+        std::unique_ptr<AccessPoint> accessPoint;
+        if (resumeFrom) {
+            // Carry on from the resume point's access point, which is
+            // written again once we know where it now ends.
+            auto &ap = resumeFrom->accessPoint;
+            totalIn = lastCompressed = ap.compressedOffset;
+            totalOut = last = lastRestart = ap.uncompressedOffset;
+            if (ap.bitOffset) {
+                uint8_t c;
+                if (pread(fileno(from.get()), &c, 1, totalIn - 1) != 1)
+                    throw ZlibError(Z_ERRNO);
+                X(inflatePrime(&zs.stream, ap.bitOffset,
+                               c >> (8 - ap.bitOffset)));
+            }
+            auto decoded = decodeWindow(windowCodec, ap.window, window,
+                                        WindowSize);
+            if (decoded != window) memcpy(window, decoded, WindowSize);
+            X(inflateSetDictionary(&zs.stream, window, WindowSize));
+            if (fseeko(from.get(), totalIn, SEEK_SET) != 0)
+                throw ZlibError(Z_ERRNO);
+            accessPoint.reset(new AccessPoint(ap));
+            skipLineData = resumeFrom->offset - totalOut;
+            lineFinder.reset(new LineFinder(*this, resumeFrom->line,
+                                            resumeFrom->offset));
+        } else {
+            lineFinder.reset(new LineFinder(*this));
+        }
+        auto addLines = [this, &skipLineData](const uint8_t *data,
+                                              uint64_t length, bool last) {
+            auto skipped = std::min(length, skipLineData);
+            skipLineData -= skipped;
+            lineFinder->add(data + skipped, length - skipped, last);
+        };
+        // Restart points read ahead of us to see what they need.
+        if (restartEvery) restartFile = randomAccessCompressed();
 
         log.info("Indexing...");
         do {
@@ -446,47 +2753,110 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
                     zs.stream.avail_out = WindowSize;
                     zs.stream.next_out = window;
                     if (!first) {
-                        finder.add(window, WindowSize, false);
+                        addLines(window, WindowSize, false);
                     }
                     first = false;
                 }
                 totalIn += zs.stream.avail_in;
                 totalOut += zs.stream.avail_out;
+                auto outBefore = zs.stream.avail_out;
+                auto startTime = std::chrono::steady_clock::now();
                 ret = inflate(&zs.stream, Z_BLOCK);
+                auto inflateTime = std::chrono::steady_clock::now()
+                                   - startTime;
+                sinceLastTime += inflateTime;
+                sinceAccessPointTime += inflateTime;
+                sinceLastKeys += (outBefore - zs.stream.avail_out)
+                                 * keysPerByte.load();
                 totalIn -= zs.stream.avail_in;
                 totalOut -= zs.stream.avail_out;
                 if (ret == Z_NEED_DICT)
                     throw ZlibError(Z_DATA_ERROR);
                 if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                     throw ZlibError(ret);
-                if (ret == Z_STREAM_END)
+                if (ret == Z_STREAM_END) {
+                    // Carry on with the next gzip member, if any.
+                    auto next = totalIn;
+                    if (!nextMember(fileno(from.get()), next, raw)) break;
+                    X(inflateReset2(&zs.stream, static_cast<int>(
+                            ZStream::Type::ZlibOrGzip)));
+                    raw = false;
+                    totalIn = next;
+                    if (fseeko(from.get(), totalIn, SEEK_SET) != 0)
+                        throw ZlibError(Z_ERRNO);
+                    zs.stream.avail_in = 0;
+                    ret = Z_OK;
+                    memberStart = true;
                     break;
-                auto sinceLast = totalOut - last;
-                bool needsIndex = sinceLast > indexEvery || totalOut == 0;
+                }
+                bool needsIndex = memberStart
+                        || (indexEvery && totalOut - last > indexEvery)
+                        || (indexEverySeconds > 0
+                            && std::chrono::duration<double>(
+                                sinceLastTime).count() > indexEverySeconds)
+                        || (indexEveryKeys && sinceLastKeys >= indexEveryKeys)
+                        || (checkpointBudget
+                            && totalIn - lastCompressed > budgetSpacing(
+                                compressedStat.st_size, numWindows
+                                ? storedCheckpointBytes / numWindows
+                                : guessWindowBytes(totalIn, totalOut)));
+                bool needsRestart = restartEvery
+                                    && totalOut - lastRestart > restartEvery;
                 bool endOfBlock = zs.stream.data_type & 0x80;
                 bool lastBlockInStream = zs.stream.data_type & 0x40;
-                if (endOfBlock && !lastBlockInStream && needsIndex) {
-                    log.debug("Creating checkpoint at ", PrettyBytes(totalOut),
+                if (endOfBlock && !lastBlockInStream
+                    && (needsIndex || needsRestart)) {
+                    log.debug("Creating ", needsIndex ? "checkpoint" : "restart"
+                              " point", " at ", PrettyBytes(totalOut),
                               " (compressed offset ", PrettyBytes(totalIn),
                               ")");
-                    if (totalOut != 0) {
-                        // Flush previous information.
-                        addIndex
-                                .bindInt64(":uncompressedEndOffset",
-                                           totalOut - 1)
-                                .step();
-                        addIndex.reset();
+                    // After an empty member, the access point at its start
+                    // is replaced by this one.
+                    if (!accessPoint
+                        || accessPoint->uncompressedOffset != totalOut) {
+                        if (accessPoint) {
+                            // Flush previous information.
+                            accessPoint->uncompressedEndOffset = totalOut - 1;
+                            flushAccessPoint(*accessPoint,
+                                             sinceAccessPointTime);
+                        }
+                        if (sparseLines)
+                            unsampledCheckpoints.push_back(totalOut);
+                    }
+                    sinceAccessPointTime = {};
+                    accessPoint.reset(new AccessPoint);
+                    auto bitOffset = zs.stream.data_type & 0x7;
+                    if (!memberStart) {
+                        uint8_t apWindow[WindowSize];
+                        unwrapWindow(window, zs.stream.avail_out, apWindow);
+                        // Restart points between checkpoints store only as
+                        // much of their window as is needed.
+                        if (!needsIndex
+                            && !maskWindow(*restartFile, totalIn, bitOffset,
+                                           apWindow))
+                            log.debug("Unable to mask window at ",
+                                      PrettyBytes(totalOut));
+                        accessPoint->window = encodeWindow(
+                                windowCodec, apWindow, WindowSize);
                     }
-                    uint8_t apWindow[compressBound(WindowSize)];
-                    auto size = makeWindow(apWindow, sizeof(apWindow), window,
-                                           zs.stream.avail_out);
-                    addIndex
-                            .bindInt64(":uncompressedOffset", totalOut)
-                            .bindInt64(":compressedOffset", totalIn)
-                            .bindInt64(":bitOffset", zs.stream.data_type & 0x7)
-                            .bindBlob(":window", apWindow, size);
-                    last = totalOut;
+                    accessPoint->uncompressedOffset = totalOut;
+                    accessPoint->compressedOffset = totalIn;
+                    accessPoint->bitOffset = bitOffset;
+                    if (needsIndex) {
+                        last = totalOut;
+                        lastCompressed = totalIn;
+                        sinceLastTime = {};
+                        sinceLastKeys = 0;
+                        ++numCheckpoints;
+                        if (!memberStart) {
+                            ++numWindows;
+                            storedCheckpointBytes += accessPoint->window.size()
+                                                     + CheckpointRowBytes;
+                        }
+                    }
+                    lastRestart = totalOut;
                 }
+                if (endOfBlock) memberStart = false;
                 auto now = time(nullptr);
                 if (now >= nextProgress) {
                     char pc[16];
@@ -500,30 +2870,159 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
             } while (zs.stream.avail_in);
         } while (ret != Z_STREAM_END);
 
-        if (totalOut != 0) {
+        // (Unless it's at the start of an empty member at the very end.)
+        if (accessPoint && accessPoint->uncompressedOffset < totalOut) {
             // Flush last block.
-            addIndex
-                    .bindInt64(":uncompressedEndOffset", totalOut - 1)
-                    .step();
+            accessPoint->uncompressedEndOffset = totalOut - 1;
+            flushAccessPoint(*accessPoint, sinceAccessPointTime);
         }
+        log.info("Created ", numCheckpoints, " checkpoints; the slowest access "
+                "point takes ", slowestCheckpointMicros / 1000.0,
+                 "ms to decompress");
 
-        log.info("Index reading complete");
+        addLines(window, WindowSize - zs.stream.avail_out, true);
+    }
 
-        finder.add(window, WindowSize - zs.stream.avail_out, true);
-        const auto &lineOffsets = finder.lineOffsets();
-        for (size_t line = 0; line < lineOffsets.size() - 1; ++line) {
-            addLine
+    std::shared_ptr<LineBatch> newBatch() const {
+        std::shared_ptr<LineBatch> result(new LineBatch);
+        result->keys.resize(handlers.size());
+        return result;
+    }
+
+    void flushAccessPoint(AccessPoint &accessPoint,
+                          std::chrono::steady_clock::duration cost) {
+        accessPoint.decompressMicros = std::chrono::duration_cast<
+                std::chrono::microseconds>(cost).count();
+        slowestCheckpointMicros = std::max(slowestCheckpointMicros,
+                                           accessPoint.decompressMicros);
+        batch->accessPoints.emplace_back(std::move(accessPoint));
+    }
+
+    // How far apart (in compressed bytes) to place checkpoints to fit the
+    // checkpoint budget, given their average size so far.
+    uint64_t budgetSpacing(uint64_t compressedSize,
+                           uint64_t bytesPerCheckpoint) const {
+        auto numAllowed = std::max<uint64_t>(
+                checkpointBudget / std::max<uint64_t>(bytesPerCheckpoint, 1),
+                1);
+        return compressedSize / numAllowed;
+    }
+
+    // Until a window's been stored, guess it'll compress as well as the data
+    // has so far.
+    uint64_t guessWindowBytes(uint64_t totalIn, uint64_t totalOut) const {
+        if (windowCodec == WindowCodec::Raw || totalOut == 0)
+            return WindowSize + CheckpointRowBytes;
+        return WindowSize * totalIn / totalOut + CheckpointRowBytes;
+    }
+
+    void indexBatch(LineBatch &lines) {
+        for (auto &line : lines.lines) {
+            if (!line.indexed) continue;
+            for (size_t i = 0; i < handlers.size(); ++i) {
+                handlers[i]->index(line.number, &lines.text[line.begin],
+                                   line.length, lines.keys[i]);
+            }
+        }
+        if (indexEveryKeys && !lines.lines.empty()) {
+            size_t numKeys = 0;
+            for (auto &keys : lines.keys) numKeys += keys.size();
+            auto &last = lines.lines.back();
+            auto bytes = last.fileOffset + last.length
+                         - lines.lines.front().fileOffset;
+            if (bytes) keysPerByte = static_cast<double>(numKeys) / bytes;
+        }
+    }
+
+    void writeBatch(const LineBatch &lines) {
+        for (auto &ap : lines.accessPoints) {
+            addAccessPointSql
                     .reset()
-                    .bindInt64(":line", line + 1)
-                    .bindInt64(":offset", lineOffsets[line])
-                    .bindInt64(":length",
-                               lineOffsets[line + 1] - lineOffsets[line])
+                    .bindInt64(":uncompressedOffset", ap.uncompressedOffset)
+                    .bindInt64(":uncompressedEndOffset",
+                               ap.uncompressedEndOffset)
+                    .bindInt64(":compressedOffset", ap.compressedOffset)
+                    .bindInt64(":bitOffset", ap.bitOffset)
+                    .bindBlob(":window", ap.window.data(), ap.window.size())
+                    .bindInt64(":decompressMicros", ap.decompressMicros)
                     .step();
         }
+        if (sparseLines) {
+            addLineSql->insert(lines.recorded, [](
+                    Sqlite::Statement &stmt, int param,
+                    const LineBatch::Line &line) {
+                stmt
+                        .bindInt64(param, line.number)
+                        .bindInt64(param + 1, line.fileOffset);
+            });
+        } else {
+            addLineSql->insert(lines.lines, [](
+                    Sqlite::Statement &stmt, int param,
+                    const LineBatch::Line &line) {
+                stmt
+                        .bindInt64(param, line.number)
+                        .bindInt64(param + 1, line.fileOffset)
+                        .bindInt64(param + 2, line.length + 1);
+            });
+        }
+        for (size_t i = 0; i < handlers.size(); ++i)
+            handlers[i]->write(lines.keys[i]);
+    }
 
-        log.info("Flushing");
-        db.exec(R"(END TRANSACTION)");
-        log.info("Done");
+    // Hands the current batch on to be indexed and written. Without a thread
+    // pool this happens immediately; otherwise the batch is indexed by the
+    // pool and queued (in order) for the writer thread.
+    void dispatch() {
+        auto toDispatch = std::move(batch);
+        batch = newBatch();
+        if (!pool) {
+            indexBatch(*toDispatch);
+            writeBatch(*toDispatch);
+            return;
+        }
+        auto indexed = pool->submit([this, toDispatch]() {
+            indexBatch(*toDispatch);
+        });
+        std::unique_lock<std::mutex> lock(pipelineMutex);
+        pipelineChanged.wait(lock, [this]() {
+            return writerError
+                   || pipeline.size() < pool->size() * BatchesInFlightPerThread;
+        });
+        if (writerError) std::rethrow_exception(writerError);
+        pipeline.emplace_back(std::move(toDispatch), std::move(indexed));
+        pipelineChanged.notify_all();
+    }
+
+    void finishPipeline(bool discardPending) {
+        std::lock_guard<std::mutex> lock(pipelineMutex);
+        if (discardPending) pipeline.clear();
+        pipelineFinished = true;
+        pipelineChanged.notify_all();
+    }
+
+    void writeBatches() {
+        try {
+            for (; ;) {
+                std::pair<std::shared_ptr<LineBatch>, std::future<void>> next;
+                {
+                    std::unique_lock<std::mutex> lock(pipelineMutex);
+                    pipelineChanged.wait(lock, [this]() {
+                        return pipelineFinished || !pipeline.empty();
+                    });
+                    if (pipeline.empty()) return;
+                    next = std::move(pipeline.front());
+                    pipeline.pop_front();
+                    pipelineChanged.notify_all();
+                }
+                next.second.get();
+                writeBatch(*next.first);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(pipelineMutex);
+            writerError = std::current_exception();
+            pipeline.clear();
+            pipelineChanged.notify_all();
+        }
     }
 
     void addMeta(const std::string &key, const std::string &value) {
@@ -538,51 +3037,96 @@ INSERT INTO LineOffsets VALUES(:line, :offset, :length))");
     void addIndexer(const std::string &name, const std::string &creation,
                     bool numeric, bool unique,
                     std::unique_ptr<LineIndexer> indexer) {
+        // The name's part of a table name, so is kept to a safe few
+        // characters.
+        if (name.empty()
+            || name.find_first_not_of(
+                    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                    "0123456789_") != std::string::npos)
+            throw std::runtime_error(
+                    "Index name '" + name + "' should be made of letters, "
+                    "digits and underscores");
+        if (indexers.count(name))
+            throw std::runtime_error("More than one index named '" + name
+                                     + "'");
         auto table = "index_" + name;
-        std::string type = numeric ? "INTEGER" : "TEXT";
-        if (unique) type += " PRIMARY KEY";
-        db.exec(R"(
+        if (addingIndices) {
+            auto existing = db.prepare(
+                    "SELECT 1 FROM Indexes WHERE name = :name");
+            existing.bindString(":name", name);
+            if (!existing.step())
+                throw std::runtime_error("There's already an index named '"
+                                         + name + "'");
+        }
+        if (appending) {
+            auto existing = db.prepare(R"(
+SELECT creationString, isNumeric FROM Indexes WHERE name = :name)");
+            existing.bindString(":name", name);
+            if (existing.step() || existing.columnString(0) != creation
+                || (existing.columnInt64(1) != 0) != numeric)
+                throw std::runtime_error(
+                        "Index '" + name + "' wasn't built as '" + creation
+                        + "'");
+        } else {
+            std::string type = numeric ? "INTEGER" : "TEXT";
+            if (unique) type += " PRIMARY KEY";
+            db.exec(R"(
 CREATE TABLE )" + table + R"((
     key )" + type + R"(,
     line INTEGER,
     offset INTEGER
 ))");
-        addIndexSql
-                .reset()
-                .bindString(":name", name)
-                .bindString(":creationString", creation)
-                .bindInt64(":isNumeric", numeric ? 1 : 0)
-                .step();
+            addIndexSql
+                    .reset()
+                    .bindString(":name", name)
+                    .bindString(":creationString", creation)
+                    .bindInt64(":isNumeric", numeric ? 1 : 0)
+                    .step();
+        }
 
-        auto inserter = db.prepare(R"(
-INSERT INTO )" + table + R"( VALUES(:key, :line, :offset)
-)");
+        BulkInsert inserter(db, table, 3);
         if (numeric) {
             indexers.emplace(name, std::unique_ptr<IndexHandler>(
-                    new NumericHandler(log, std::move(indexer),
+                    new NumericHandler(log, name, unique, std::move(indexer),
                                        std::move(inserter))));
         } else {
             indexers.emplace(name, std::unique_ptr<IndexHandler>(
-                    new AlphaHandler(log, std::move(indexer),
+                    new AlphaHandler(log, name, unique, std::move(indexer),
                                      std::move(inserter))));
         }
     }
 
     void onLine(
             size_t lineNumber,
-            size_t /*fileOffset*/,
+            size_t fileOffset,
             const char *line, size_t length) override {
-        if (lineNumber <= skipFirst) return;
-        for (auto &&pair : indexers) {
-            pair.second->onLine(lineNumber, line, length);
+        auto begin = batch->text.size();
+        bool indexed = lineNumber > skipFirst && !handlers.empty();
+        if (indexed)
+            batch->text.insert(batch->text.end(), line, line + length);
+        batch->lines.push_back(LineBatch::Line{
+                lineNumber, fileOffset, begin, length, indexed});
+        if (sparseLines) {
+            // Sample the first line starting in each checkpoint, plus every
+            // sampleLinesEvery lines if requested.
+            bool sample = sampleLinesEvery
+                          && (lineNumber - 1) % sampleLinesEvery == 0;
+            while (!unsampledCheckpoints.empty()
+                   && fileOffset >= unsampledCheckpoints.front()) {
+                unsampledCheckpoints.pop_front();
+                sample = true;
+            }
+            if (sample) batch->recorded.push_back(batch->lines.back());
         }
+        if (batch->full()) dispatch();
     }
 };
 
 Index::Builder::Builder(Log &log, File &&from, const std::string &fromPath,
-                        const std::string &indexFilename, uint64_t skipFirst)
+                        const std::string &indexFilename, uint64_t skipFirst,
+                        Mode mode)
         : impl_(new Impl(log, std::move(from), fromPath, indexFilename,
-                         skipFirst)) {
+                         skipFirst, mode)) {
     impl_->init();
 }
 
@@ -601,6 +3145,62 @@ Index::Builder &Index::Builder::indexEvery(uint64_t bytes) {
     return *this;
 }
 
+Index::Builder &Index::Builder::sortMemory(uint64_t bytes) {
+    if (bytes == 0)
+        throw std::runtime_error("Sorting keys needs some memory");
+    impl_->sortMemory = bytes;
+    return *this;
+}
+
+Index::Builder &Index::Builder::sparseLineOffsets(uint64_t sampleEvery) {
+    impl_->sparseLines = true;
+    impl_->sampleLinesEvery = sampleEvery;
+    return *this;
+}
+
+Index::Builder &Index::Builder::indexEveryTime(double seconds) {
+    impl_->indexEverySeconds = seconds;
+    return *this;
+}
+
+Index::Builder &Index::Builder::indexEveryKeys(uint64_t keys) {
+    impl_->indexEveryKeys = keys;
+    return *this;
+}
+
+Index::Builder &Index::Builder::checkpointBudget(uint64_t bytes) {
+    impl_->checkpointBudget = bytes;
+    return *this;
+}
+
+Index::Builder &Index::Builder::restartEvery(uint64_t bytes) {
+    impl_->restartEvery = bytes;
+    return *this;
+}
+
+Index::Builder &Index::Builder::speculativeInflate(uint64_t pieceBytes) {
+    impl_->speculativePieceBytes = pieceBytes;
+    return *this;
+}
+
+Index::Builder &Index::Builder::rewriteSeekable(const std::string &path) {
+    impl_->rewritePath = path;
+    return *this;
+}
+
+Index::Builder &Index::Builder::windowCodec(WindowCodec codec) {
+    if (!windowCodecAvailable(codec))
+        throw std::runtime_error("Window codec '" + windowCodecName(codec)
+                                 + "' is not supported by this build");
+    impl_->windowCodec = codec;
+    return *this;
+}
+
+Index::Builder &Index::Builder::numThreads(size_t threads) {
+    impl_->numThreads = threads ? threads : 1;
+    return *this;
+}
+
 void Index::Builder::build() {
     impl_->build();
 }
@@ -618,24 +3218,56 @@ Index Index::load(Log &log, File &&fromCompressed,
     return Index(std::move(impl));
 }
 
+void Index::refineCheckpoints(Log &log, File &&fromCompressed,
+                              const std::string &indexFilename,
+                              uint64_t every, size_t threads) {
+    // Opening read-write would otherwise create an empty index.
+    if (access(indexFilename.c_str(), F_OK) != 0)
+        throw std::runtime_error("No index " + indexFilename + " to refine");
+    Sqlite db(log);
+    db.open(indexFilename.c_str(), false);
+
+    std::unique_ptr<Impl> impl(new Impl(log,
+                                        std::move(fromCompressed),
+                                        std::move(db)));
+    impl->init(false);
+    if (threads > 1) impl->pool_.reset(new ThreadPool(threads));
+    impl->refineCheckpoints(every);
+}
+
 void Index::getLine(uint64_t line, LineSink &sink) {
-    impl_->getLine(line, sink);
+    impl_->getLines({line}, sink, LineOrder::File);
 }
 
-void Index::getLines(const std::vector<uint64_t> &lines, LineSink &sink) {
-    for (auto line : lines) impl_->getLine(line, sink);
+void Index::getLines(const std::vector<uint64_t> &lines, LineSink &sink,
+                     LineOrder order) {
+    impl_->getLines(lines, sink, order);
 }
 
 void Index::queryIndex(const std::string &index, const std::string &query,
                        LineFunction lineFunction) {
-    impl_->queryIndex(index, query, lineFunction);
+    impl_->queryIndex(index, {query}, lineFunction);
+}
+
+void Index::queryIndex(const std::string &index, const std::string &query,
+                       LineSink &sink) {
+    queryIndexMulti(index, {query}, sink, LineOrder::File);
 }
 
 void Index::queryIndexMulti(const std::string &index,
                             const std::vector<std::string> &queries,
                             LineFunction lineFunction) {
-    // TODO be a little smarter about this.
-    for (auto query : queries) impl_->queryIndex(index, query, lineFunction);
+    impl_->queryIndex(index, queries, lineFunction);
+}
+
+void Index::queryIndexMulti(const std::string &index,
+                            const std::vector<std::string> &queries,
+                            LineSink &sink, LineOrder order) {
+    std::vector<uint64_t> lines;
+    impl_->queryIndex(index, queries, [&lines](size_t line) {
+        lines.push_back(line);
+    });
+    impl_->getLines(lines, sink, order);
 }
 
 Index::Builder::~Builder() {
@@ -645,6 +3277,28 @@ size_t Index::indexSize(const std::string &index) const {
     return impl_->indexSize(index);
 }
 
+void Index::setCacheSize(size_t bytes) {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    impl_->cache_.setCapacity(bytes);
+}
+
+double Index::estimateFetchSeconds(const std::vector<uint64_t> &lines) {
+    return impl_->estimateFetchSeconds(lines);
+}
+
+void Index::setNumThreads(size_t threads) {
+    impl_->pool_.reset(threads > 1 ? new ThreadPool(threads) : nullptr);
+}
+
+Index::CacheStats Index::cacheStats() const {
+    std::lock_guard<std::mutex> lock(impl_->mutex_);
+    CacheStats stats;
+    stats.hits = impl_->cache_.hits();
+    stats.misses = impl_->cache_.misses();
+    stats.bytes = impl_->cache_.totalCost();
+    return stats;
+}
+
 const Index::Metadata &Index::getMetadata() const {
     return impl_->metadata_;
 }
@@ -7,6 +7,7 @@
 #include <memory>
 #include <unordered_map>
 #include <functional>
+#include <string>
 
 class Log;
 
@@ -16,6 +17,8 @@ class LineIndexer;
 
 class Sqlite;
 
+enum class WindowCodec;
+
 class Index {
     struct Impl;
     std::unique_ptr<Impl> impl_;
@@ -29,24 +32,50 @@ public:
     ~Index();
 
     void getLine(uint64_t line, LineSink &sink);
-    void getLines(const std::vector<uint64_t> &lines, LineSink &sink);
+    // Lines may be fetched in file order, which lets each access point be
+    // decompressed just once for all the lines after it, or in the order
+    // requested, which buffers the lines until all are found. Lines asked
+    // for more than once are passed to the sink more than once.
+    enum class LineOrder {
+        File,
+        Requested
+    };
+    void getLines(const std::vector<uint64_t> &lines, LineSink &sink,
+                  LineOrder order = LineOrder::File);
     using LineFunction = std::function<void(size_t)>;
     LineFunction sinkFetch(LineSink &sink);
     void queryIndex(const std::string &index, const std::string &query,
                     LineFunction lineFunction);
     void queryIndex(const std::string &index, const std::string &query,
-                    LineSink &sink) {
-        queryIndex(index, query, sinkFetch(sink));
-    }
+                    LineSink &sink);
     void queryIndexMulti(const std::string &index,
                          const std::vector<std::string> &queries,
                          LineFunction lineFunction);
+    // Finds all the matching lines before fetching any, then fetches them
+    // as getLines() does.
     void queryIndexMulti(const std::string &index,
                          const std::vector<std::string> &queries,
-                         LineSink &sink) {
-        queryIndexMulti(index, queries, sinkFetch(sink));
-    }
+                         LineSink &sink, LineOrder order = LineOrder::File);
     size_t indexSize(const std::string &index) const;
+    // Estimates how long decompressing the given lines will take (ignoring
+    // the cache), from the cost of each checkpoint measured when the index
+    // was built. Returns a negative number for indices without costs.
+    double estimateFetchSeconds(const std::vector<uint64_t> &lines);
+
+    // Keep up to <bytes> of decompressed data around, by access point, so
+    // repeated and nearby lookups needn't decompress it again. Zero (the
+    // default) disables caching.
+    void setCacheSize(size_t bytes);
+    // Decompress lines from different access points on up to <threads>
+    // threads at once. Lines are still passed to sinks in order, on the
+    // calling thread.
+    void setNumThreads(size_t threads);
+    struct CacheStats {
+        size_t hits;
+        size_t misses;
+        size_t bytes;
+    };
+    CacheStats cacheStats() const;
 
     using Metadata = std::unordered_map<std::string, std::string>;
     const Metadata &getMetadata() const;
@@ -55,10 +84,68 @@ public:
         struct Impl;
         std::unique_ptr<Impl> impl_;
     public:
+        // Either build a new index (replacing any already there), add what's
+        // been appended to the file since to an existing one, or add new
+        // indices to an existing one. When appending, the same indexers must
+        // be added as when it was built, and lines and windows are stored as
+        // they were then. When adding indices, only indexers for new indices
+        // are added; the existing checkpoints and line offsets are kept, and
+        // the file is decompressed from each checkpoint (on numThreads
+        // threads) to fill the new indices alone. The checkpoint criteria
+        // don't apply. Either way, the lines skipped when it was built are
+        // skipped again: skipFirst may be left zero, but mustn't differ.
+        enum class Mode {
+            Create,
+            Append,
+            AddIndices
+        };
         Builder(Log &log, File &&from, const std::string &fromPath,
-                const std::string &indexFilename, uint64_t skipFirst);
+                const std::string &indexFilename, uint64_t skipFirst,
+                Mode mode = Mode::Create);
         ~Builder();
+        // Checkpoints are placed wherever any of these criteria say so.
+        // Every <bytes> of decompressed data (zero for no limit):
         Builder &indexEvery(uint64_t bytes);
+        // Once decompressing since the last checkpoint took <seconds>:
+        Builder &indexEveryTime(double seconds);
+        // Once around <keys> keys have been found since the last checkpoint
+        // (estimated from the most recently indexed lines), so regions dense
+        // in keys get more checkpoints:
+        Builder &indexEveryKeys(uint64_t keys);
+        // Spaced evenly through the compressed file so their windows take up
+        // around <bytes> in all:
+        Builder &checkpointBudget(uint64_t bytes);
+        // Index lines on <threads> threads; decompression and writing to
+        // the index each get a thread of their own in addition. The members
+        // of BGZF files, and of other gzip files made of several (each under
+        // 4MiB compressed, say by cat), are decompressed on them too.
+        Builder &numThreads(size_t threads);
+        // Keys for unique indices are sorted before being written, using up
+        // to around <bytes> of memory before spilling to temporary files.
+        // Each unique index gets at least 64KiB; zero isn't allowed.
+        Builder &sortMemory(uint64_t bytes);
+        // Rather than storing every line's offset, store only the first line
+        // in each checkpoint (and every <sampleEvery> lines, if non-zero).
+        // Lines are then found by counting newlines from the nearest sample.
+        Builder &sparseLineOffsets(uint64_t sampleEvery);
+        // Between checkpoints, add restart points every <bytes> or so. These
+        // are checkpoints whose windows keep only the bytes the data after
+        // them refers back to (often few), so they cost little space but
+        // let lookups start decompressing nearer to the lines they want.
+        Builder &restartEvery(uint64_t bytes);
+        // (Experimental.) With more than one thread, inflate a single gzip
+        // stream in parallel, splitting it into pieces of around <bytes>
+        // compressed each and guessing where a block starts in each. Only
+        // indexEvery places checkpoints then. Zero (the default unless this
+        // is called) disables.
+        Builder &speculativeInflate(uint64_t pieceBytes = 4 * 1024 * 1024);
+        // Rewrite the file to <path> as it's indexed, as BGZF (gzip in
+        // members of under 64KiB, which zcat reads as usual), and index that
+        // instead. Each member starts a checkpoint needing no window; the
+        // other checkpoint criteria don't apply.
+        Builder &rewriteSeekable(const std::string &path);
+        // How to store each checkpoint's window (zlib by default).
+        Builder &windowCodec(WindowCodec codec);
         Builder &addIndexer(const std::string &name,
                             const std::string &creation,
                             bool numeric,
@@ -70,4 +157,12 @@ public:
 
     static Index load(Log &log, File &&fromCompressed,
                       const std::string &indexFilename, bool forceLoad);
+
+    // Adds checkpoints to an existing index so that no more than <every>
+    // bytes of data lie between any two, without rebuilding its indices or
+    // line offsets. The spans between the existing checkpoints are
+    // decompressed on up to <threads> threads at once.
+    static void refineCheckpoints(Log &log, File &&fromCompressed,
+                                  const std::string &indexFilename,
+                                  uint64_t every, size_t threads);
 };
@@ -0,0 +1,212 @@
+#include "KeySorter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto MaxRuns = 64u;
+constexpr auto OutputBatchSize = 16384u;
+
+File tempFile() {
+    auto dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp")
+                       + "/zindex_sort_XXXXXX";
+    auto fd = mkstemp(&path[0]);
+    if (fd == -1)
+        throw std::runtime_error("Unable to create a temporary file in "
+                                 + path + ": " + strerror(errno));
+    // The file lives on only as long as we hold it open.
+    unlink(path.c_str());
+    File file(fdopen(fd, "w+b"));
+    if (!file) {
+        ::close(fd);
+        throw std::runtime_error("Unable to open temporary file");
+    }
+    return file;
+}
+
+void writeBytes(FILE *file, const void *data, size_t length) {
+    if (fwrite(data, 1, length, file) != length)
+        throw std::runtime_error(std::string("Unable to write sort run: ")
+                                 + strerror(errno));
+}
+
+bool readBytes(FILE *file, void *data, size_t length) {
+    auto read = fread(data, 1, length, file);
+    if (read == length) return true;
+    if (ferror(file) || read != 0)
+        throw std::runtime_error("Unable to read sort run");
+    return false;
+}
+
+size_t memoryFor(const IndexKey &key) {
+    return sizeof(IndexKey) + key.alpha.size();
+}
+
+}
+
+KeySorter::KeySorter(bool numeric, size_t memoryBudget)
+        : numeric_(numeric), memoryBudget_(memoryBudget), memoryUsed_(0),
+          numSpilledRuns_(0) {
+    if (memoryBudget_ == 0)
+        throw std::runtime_error("Key sorting needs some memory");
+}
+
+bool KeySorter::less(const IndexKey &lhs, const IndexKey &rhs) const {
+    if (numeric_) {
+        if (lhs.numeric != rhs.numeric) return lhs.numeric < rhs.numeric;
+    } else {
+        // std::string comparison is memcmp order, as is SQLite's BINARY
+        // collation.
+        auto cmp = lhs.alpha.compare(rhs.alpha);
+        if (cmp != 0) return cmp < 0;
+    }
+    if (lhs.line != rhs.line) return lhs.line < rhs.line;
+    return lhs.offset < rhs.offset;
+}
+
+void KeySorter::add(const IndexKeys &keys) {
+    for (auto &key : keys) {
+        keys_.push_back(key);
+        memoryUsed_ += memoryFor(key);
+        if (memoryUsed_ >= memoryBudget_) spill();
+    }
+}
+
+void KeySorter::spill() {
+    if (keys_.empty()) return;
+    std::sort(keys_.begin(), keys_.end(),
+              [this](const IndexKey &lhs, const IndexKey &rhs) {
+                  return less(lhs, rhs);
+              });
+    auto run = tempFile();
+    for (auto &key : keys_) write(run.get(), key);
+    keys_.clear();
+    keys_.shrink_to_fit();
+    memoryUsed_ = 0;
+    ++numSpilledRuns_;
+    addRun(std::move(run), 0);
+}
+
+void KeySorter::addRun(File run, size_t level) {
+    if (levels_.size() <= level) levels_.resize(level + 1);
+    levels_[level].emplace_back(std::move(run));
+    if (levels_[level].size() < MaxRuns) return;
+    // Too many runs to merge at once: combine them into one on the level
+    // above.
+    auto combined = tempFile();
+    merge(levels_[level], [this, &combined](const IndexKeys &keys) {
+        for (auto &key : keys) write(combined.get(), key);
+    });
+    levels_[level].clear();
+    addRun(std::move(combined), level + 1);
+}
+
+size_t KeySorter::numRuns() const {
+    size_t numRuns = 0;
+    for (auto &level : levels_) numRuns += level.size();
+    return numRuns;
+}
+
+void KeySorter::finish(Output output) {
+    if (levels_.empty()) {
+        std::sort(keys_.begin(), keys_.end(),
+                  [this](const IndexKey &lhs, const IndexKey &rhs) {
+                      return less(lhs, rhs);
+                  });
+        IndexKeys batch;
+        for (auto &key : keys_) {
+            batch.emplace_back(std::move(key));
+            if (batch.size() == OutputBatchSize) {
+                output(batch);
+                batch.clear();
+            }
+        }
+        if (!batch.empty()) output(batch);
+    } else {
+        spill();
+        // Combine the lowest levels (the smallest runs) until what's left
+        // can be merged at once.
+        for (size_t level = 0; numRuns() > MaxRuns; ++level) {
+            if (levels_[level].size() < 2) continue;
+            auto combined = tempFile();
+            merge(levels_[level], [this, &combined](const IndexKeys &keys) {
+                for (auto &key : keys) write(combined.get(), key);
+            });
+            levels_[level].clear();
+            addRun(std::move(combined), level + 1);
+        }
+        std::vector<File> runs;
+        for (auto &level : levels_)
+            for (auto &run : level) runs.emplace_back(std::move(run));
+        levels_.clear();
+        merge(runs, output);
+    }
+    keys_.clear();
+    memoryUsed_ = 0;
+}
+
+void KeySorter::merge(std::vector<File> &runs, Output output) {
+    struct Head {
+        IndexKey key;
+        size_t run;
+    };
+    auto greater = [this](const Head &lhs, const Head &rhs) {
+        return less(rhs.key, lhs.key);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads(
+            greater);
+    for (size_t run = 0; run < runs.size(); ++run) {
+        rewind(runs[run].get());
+        Head head;
+        head.run = run;
+        if (read(runs[run].get(), head.key)) heads.push(std::move(head));
+    }
+    IndexKeys batch;
+    while (!heads.empty()) {
+        auto head = heads.top();
+        heads.pop();
+        batch.push_back(head.key);
+        if (batch.size() == OutputBatchSize) {
+            output(batch);
+            batch.clear();
+        }
+        if (read(runs[head.run].get(), head.key)) heads.push(std::move(head));
+    }
+    if (!batch.empty()) output(batch);
+}
+
+void KeySorter::write(FILE *file, const IndexKey &key) const {
+    if (numeric_) {
+        writeBytes(file, &key.numeric, sizeof(key.numeric));
+    } else {
+        uint32_t length = key.alpha.size();
+        writeBytes(file, &length, sizeof(length));
+        writeBytes(file, key.alpha.data(), length);
+    }
+    writeBytes(file, &key.line, sizeof(key.line));
+    writeBytes(file, &key.offset, sizeof(key.offset));
+}
+
+bool KeySorter::read(FILE *file, IndexKey &key) const {
+    if (numeric_) {
+        if (!readBytes(file, &key.numeric, sizeof(key.numeric)))
+            return false;
+    } else {
+        uint32_t length;
+        if (!readBytes(file, &length, sizeof(length))) return false;
+        key.alpha.resize(length);
+        if (length && !readBytes(file, &key.alpha[0], length))
+            throw std::runtime_error("Truncated sort run");
+    }
+    if (!readBytes(file, &key.line, sizeof(key.line))
+        || !readBytes(file, &key.offset, sizeof(key.offset)))
+        throw std::runtime_error("Truncated sort run");
+    return true;
+}
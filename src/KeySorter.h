@@ -0,0 +1,60 @@
+#pragma once
+
+#include "File.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct IndexKey {
+    int64_t numeric;
+    std::string alpha;
+    uint64_t line;
+    uint64_t offset;
+};
+
+using IndexKeys = std::vector<IndexKey>;
+
+// Sorts index keys into (key, line, offset) order, using at most (roughly)
+// memoryBudget bytes of memory. Once the budget is exceeded, the keys held so
+// far are sorted and spilled to a temporary file, and all the spilled runs are
+// merged back together by finish().
+//
+// Only so many runs are merged at once. Runs are kept in levels: when a level
+// fills, its runs are merged into one run on the level above. Each key is
+// then rewritten once per level, and the levels grow only logarithmically.
+class KeySorter {
+    bool numeric_;
+    size_t memoryBudget_;
+    size_t memoryUsed_;
+    IndexKeys keys_;
+    std::vector<std::vector<File>> levels_;
+    size_t numSpilledRuns_;
+
+public:
+    KeySorter(bool numeric, size_t memoryBudget);
+
+    KeySorter(const KeySorter &) = delete;
+    KeySorter &operator=(const KeySorter &) = delete;
+
+    void add(const IndexKeys &keys);
+
+    using Output = std::function<void(const IndexKeys &)>;
+    // Passes all the keys added, in order, to output (in several calls).
+    void finish(Output output);
+
+    // How many runs have been spilled to disk, including merged ones.
+    size_t numSpilledRuns() const { return numSpilledRuns_; }
+
+    bool less(const IndexKey &lhs, const IndexKey &rhs) const;
+
+private:
+    void spill();
+    void addRun(File run, size_t level);
+    size_t numRuns() const;
+    void merge(std::vector<File> &runs, Output output);
+    void write(FILE *file, const IndexKey &key) const;
+    bool read(FILE *file, IndexKey &key) const;
+};
@@ -7,7 +7,13 @@
 #include <stdexcept>
 
 LineFinder::LineFinder(LineSink &sink)
-        : sink_(sink), currentLineOffset_(0) {
+        : sink_(sink), numLines_(0), currentLineOffset_(0) {
+}
+
+LineFinder::LineFinder(LineSink &sink, uint64_t firstLine,
+                       uint64_t firstOffset)
+        : sink_(sink), numLines_(firstLine - 1),
+          currentLineOffset_(firstOffset) {
 }
 
 void LineFinder::add(const uint8_t *data, uint64_t length, bool last) {
@@ -25,20 +31,18 @@ void LineFinder::add(const uint8_t *data, uint64_t length, bool last) {
     }
     if (last && !lineBuffer_.empty())
         lineData(nullptr, nullptr);
-    if (last)
-        lineOffsets_.emplace_back(currentLineOffset_);
 }
 
 void LineFinder::lineData(const uint8_t *begin, const uint8_t *end) {
-    lineOffsets_.emplace_back(currentLineOffset_);
+    ++numLines_;
     uint64_t length;
     if (lineBuffer_.empty()) {
-        sink_.onLine(lineOffsets_.size(), currentLineOffset_,
+        sink_.onLine(numLines_, currentLineOffset_,
                      reinterpret_cast<const char *>(begin), end - begin);
         length = (end - begin) + 1;
     } else {
         std::copy(begin, end, std::back_inserter(lineBuffer_));
-        sink_.onLine(lineOffsets_.size(), currentLineOffset_,
+        sink_.onLine(numLines_, currentLineOffset_,
                      &lineBuffer_[0], lineBuffer_.size());
         length = lineBuffer_.size() + 1;
         lineBuffer_.clear();
@@ -8,14 +8,19 @@ class LineSink;
 class LineFinder {
     LineSink &sink_;
     std::vector<char> lineBuffer_;
-    std::vector<uint64_t> lineOffsets_;
+    uint64_t numLines_;
     uint64_t currentLineOffset_;
 public:
     LineFinder(LineSink &sink);
+    // Carries on from part way through a file: the data added starts with
+    // line number firstLine, at offset firstOffset.
+    LineFinder(LineSink &sink, uint64_t firstLine, uint64_t firstOffset);
 
     void add(const uint8_t *data, uint64_t length, bool last);
 
-    const std::vector<uint64_t> &lineOffsets() const { return lineOffsets_; }
+    // Line offsets aren't kept: each is passed to the sink as it's found.
+    uint64_t numLines() const { return numLines_; }
+    uint64_t endOffset() const { return currentLineOffset_; }
 
 private:
     void lineData(const uint8_t *begin, const uint8_t *end);
@@ -11,4 +11,8 @@ public:
     virtual ~LineIndexer() { }
 
     virtual void index(IndexSink &sink, StringView line) = 0;
+
+    // Indexers which can safely index several lines concurrently may be run
+    // on many threads at once; others are serialised by the index builder.
+    virtual bool threadSafe() const { return false; }
 };
\ No newline at end of file
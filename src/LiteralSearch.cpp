@@ -0,0 +1,50 @@
+#include "LiteralSearch.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+LiteralSearch::LiteralSearch(const std::string &literal)
+        : literal_(literal) { }
+
+const char *LiteralSearch::find(const char *begin, const char *end) const {
+    auto length = literal_.size();
+    if (length == 0) return begin;
+    if (static_cast<size_t>(end - begin) < length) return nullptr;
+    auto needle = literal_.data();
+    if (length == 1)
+        return static_cast<const char *>(memchr(begin, needle[0],
+                                                end - begin));
+    // The last position the literal could start.
+    auto last = end - length;
+    auto pos = begin;
+#ifdef __SSE2__
+    auto first = _mm_set1_epi8(needle[0]);
+    auto final = _mm_set1_epi8(needle[length - 1]);
+    for (; pos + 16 <= last + 1; pos += 16) {
+        auto starts = _mm_cmpeq_epi8(
+                first, _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos)));
+        auto ends = _mm_cmpeq_epi8(
+                final, _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                        pos + length - 1)));
+        auto mask = static_cast<unsigned>(
+                _mm_movemask_epi8(_mm_and_si128(starts, ends)));
+        while (mask) {
+            auto candidate = pos + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, length - 2) == 0)
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (pos <= last) {
+        pos = static_cast<const char *>(memchr(pos, needle[0],
+                                               last - pos + 1));
+        if (!pos) return nullptr;
+        if (memcmp(pos + 1, needle + 1, length - 1) == 0) return pos;
+        ++pos;
+    }
+    return nullptr;
+}
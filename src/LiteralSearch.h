@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Finds a fixed string in text. Candidates are found 16 bytes at a time, by
+// comparing against both the string's first and last bytes with SSE2 (where
+// the build has it), and only they are compared in full.
+class LiteralSearch {
+    std::string literal_;
+
+public:
+    explicit LiteralSearch(const std::string &literal);
+
+    const std::string &literal() const { return literal_; }
+
+    // The first occurrence in [begin, end), or nullptr if there's none. An
+    // empty literal is found at begin.
+    const char *find(const char *begin, const char *end) const;
+};
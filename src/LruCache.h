@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+// A least-recently-used cache of shared values, bounded by the total "cost"
+// (typically the memory used) of the values it holds. A value's cost may
+// change while it is cached; the cache evicts as needed to stay within its
+// capacity. Evicted values live on while anyone still holds them.
+template<typename Key, typename Value>
+class LruCache {
+    using Entry = std::pair<Key, std::shared_ptr<Value>>;
+    using List = std::list<Entry>;
+
+    size_t capacity_;
+    size_t totalCost_;
+    size_t hits_;
+    size_t misses_;
+    List entries_; // most recently used first
+    std::unordered_map<Key, std::pair<typename List::iterator, size_t>> index_;
+
+public:
+    explicit LruCache(size_t capacity)
+            : capacity_(capacity), totalCost_(0), hits_(0), misses_(0) { }
+
+    size_t capacity() const { return capacity_; }
+    size_t totalCost() const { return totalCost_; }
+    size_t size() const { return index_.size(); }
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+
+    void setCapacity(size_t capacity) {
+        capacity_ = capacity;
+        evict();
+    }
+
+    // Returns the value for key (marking it most recently used), or null.
+    std::shared_ptr<Value> get(const Key &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            ++misses_;
+            return nullptr;
+        }
+        ++hits_;
+        entries_.splice(entries_.begin(), entries_, it->second.first);
+        return it->second.first->second;
+    }
+
+    void put(const Key &key, std::shared_ptr<Value> value, size_t cost) {
+        erase(key);
+        entries_.emplace_front(key, std::move(value));
+        index_.emplace(key, std::make_pair(entries_.begin(), cost));
+        totalCost_ += cost;
+        evict();
+    }
+
+    void updateCost(const Key &key, size_t cost) {
+        auto it = index_.find(key);
+        if (it == index_.end()) return;
+        totalCost_ = totalCost_ - it->second.second + cost;
+        it->second.second = cost;
+        evict();
+    }
+
+    void erase(const Key &key) {
+        auto it = index_.find(key);
+        if (it == index_.end()) return;
+        totalCost_ -= it->second.second;
+        entries_.erase(it->second.first);
+        index_.erase(it);
+    }
+
+    void clear() {
+        entries_.clear();
+        index_.clear();
+        totalCost_ = 0;
+    }
+
+private:
+    void evict() {
+        while (totalCost_ > capacity_ && !entries_.empty())
+            erase(entries_.back().first);
+    }
+};
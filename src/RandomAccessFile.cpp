@@ -0,0 +1,66 @@
+#include "RandomAccessFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+RandomAccessFile::RandomAccessFile(File &&file, bool map)
+        : file_(std::move(file)), fd_(fileno(file_.get())), size_(0),
+          mapping_(nullptr) {
+    struct stat stats;
+    if (fstat(fd_, &stats) != 0)
+        throw std::runtime_error(std::string("Unable to get file stats: ")
+                                 + strerror(errno));
+    size_ = stats.st_size;
+    if (map && size_ > 0) {
+        auto mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (mapping != MAP_FAILED) {
+            mapping_ = static_cast<const uint8_t *>(mapping);
+            // Lookups jump about the file; only read what's asked for.
+            madvise(mapping, size_, MADV_RANDOM);
+        }
+    }
+    if (!mapping_) posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
+}
+
+RandomAccessFile::~RandomAccessFile() {
+    if (mapping_) munmap(const_cast<uint8_t *>(mapping_), size_);
+}
+
+size_t RandomAccessFile::read(uint64_t offset, size_t length, uint8_t *buffer,
+                              const uint8_t *&data) const {
+    if (mapping_) {
+        if (offset >= size_) return 0;
+        data = mapping_ + offset;
+        return std::min<uint64_t>(length, size_ - offset);
+    }
+    for (; ;) {
+        auto res = ::pread(fd_, buffer, length, offset);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0)
+            throw std::runtime_error(std::string("Unable to read file: ")
+                                     + strerror(errno));
+        data = buffer;
+        return res;
+    }
+}
+
+void RandomAccessFile::willNeed(uint64_t offset, uint64_t length) const {
+    if (offset >= size_) return;
+    length = std::min(length, size_ - offset);
+    if (mapping_) {
+        // madvise() needs a page-aligned address.
+        static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        auto aligned = offset - offset % pageSize;
+        madvise(const_cast<uint8_t *>(mapping_) + aligned,
+                length + (offset - aligned), MADV_WILLNEED);
+    } else {
+        posix_fadvise(fd_, offset, length, POSIX_FADV_WILLNEED);
+    }
+}
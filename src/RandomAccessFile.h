@@ -0,0 +1,38 @@
+#pragma once
+
+#include "File.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Read-only random access to a file, without any shared file position, so it
+// may be read from several threads at once. Where possible the file is mapped
+// into memory and reads return pointers straight into the mapping; otherwise
+// (or if asked not to map) reads fall back to pread() into a caller's buffer.
+class RandomAccessFile {
+    File file_;
+    int fd_;
+    uint64_t size_;
+    const uint8_t *mapping_;
+
+public:
+    explicit RandomAccessFile(File &&file, bool map = true);
+    ~RandomAccessFile();
+
+    RandomAccessFile(const RandomAccessFile &) = delete;
+    RandomAccessFile &operator=(const RandomAccessFile &) = delete;
+
+    int fd() const { return fd_; }
+    uint64_t size() const { return size_; }
+    bool mapped() const { return mapping_ != nullptr; }
+
+    // Finds up to length bytes at offset, pointing data at them. If the file
+    // isn't mapped they're read into buffer, which must hold length bytes.
+    // Returns the number of bytes available, which is zero only at the end
+    // of the file.
+    size_t read(uint64_t offset, size_t length, uint8_t *buffer,
+                const uint8_t *&data) const;
+
+    // Hints that the given range is about to be read.
+    void willNeed(uint64_t offset, uint64_t length) const;
+};
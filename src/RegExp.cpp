@@ -1,37 +1,269 @@
+#include <algorithm>
+#include <cctype>
 #include <stdexcept>
 #include <regex.h>
+#include "LiteralSearch.h"
 #include "RegExp.h"
 
-RegExp::RegExp(const std::string &regex)
-        : RegExp(regex.c_str()) { }
+#ifdef ZINDEX_HAVE_RE2
+#include <re2/re2.h>
+#endif
 
-RegExp::RegExp(const char *regex) {
-    R(regcomp(&re_, regex, REG_EXTENDED), regex);
-    owned_ = true;
+namespace {
+
+constexpr auto MaxMatches = 20u;
+
+void check(int e, const regex_t &re, const char *context = nullptr) {
+    if (!e) return;
+    char error[1024];
+    regerror(e, &re, error, sizeof(error));
+    if (!context) throw std::runtime_error(error);
+    throw std::runtime_error(error + std::string(" in '") + context + "'");
+}
+
+// The index after the bracket expression starting at regex[i], as POSIX reads
+// it: a ] first is part of it, as are those closing [:class:] and the like.
+size_t skipBracket(const std::string &regex, size_t i) {
+    auto j = i + 1;
+    if (j < regex.size() && regex[j] == '^') ++j;
+    if (j < regex.size() && regex[j] == ']') ++j;
+    for (; j < regex.size() && regex[j] != ']'; ++j) {
+        if (regex[j] == '[' && j + 1 < regex.size()
+            && (regex[j + 1] == ':' || regex[j + 1] == '='
+                || regex[j + 1] == '.')) {
+            auto close = regex.find(std::string{regex[j + 1], ']'}, j + 2);
+            if (close == std::string::npos) return regex.size();
+            j = close + 1;
+        }
+    }
+    return j + 1;
+}
+
+// The longest run of literal characters outside any group in the regex,
+// which (without alternatives at the top level) every match contains. Sets
+// prefix if it starts the regex, when every match starts with it.
+std::string requiredLiteral(const std::string &regex, bool &prefix) {
+    std::string best, run;
+    bool runPrefix = true;
+    prefix = false;
+    auto endRun = [&]() {
+        if (run.size() > best.size()) {
+            best = run;
+            prefix = runPrefix;
+        }
+        run.clear();
+        runPrefix = false;
+    };
+    size_t depth = 0;
+    for (size_t i = 0; i < regex.size(); ++i) {
+        auto c = regex[i];
+        if (depth) {
+            if (c == '\\') ++i;
+            else if (c == '[') i = skipBracket(regex, i) - 1;
+            else if (c == '(') ++depth;
+            else if (c == ')') --depth;
+            continue;
+        }
+        switch (c) {
+            case '|':
+                return std::string();
+            case '\\':
+                if (++i == regex.size()) return std::string();
+                // Escaped letters and digits are classes, anchors or back
+                // references; as are \< and friends.
+                if (isalnum(static_cast<unsigned char>(regex[i]))
+                    || std::string("<>`'").find(regex[i])
+                       != std::string::npos)
+                    endRun();
+                else
+                    run += regex[i];
+                break;
+            case '(':
+                // RE2's flags, such as (?i), may change what matches.
+                if (i + 1 < regex.size() && regex[i + 1] == '?')
+                    return std::string();
+                endRun();
+                depth = 1;
+                break;
+            case '[':
+                endRun();
+                i = skipBracket(regex, i) - 1;
+                break;
+            case '*':
+            case '?':
+            case '+':
+            case '{':
+                // The character before needn't appear (as such) after all.
+                if (!run.empty()) run.pop_back();
+                endRun();
+                if (c == '{') {
+                    i = regex.find('}', i);
+                    if (i == std::string::npos) return std::string();
+                }
+                break;
+            case '.':
+            case '^':
+            case '$':
+            case ')':
+                endRun();
+                break;
+            default:
+                run += c;
+        }
+    }
+    endRun();
+    return best;
+}
+
+#ifdef ZINDEX_HAVE_RE2
+
+// Whether RE2 reads the regex as POSIX would. Of the escapes glibc knows, RE2
+// has only those for words and spaces (it takes \< and the like as literals);
+// and within bracket expressions a backslash is just a backslash to POSIX.
+// Most else RE2 doesn't know it rejects, so is caught then.
+bool dfaCompatible(const std::string &regex) {
+    for (size_t i = 0; i < regex.size(); ++i) {
+        if (regex[i] == '\\') {
+            if (++i == regex.size()) return false;
+            if ((isalnum(static_cast<unsigned char>(regex[i]))
+                 || std::string("<>`'").find(regex[i]) != std::string::npos)
+                && std::string("wWsSbB").find(regex[i]) == std::string::npos)
+                return false;
+        } else if (regex[i] == '[') {
+            auto end = skipBracket(regex, i);
+            auto bracket = regex.substr(i, end - i);
+            // RE2 has character classes, but no equivalence classes or
+            // collating elements.
+            if (bracket.find('\\') != std::string::npos
+                || bracket.find("[=") != std::string::npos
+                || bracket.find("[.") != std::string::npos)
+                return false;
+            i = end - 1;
+        }
+    }
+    return true;
+}
+
+// As regcomp(REG_EXTENDED): leftmost-longest, on bytes, with . matching
+// newlines and ^ and $ only at the ends.
+RE2::Options dfaOptions() {
+    RE2::Options options;
+    options.set_posix_syntax(true);
+    options.set_longest_match(true);
+    options.set_dot_nl(true);
+    options.set_encoding(RE2::Options::EncodingLatin1);
+    options.set_perl_classes(true);
+    options.set_word_boundary(true);
+    options.set_one_line(true);
+    options.set_log_errors(false);
+    return options;
+}
+
+#endif
+
+}
+
+RegExp::RegExp(const std::string &regex, Engine engine)
+        : RegExp(regex.c_str(), engine) { }
+
+RegExp::RegExp(const char *regex, Engine engine) : literalPrefix_(false) {
+    auto literal = ::requiredLiteral(regex, literalPrefix_);
+    if (!literal.empty()) literal_.reset(new LiteralSearch(literal));
+#ifdef ZINDEX_HAVE_RE2
+    if (engine == Engine::Dfa && dfaCompatible(regex)) {
+        std::shared_ptr<re2::RE2> dfa(new re2::RE2(regex, dfaOptions()));
+        if (dfa->ok()) {
+            dfa_ = std::move(dfa);
+            return;
+        }
+    }
+#else
+    static_cast<void>(engine);
+#endif
+    std::unique_ptr<regex_t> re(new regex_t);
+    check(regcomp(re.get(), regex, REG_EXTENDED), *re, regex);
+    posix_.reset(re.release(), [](regex_t *compiled) {
+        regfree(compiled);
+        delete compiled;
+    });
 }
 
-RegExp::~RegExp() {
-    release();
+RegExp::~RegExp() { }
+
+std::string RegExp::requiredLiteral() const {
+    return literal_ ? literal_->literal() : std::string();
 }
 
-void RegExp::release() {
-    if (owned_)
-        regfree(&re_);
-    owned_ = false;
+bool RegExp::exec(StringView against, RegExp::Matches &result,
+                  size_t offset) const {
+    if (!literal_) return match(against, result, offset);
+    auto found = literal_->find(against.begin() + offset, against.end());
+    if (!found) return false;
+    if (!literalPrefix_) return match(against, result, offset);
+    // No match starts before the literal does.
+    auto start = static_cast<size_t>(found - against.begin());
+    if (!match(against, result, start)) return false;
+    for (auto &match : result) {
+        match.first += start - offset;
+        match.second += start - offset;
+    }
+    return true;
 }
 
-bool RegExp::exec(const std::string &match, std::vector<Match> &result,
-                  size_t offset) {
-    return exec(match.c_str() + offset, result, offset == 0);
+bool RegExp::match(StringView against, RegExp::Matches &result,
+                   size_t offset) const {
+    // An empty view may have no data, but matches still need somewhere.
+    auto text = against.begin() ? against.begin() : "";
+#ifdef ZINDEX_HAVE_RE2
+    if (dfa_) {
+        re2::StringPiece groups[MaxMatches];
+        auto numGroups = std::min<size_t>(
+                MaxMatches, dfa_->NumberOfCapturingGroups() + 1);
+        if (!dfa_->Match(re2::StringPiece(text, against.length()), offset,
+                         against.length(), RE2::UNANCHORED, groups,
+                         numGroups))
+            return false;
+        result.clear();
+        for (size_t i = 0; i < numGroups; ++i) {
+            if (!groups[i].data()) break;
+            auto start = groups[i].data() - text - offset;
+            result.emplace_back(start, start + groups[i].size());
+        }
+        return true;
+    }
+#endif
+#ifdef REG_STARTEND
+    regmatch_t matches[MaxMatches];
+    matches[0].rm_so = offset;
+    matches[0].rm_eo = against.length();
+    auto res = regexec(posix_.get(), text, MaxMatches, matches, REG_STARTEND);
+    if (res == REG_NOMATCH) return false;
+    check(res, *posix_);
+    result.clear();
+    for (auto i = 0u; i < MaxMatches; ++i) {
+        if (matches[i].rm_so == -1) break;
+        result.emplace_back(matches[i].rm_so - offset,
+                            matches[i].rm_eo - offset);
+    }
+    return true;
+#else
+    auto copy = against.str();
+    return exec(copy.c_str() + offset, result, offset == 0);
+#endif
 }
 
-bool RegExp::exec(const char *against, RegExp::Matches &result, bool bol) {
-    constexpr auto MaxMatches = 20u;
+bool RegExp::exec(const char *against, RegExp::Matches &result,
+                  bool bol) const {
+    if (dfa_) {
+        if (bol) return exec(StringView(against), result);
+        // Something before the start stops ^ matching there.
+        return exec(StringView("\n" + std::string(against)), result, 1);
+    }
     regmatch_t matches[MaxMatches];
-    auto res = regexec(&re_, against, MaxMatches, matches,
+    auto res = regexec(posix_.get(), against, MaxMatches, matches,
                        bol ? 0 : REG_NOTBOL);
     if (res == REG_NOMATCH) return false;
-    R(res);
+    check(res, *posix_);
     result.clear();
     for (auto i = 0u; i < MaxMatches; ++i) {
         if (matches[i].rm_so == -1) break;
@@ -40,32 +272,14 @@ bool RegExp::exec(const char *against, RegExp::Matches &result, bool bol) {
     return true;
 }
 
-void RegExp::R(int e) const {
-    if (!e) return;
-    char error[1024];
-    regerror(e, &re_, error, sizeof(error));
-    throw std::runtime_error(error);
-}
-
-void RegExp::R(int e, const char *context) const {
-    if (!e) return;
-    char error[1024];
-    regerror(e, &re_, error, sizeof(error));
-    throw std::runtime_error(error + std::string(" in '") + context + "'");
-}
-
 RegExp::RegExp(RegExp &&exp)
-        : re_(exp.re_) {
-    exp.owned_ = false;
-    owned_ = true;
-}
+        : posix_(exp.posix_), dfa_(exp.dfa_), literal_(exp.literal_),
+          literalPrefix_(exp.literalPrefix_) { }
 
 RegExp &RegExp::operator=(RegExp &&exp) {
-    if (this != &exp) {
-        release();
-        re_ = exp.re_;
-        exp.owned_ = false;
-        owned_ = true;
-    }
+    posix_ = exp.posix_;
+    dfa_ = exp.dfa_;
+    literal_ = exp.literal_;
+    literalPrefix_ = exp.literalPrefix_;
     return *this;
 }
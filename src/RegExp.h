@@ -1,5 +1,8 @@
 #pragma once
 
+#include "StringView.h"
+
+#include <memory>
 #include <string>
 #include <vector>
 #include <regex.h>
@@ -7,13 +10,37 @@
 // Ideally we'd use std::regex, but that's broken on GCC 4.8 (which is what
 // I'm targeting).
 
+namespace re2 {
+class RE2;
+}
+
+class LiteralSearch;
+
+// POSIX extended regular expressions. Where the build has RE2, they're
+// matched with its DFA (in linear time, and on the text as it is); those RE2
+// can't match as POSIX would (back references, \< and \>, backslashes in
+// bracket expressions) fall back to the C library's regexec. Either way, the
+// longest string every match must contain is looked for first: text without
+// it isn't matched at all, and if every match starts with it, matching starts
+// where it's found.
 class RegExp {
-    regex_t re_;
-    bool owned_;
+public:
+    enum class Engine {
+        Dfa,
+        Posix
+    };
+
+private:
+    // Shared, so that RegExps moved from still match as they did.
+    std::shared_ptr<regex_t> posix_;
+    std::shared_ptr<const re2::RE2> dfa_;
+    std::shared_ptr<const LiteralSearch> literal_;
+    bool literalPrefix_;
 
 public:
-    explicit RegExp(const char *regex);
-    explicit RegExp(const std::string &regex);
+    // Uses the engine asked for if it can, otherwise POSIX.
+    explicit RegExp(const char *regex, Engine engine = Engine::Dfa);
+    explicit RegExp(const std::string &regex, Engine engine = Engine::Dfa);
     ~RegExp();
 
     RegExp(const RegExp &) = delete;
@@ -21,13 +48,20 @@ public:
     RegExp(RegExp &&);
     RegExp &operator=(RegExp &&);
 
+    Engine engine() const { return dfa_ ? Engine::Dfa : Engine::Posix; }
+    // The literal looked for first (empty if there's none), and whether every
+    // match starts with it.
+    std::string requiredLiteral() const;
+    bool literalIsPrefix() const { return literalPrefix_; }
+
+    // Matches are relative to offset, and stop at the first subexpression
+    // that didn't take part. ^ only matches at the very start of against.
     using Match = std::pair<size_t, size_t>;
     using Matches = std::vector<Match>;
-    bool exec(const std::string &against, Matches &result, size_t offset = 0);
-    bool exec(const char *against, Matches &result, bool bol=true);
+    bool exec(StringView against, Matches &result, size_t offset = 0) const;
+    bool exec(const char *against, Matches &result, bool bol=true) const;
 
 private:
-    void release();
-    void R(int e) const;
-    void R(int e, const char *context) const;
+    // As exec(), once the literal's been looked for.
+    bool match(StringView against, Matches &result, size_t offset) const;
 };
@@ -8,11 +8,14 @@
 class RegExpIndexer : public LineIndexer {
     RegExp re_;
 public:
-    RegExpIndexer(const std::string &regex);
+    RegExpIndexer(const std::string &regex,
+                  RegExp::Engine engine = RegExp::Engine::Dfa);
     void index(IndexSink &sink, StringView line) override;
+    bool threadSafe() const override { return true; }
+    RegExp::Engine engine() const { return re_.engine(); }
 
 private:
-    void onMatch(IndexSink &sink, const std::string &line, size_t offset,
+    void onMatch(IndexSink &sink, StringView line, size_t offset,
                  const RegExp::Match &match);
 };
 
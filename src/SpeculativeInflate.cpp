@@ -0,0 +1,386 @@
+#include "SpeculativeInflate.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr auto WindowSize = 32768u;
+constexpr auto MaxMatch = 258u;
+constexpr auto InitialOutput = 1024 * 1024u;
+constexpr auto MaxCodeBits = 15;
+// Codes up to this long are decoded with a single table lookup.
+constexpr auto FastBits = 10;
+constexpr auto NumLengthSymbols = 286;
+constexpr auto NumDistanceSymbols = 30;
+constexpr uint16_t FirstWindowSymbol = 256;
+
+const uint16_t LengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+        59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t LengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4,
+        5, 5, 5, 5, 0};
+const uint16_t DistanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+        513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+        24577};
+const uint8_t DistanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+        10, 11, 11, 12, 12, 13, 13};
+// The order in which a dynamic block gives the code length code's lengths.
+const uint8_t CodeLengthOrder[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+class BitReader {
+    const uint8_t *data_;
+    uint64_t size_;
+    uint64_t bit_;
+
+public:
+    BitReader(const uint8_t *data, uint64_t size, uint64_t bit)
+            : data_(data), size_(size), bit_(bit) { }
+
+    uint64_t position() const { return bit_; }
+    void seek(uint64_t bit) { bit_ = bit; }
+
+    // The next n (up to 32) bits, without consuming them. Bits past the end
+    // of the data read as zero.
+    uint32_t peek(int n) const {
+        auto byte = bit_ >> 3;
+        uint64_t value = 0;
+        if (byte + sizeof(value) <= size_) {
+            memcpy(&value, data_ + byte, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            value = __builtin_bswap64(value);
+#endif
+        } else {
+            for (auto i = byte; i < size_ && i < byte + sizeof(value); ++i)
+                value |= static_cast<uint64_t>(data_[i]) << (8 * (i - byte));
+        }
+        return static_cast<uint32_t>(
+                (value >> (bit_ & 7)) & ((1ull << n) - 1));
+    }
+
+    void skip(int n) {
+        bit_ += n;
+        if (bit_ > size_ * 8)
+            throw DeflateError("Unexpected end of deflate data");
+    }
+
+    uint32_t read(int n) {
+        auto value = peek(n);
+        skip(n);
+        return value;
+    }
+
+    void alignToByte() { bit_ = (bit_ + 7) & ~static_cast<uint64_t>(7); }
+};
+
+// A canonical Huffman code. Codes of up to FastBits bits are decoded by
+// looking up the next FastBits bits; longer ones a bit at a time, as zlib's
+// puff does.
+class Huffman {
+    // (symbol << 4) | length, or zero for longer (or invalid) codes.
+    uint16_t fast_[1u << FastBits];
+    uint16_t count_[MaxCodeBits + 1];
+    uint16_t symbols_[288];
+
+public:
+    // Builds the code from each symbol's code length (zero if unused),
+    // returning false if they don't make a valid code. As zlib does, only
+    // allows incomplete codes if asked, and then only a lone one-bit code
+    // (or none at all).
+    bool build(const uint8_t *lengths, int num, bool incompleteOk) {
+        std::fill(count_, count_ + MaxCodeBits + 1, 0);
+        for (int symbol = 0; symbol < num; ++symbol) ++count_[lengths[symbol]];
+        int maxLength = 0;
+        int left = 1;
+        for (int length = 1; length <= MaxCodeBits; ++length) {
+            left <<= 1;
+            left -= count_[length];
+            if (left < 0) return false;
+            if (count_[length]) maxLength = length;
+        }
+        if (left > 0 && !(incompleteOk && maxLength <= 1)) return false;
+
+        uint16_t offsets[MaxCodeBits + 2];
+        offsets[1] = 0;
+        for (int length = 1; length <= MaxCodeBits; ++length)
+            offsets[length + 1] = offsets[length] + count_[length];
+        for (int symbol = 0; symbol < num; ++symbol) {
+            if (lengths[symbol])
+                symbols_[offsets[lengths[symbol]]++] = symbol;
+        }
+
+        std::fill(fast_, fast_ + (1u << FastBits), 0);
+        unsigned code = 0;
+        int index = 0;
+        for (int length = 1; length <= FastBits; ++length) {
+            for (int i = 0; i < count_[length]; ++i, ++code) {
+                // Codes are sent most significant bit first, so are looked up
+                // reversed.
+                unsigned reversed = 0;
+                for (int bit = 0; bit < length; ++bit)
+                    reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+                uint16_t entry = (symbols_[index + i] << 4) | length;
+                for (auto fill = reversed; fill < (1u << FastBits);
+                     fill += 1u << length)
+                    fast_[fill] = entry;
+            }
+            index += count_[length];
+            code <<= 1;
+        }
+        return true;
+    }
+
+    // The next symbol, or -1 if the bits aren't a code.
+    int decode(BitReader &in) const {
+        auto entry = fast_[in.peek(FastBits)];
+        if (entry) {
+            in.skip(entry & 15);
+            return entry >> 4;
+        }
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (int length = 1; length <= MaxCodeBits; ++length) {
+            code |= in.read(1);
+            int count = count_[length];
+            if (code - count < first) return symbols_[index + (code - first)];
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+};
+
+struct FixedCodes {
+    Huffman lengths;
+    Huffman distances;
+
+    FixedCodes() {
+        uint8_t codeLengths[288];
+        std::fill(codeLengths, codeLengths + 144, 8);
+        std::fill(codeLengths + 144, codeLengths + 256, 9);
+        std::fill(codeLengths + 256, codeLengths + 280, 7);
+        std::fill(codeLengths + 280, codeLengths + 288, 8);
+        lengths.build(codeLengths, 288, false);
+        std::fill(codeLengths, codeLengths + 32, 5);
+        distances.build(codeLengths, 32, false);
+    }
+};
+
+const FixedCodes &fixedCodes() {
+    static const FixedCodes codes;
+    return codes;
+}
+
+// Reads the codes of a dynamic block (from just after its type), returning
+// false if they're invalid.
+bool readDynamicCodes(BitReader &in, Huffman &lengthCodes,
+                      Huffman &distanceCodes) {
+    int numLengths = in.read(5) + 257;
+    int numDistances = in.read(5) + 1;
+    int numCodeLengths = in.read(4) + 4;
+    if (numLengths > NumLengthSymbols || numDistances > NumDistanceSymbols)
+        return false;
+    uint8_t codeLengthLengths[19] = {};
+    for (int i = 0; i < numCodeLengths; ++i)
+        codeLengthLengths[CodeLengthOrder[i]] = in.read(3);
+    Huffman codeLengthCodes;
+    if (!codeLengthCodes.build(codeLengthLengths, 19, false)) return false;
+
+    uint8_t lengths[NumLengthSymbols + NumDistanceSymbols];
+    auto total = numLengths + numDistances;
+    for (int i = 0; i < total;) {
+        auto symbol = codeLengthCodes.decode(in);
+        if (symbol < 0) return false;
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (i == 0) return false;
+            value = lengths[i - 1];
+            repeat = 3 + in.read(2);
+        } else if (symbol == 17) {
+            repeat = 3 + in.read(3);
+        } else {
+            repeat = 11 + in.read(7);
+        }
+        if (i + repeat > total) return false;
+        while (repeat--) lengths[i++] = value;
+    }
+    // Every block needs an end.
+    if (lengths[256] == 0) return false;
+    return lengthCodes.build(lengths, numLengths, true)
+           && distanceCodes.build(lengths + numLengths, numDistances, true);
+}
+
+// Decodes a compressed block's symbols into out from <end> on, returning the
+// new end.
+size_t inflateBlock(BitReader &in, const Huffman &lengthCodes,
+                    const Huffman &distanceCodes, std::vector<uint16_t> &out,
+                    size_t end) {
+    for (;;) {
+        if (end + MaxMatch > out.size()) out.resize(out.size() * 2);
+        auto symbol = lengthCodes.decode(in);
+        if (symbol < 0) throw DeflateError("Invalid literal/length code");
+        if (symbol < 256) {
+            out[end++] = symbol;
+            continue;
+        }
+        if (symbol == 256) return end;
+        symbol -= 257;
+        if (symbol >= 29) throw DeflateError("Invalid length symbol");
+        auto length = LengthBase[symbol] + in.read(LengthExtra[symbol]);
+        auto distanceSymbol = distanceCodes.decode(in);
+        if (distanceSymbol < 0 || distanceSymbol >= NumDistanceSymbols)
+            throw DeflateError("Invalid distance code");
+        auto distance = DistanceBase[distanceSymbol]
+                        + in.read(DistanceExtra[distanceSymbol]);
+        if (distance > end) throw DeflateError("Invalid distance");
+        // Copies may overlap themselves, so go a symbol at a time.
+        auto to = &out[end];
+        auto from = to - distance;
+        for (unsigned i = 0; i < length; ++i) to[i] = from[i];
+        end += length;
+    }
+}
+
+}
+
+uint64_t gzipDataStart(const uint8_t *data, size_t size, uint64_t offset) {
+    if (offset + 10 > size || data[offset] != 0x1f || data[offset + 1] != 0x8b
+        || data[offset + 2] != 8)
+        throw DeflateError("Not a gzip header");
+    auto flags = data[offset + 3];
+    auto pos = offset + 10;
+    if (flags & 4) {
+        if (pos + 2 > size) throw DeflateError("Truncated gzip header");
+        pos += 2 + (data[pos] | (data[pos + 1] << 8));
+    }
+    // The file name, then the comment, each nul-terminated.
+    for (auto flag : {8, 16}) {
+        if (!(flags & flag)) continue;
+        while (pos < size && data[pos]) ++pos;
+        ++pos;
+    }
+    if (flags & 2) pos += 2;
+    if (pos > size) throw DeflateError("Truncated gzip header");
+    return pos * 8;
+}
+
+InflatedPiece inflatePiece(const uint8_t *data, size_t size, uint64_t startBit,
+                           uint64_t stopBit, const uint8_t *window,
+                           bool memberStart) {
+    InflatedPiece piece;
+    piece.startBit = startBit;
+    piece.finished = false;
+    // The window and then what's inflated after it, as symbols.
+    std::vector<uint16_t> out(WindowSize + InitialOutput);
+    for (size_t i = 0; i < WindowSize; ++i)
+        out[i] = window ? window[i] : FirstWindowSymbol + i;
+    size_t end = WindowSize;
+
+    BitReader in(data, size, startBit);
+    Huffman lengthCodes;
+    Huffman distanceCodes;
+    for (bool first = true;; first = false) {
+        if (!first && !memberStart && in.position() >= stopBit) break;
+        piece.boundaries.push_back(
+                {in.position(), end - WindowSize, memberStart});
+        memberStart = false;
+        bool last = in.read(1);
+        auto type = in.read(2);
+        if (type == 0) {
+            in.alignToByte();
+            auto length = in.read(16);
+            if ((in.read(16) ^ 0xffff) != length)
+                throw DeflateError("Invalid stored block length");
+            auto from = in.position() / 8;
+            in.skip(length * 8);
+            if (end + length > out.size())
+                out.resize(std::max(out.size() * 2, end + length));
+            std::copy(data + from, data + from + length, out.begin() + end);
+            end += length;
+        } else if (type == 1) {
+            end = inflateBlock(in, fixedCodes().lengths,
+                               fixedCodes().distances, out, end);
+        } else if (type == 2) {
+            if (!readDynamicCodes(in, lengthCodes, distanceCodes))
+                throw DeflateError("Invalid dynamic block codes");
+            end = inflateBlock(in, lengthCodes, distanceCodes, out, end);
+        } else {
+            throw DeflateError("Invalid block type");
+        }
+        if (!last) continue;
+
+        // The member's trailer, then maybe another member.
+        in.alignToByte();
+        InflatedPiece::MemberEnd memberEnd;
+        memberEnd.offset = end - WindowSize;
+        memberEnd.crc = in.read(32);
+        memberEnd.size = in.read(32);
+        piece.memberEnds.push_back(memberEnd);
+        auto next = in.position() / 8;
+        if (next + 2 > size || data[next] != 0x1f || data[next + 1] != 0x8b) {
+            piece.finished = true;
+            break;
+        }
+        in.seek(gzipDataStart(data, size, next));
+        memberStart = true;
+    }
+    piece.endBit = in.position();
+
+    piece.data.resize(end - WindowSize);
+    size_t unresolvedEnd = 0;
+    for (size_t i = WindowSize; i < end; ++i) {
+        if (out[i] < FirstWindowSymbol) {
+            piece.data[i - WindowSize] = out[i];
+        } else {
+            piece.data[i - WindowSize] = 0;
+            unresolvedEnd = i - WindowSize + 1;
+        }
+    }
+    piece.unresolved.assign(out.begin() + WindowSize,
+                            out.begin() + WindowSize + unresolvedEnd);
+    return piece;
+}
+
+void resolvePiece(InflatedPiece &piece, const uint8_t *window) {
+    for (size_t i = 0; i < piece.unresolved.size(); ++i) {
+        auto symbol = piece.unresolved[i];
+        if (symbol >= FirstWindowSymbol)
+            piece.data[i] = window[symbol - FirstWindowSymbol];
+    }
+    piece.unresolved.clear();
+    piece.unresolved.shrink_to_fit();
+}
+
+uint64_t findBlockStart(const uint8_t *data, size_t size, uint64_t fromBit,
+                        uint64_t toBit) {
+    Huffman lengthCodes;
+    Huffman distanceCodes;
+    for (auto bit = fromBit; bit < toBit; ++bit) {
+        BitReader in(data, size, bit);
+        // Most positions are ruled out by the first few bits: not last, type
+        // 2, and no more length or distance codes than there are.
+        auto header = in.peek(13);
+        if ((header & 7) != 4 || ((header >> 3) & 31) > 29
+            || ((header >> 8) & 31) > 29)
+            continue;
+        try {
+            in.skip(3);
+            if (readDynamicCodes(in, lengthCodes, distanceCodes)) return bit;
+        } catch (const DeflateError &) {
+            // Ran out of data.
+        }
+    }
+    return toBit;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// A deflate decoder for inflating one gzip stream in pieces on several
+// threads at once, as rapidgzip and pugz do. A piece may start at a guessed
+// block boundary without knowing the 32KiB window before it: bytes copied
+// from that window are kept as references to it, and filled in once the piece
+// before (and so its last 32KiB) is known.
+//
+// Positions in the compressed data are counted in bits from its start.
+
+struct DeflateError : std::runtime_error {
+    explicit DeflateError(const std::string &what)
+            : std::runtime_error(what) { }
+};
+
+struct InflatedPiece {
+    // Where decoding started and stopped, both block boundaries (or the end
+    // of the data).
+    uint64_t startBit;
+    uint64_t endBit;
+    // Whether the data ended (after the last gzip member) at endBit.
+    bool finished;
+    // The inflated data. Where it depends on the unknown window it's zero
+    // until resolved.
+    std::vector<uint8_t> data;
+    // The data up to its last reference to the unknown window, as symbols:
+    // bytes below 256, and positions in the window (0 being its oldest byte)
+    // plus 256 above. Empty once resolved.
+    std::vector<uint16_t> unresolved;
+
+    struct Boundary {
+        uint64_t bit;
+        uint64_t offset; // into data
+        // The first block of a gzip member, which needs no window.
+        bool memberStart;
+    };
+    // Each block boundary decoded from, in order.
+    std::vector<Boundary> boundaries;
+
+    struct MemberEnd {
+        uint64_t offset; // into data
+        // From the member's trailer.
+        uint32_t crc;
+        uint32_t size;
+    };
+    std::vector<MemberEnd> memberEnds;
+};
+
+// Where the deflate data of the gzip member at byte <offset> starts. Throws
+// DeflateError if there's no gzip header there.
+uint64_t gzipDataStart(const uint8_t *data, size_t size, uint64_t offset);
+
+// Inflates from the block boundary at startBit until the first boundary at or
+// after stopBit (other than a member's first block), or the end of the last
+// gzip member, carrying on from member to member. Given the 32KiB window
+// before startBit the piece is complete; without (nullptr) it refers to the
+// window where needed. Throws DeflateError if the data's invalid.
+InflatedPiece inflatePiece(const uint8_t *data, size_t size, uint64_t startBit,
+                           uint64_t stopBit, const uint8_t *window,
+                           bool memberStart = false);
+
+// Fills in the bytes of a piece that come from the window before it.
+void resolvePiece(InflatedPiece &piece, const uint8_t *window);
+
+// Finds the first bit in [fromBit, toBit) where a block (not the last in its
+// member) with dynamic Huffman codes might start: one whose header describes
+// valid codes. Returns toBit if there's none.
+uint64_t findBlockStart(const uint8_t *data, size_t size, uint64_t fromBit,
+                        uint64_t toBit);
@@ -75,19 +75,33 @@ bool Sqlite::Statement::step() {
 
 Sqlite::Statement &Sqlite::Statement::bindBlob(
         const std::string &param, const void *data, size_t length) {
-    R(sqlite3_bind_blob(statement_, P(param), data, length, SQLITE_TRANSIENT));
-    return *this;
+    return bindBlob(parameterIndex(param), data, length);
 }
 
 Sqlite::Statement &Sqlite::Statement::bindInt64(const std::string &param,
                                                 int64_t data) {
-    R(sqlite3_bind_int64(statement_, P(param), data));
-    return *this;
+    return bindInt64(parameterIndex(param), data);
 }
 
 Sqlite::Statement &Sqlite::Statement::bindString(const std::string &param,
                                                  const std::string &data) {
-    R(sqlite3_bind_text(statement_, P(param), data.c_str(), data.size(),
+    return bindString(parameterIndex(param), data);
+}
+
+Sqlite::Statement &Sqlite::Statement::bindBlob(
+        int index, const void *data, size_t length) {
+    R(sqlite3_bind_blob(statement_, index, data, length, SQLITE_TRANSIENT));
+    return *this;
+}
+
+Sqlite::Statement &Sqlite::Statement::bindInt64(int index, int64_t data) {
+    R(sqlite3_bind_int64(statement_, index, data));
+    return *this;
+}
+
+Sqlite::Statement &Sqlite::Statement::bindString(int index,
+                                                 const std::string &data) {
+    R(sqlite3_bind_text(statement_, index, data.c_str(), data.size(),
                         SQLITE_TRANSIENT));
     return *this;
 }
@@ -108,7 +122,7 @@ std::string Sqlite::Statement::columnName(int index) const {
     return sqlite3_column_name(statement_, index);
 }
 
-int Sqlite::Statement::P(const std::string &param) const {
+int Sqlite::Statement::parameterIndex(const std::string &param) const {
     auto index = sqlite3_bind_parameter_index(statement_, param.c_str());
     if (index == 0)
         throw std::runtime_error(
@@ -119,7 +133,7 @@ int Sqlite::Statement::P(const std::string &param) const {
 std::vector<uint8_t> Sqlite::Statement::columnBlob(int index) const {
     auto ptr = sqlite3_column_blob(statement_, index);
     std::vector<uint8_t> data(sqlite3_column_bytes(statement_, index));
-    std::memcpy(&data[0], ptr, data.size());
+    if (!data.empty()) std::memcpy(&data[0], ptr, data.size());
     return data;
 }
 
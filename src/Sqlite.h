@@ -61,6 +61,13 @@ public:
         Statement &bindString(const std::string &param,
                               const std::string &string);
 
+        // Binding by (1-based) parameter index avoids looking the parameter
+        // up by name; see parameterIndex() to find the index once up front.
+        int parameterIndex(const std::string &param) const;
+        Statement &bindInt64(int index, int64_t data);
+        Statement &bindBlob(int index, const void *data, size_t length);
+        Statement &bindString(int index, const std::string &string);
+
         bool step();
 
         int columnCount() const;
@@ -69,9 +76,6 @@ public:
         int64_t columnInt64(int index) const;
         std::string columnString(int index) const;
         std::vector<uint8_t> columnBlob(int index) const;
-
-    private:
-        int P(const std::string &param) const;
     };
 
     Statement prepare(const std::string &sql) const;
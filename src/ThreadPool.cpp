@@ -0,0 +1,46 @@
+#include "ThreadPool.h"
+
+#include <stdexcept>
+
+ThreadPool::ThreadPool(size_t numThreads)
+        : stopping_(false) {
+    if (numThreads == 0)
+        throw std::invalid_argument("A thread pool needs at least one thread");
+    for (size_t i = 0; i < numThreads; ++i)
+        threads_.emplace_back([this]() { run(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    workAvailable_.notify_all();
+    for (auto &thread : threads_) thread.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> work) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        work_.emplace_back(std::move(work));
+    }
+    workAvailable_.notify_one();
+}
+
+void ThreadPool::run() {
+    for (; ;) {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            workAvailable_.wait(lock, [this]() {
+                return stopping_ || !work_.empty();
+            });
+            // Outstanding work is still run on shutdown so nobody is left
+            // waiting on a future that will never be satisfied.
+            if (work_.empty()) return;
+            work = std::move(work_.front());
+            work_.pop_front();
+        }
+        work();
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed-size pool of worker threads. Work is run in submission order (though
+// of course may complete out of order); results and exceptions are reported
+// through the returned future.
+class ThreadPool {
+    std::mutex mutex_;
+    std::condition_variable workAvailable_;
+    std::deque<std::function<void()>> work_;
+    std::vector<std::thread> threads_;
+    bool stopping_;
+
+public:
+    explicit ThreadPool(size_t numThreads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return threads_.size(); }
+
+    template<typename F>
+    auto submit(F &&func) -> std::future<decltype(func())> {
+        using Result = decltype(func());
+        auto task = std::make_shared<std::packaged_task<Result()>>(
+                std::forward<F>(func));
+        auto future = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return future;
+    }
+
+private:
+    void enqueue(std::function<void()> work);
+    void run();
+};
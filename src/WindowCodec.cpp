@@ -0,0 +1,123 @@
+#include "WindowCodec.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <zlib.h>
+
+#ifdef ZINDEX_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace {
+
+void zlibCheck(int result) {
+    if (result != Z_OK)
+        throw std::runtime_error(std::string("Error from zlib : ")
+                                 + zError(result));
+}
+
+}
+
+WindowCodec parseWindowCodec(const std::string &name) {
+    if (name == "raw") return WindowCodec::Raw;
+    if (name == "zlib") return WindowCodec::Zlib;
+    if (name == "zlib-fast") return WindowCodec::ZlibFast;
+    if (name == "lz4") return WindowCodec::Lz4;
+    throw std::invalid_argument("Unknown window codec '" + name + "'");
+}
+
+std::string windowCodecName(WindowCodec codec) {
+    switch (codec) {
+        case WindowCodec::Raw:
+            return "raw";
+        case WindowCodec::Zlib:
+        case WindowCodec::ZlibFast:
+            return "zlib";
+        case WindowCodec::Lz4:
+            return "lz4";
+    }
+    throw std::logic_error("Bad window codec");
+}
+
+bool windowCodecAvailable(WindowCodec codec) {
+#ifdef ZINDEX_HAVE_LZ4
+    (void)codec;
+    return true;
+#else
+    return codec != WindowCodec::Lz4;
+#endif
+}
+
+std::vector<uint8_t> encodeWindow(WindowCodec codec, const uint8_t *window,
+                                  size_t size) {
+    std::vector<uint8_t> encoded;
+    switch (codec) {
+        case WindowCodec::Raw:
+            encoded.assign(window, window + size);
+            break;
+        case WindowCodec::Zlib:
+        case WindowCodec::ZlibFast: {
+            uLongf length = compressBound(size);
+            encoded.resize(length);
+            zlibCheck(compress2(&encoded[0], &length, window, size,
+                                codec == WindowCodec::Zlib ? 9 : 1));
+            encoded.resize(length);
+            break;
+        }
+        case WindowCodec::Lz4: {
+#ifdef ZINDEX_HAVE_LZ4
+            encoded.resize(LZ4_compressBound(size));
+            auto length = LZ4_compress_default(
+                    reinterpret_cast<const char *>(window),
+                    reinterpret_cast<char *>(&encoded[0]), size,
+                    encoded.size());
+            if (length <= 0)
+                throw std::runtime_error("Unable to LZ4 compress a window");
+            encoded.resize(length);
+            break;
+#else
+            throw std::runtime_error("LZ4 support was not built in");
+#endif
+        }
+    }
+    return encoded;
+}
+
+const uint8_t *decodeWindow(WindowCodec codec,
+                            const std::vector<uint8_t> &stored,
+                            uint8_t *buffer, size_t size) {
+    if (stored.empty()) {
+        memset(buffer, 0, size);
+        return buffer;
+    }
+    switch (codec) {
+        case WindowCodec::Raw:
+            if (stored.size() != size)
+                throw std::runtime_error("Stored window is the wrong size");
+            return &stored[0];
+        case WindowCodec::Zlib:
+        case WindowCodec::ZlibFast: {
+            uLongf length = size;
+            zlibCheck(::uncompress(buffer, &length, &stored[0],
+                                   stored.size()));
+            if (length != size)
+                throw std::runtime_error("Unable to decompress a full window");
+            return buffer;
+        }
+        case WindowCodec::Lz4: {
+#ifdef ZINDEX_HAVE_LZ4
+            auto length = LZ4_decompress_safe(
+                    reinterpret_cast<const char *>(&stored[0]),
+                    reinterpret_cast<char *>(buffer), stored.size(), size);
+            if (length < 0 || static_cast<size_t>(length) != size)
+                throw std::runtime_error("Unable to decompress a full window");
+            return buffer;
+#else
+            throw std::runtime_error(
+                    "Index windows are LZ4 compressed, but LZ4 support was "
+                    "not built in");
+#endif
+        }
+    }
+    throw std::logic_error("Bad window codec");
+}
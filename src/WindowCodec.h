@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// How the 32KiB window stored with each access point is encoded. Windows are
+// decoded before every lookup, so cheaper codecs trade index size for
+// latency. ZlibFast differs from Zlib only in how hard it compresses; both are
+// decoded the same way.
+enum class WindowCodec {
+    Raw,
+    Zlib,
+    ZlibFast,
+    Lz4
+};
+
+// Parses a codec name as given on the command line ("raw", "zlib",
+// "zlib-fast" or "lz4"). Throws std::invalid_argument if unknown.
+WindowCodec parseWindowCodec(const std::string &name);
+// The name recorded in an index's metadata, from which it may be decoded.
+std::string windowCodecName(WindowCodec codec);
+// Whether this build supports the codec (LZ4 is optional).
+bool windowCodecAvailable(WindowCodec codec);
+
+std::vector<uint8_t> encodeWindow(WindowCodec codec, const uint8_t *window,
+                                  size_t size);
+// Decodes a stored window of size bytes, returning a pointer to it: either
+// into buffer, or (if stored raw) into the stored data itself. Access points
+// at the start of a gzip member need no window, and store none: an empty
+// window decodes as zeros.
+const uint8_t *decodeWindow(WindowCodec codec,
+                            const std::vector<uint8_t> &stored,
+                            uint8_t *buffer, size_t size);
@@ -3,6 +3,7 @@
 #include "RegExpIndexer.h"
 #include "ConsoleLog.h"
 #include "FieldIndexer.h"
+#include "WindowCodec.h"
 
 #include <tclap/CmdLine.h>
 
@@ -16,6 +17,23 @@ using namespace TCLAP;
 
 namespace {
 
+// The options that add an index, and those that describe the index added by
+// the option before them.
+enum class IndexOption { Regex, Field, Pipe, Name, Numeric, Unique };
+
+// Records the order the options are given in, which TCLAP only keeps for each
+// option separately.
+class IndexOptionOrder : public Visitor {
+    vector<IndexOption> &order_;
+    IndexOption option_;
+
+public:
+    IndexOptionOrder(vector<IndexOption> &order, IndexOption option)
+            : order_(order), option_(option) { }
+
+    void visit() override { order_.push_back(option_); }
+};
+
 string getRealPath(const string &relPath) {
     char realPathBuf[PATH_MAX];
     auto result = realpath(relPath.c_str(), realPathBuf);
@@ -33,23 +51,57 @@ int Main(int argc, const char *argv[]) {
     SwitchArg debug("", "debug", "Be even more verbose", cmd);
     SwitchArg forceColour("", "colour", "Use colour even on non-TTY", cmd);
     SwitchArg forceColor("", "color", "Use color even on non-TTY", cmd);
-    SwitchArg numeric("n", "numeric", "Assume the index is numeric", cmd);
-    SwitchArg unique("u", "unique", "Assume each line's index is unique", cmd);
     ValueArg<uint64_t> checkpointEvery(
             "", "checkpoint-every",
             "Create an compression checkpoint every <bytes>", false,
             0, "bytes", cmd);
-    ValueArg<string> regex("", "regex", "Create an index using <regex>", false,
-                           "", "regex", cmd);
-    ValueArg<uint64_t> skipFirst("", "skip-first", "Skip the first <num> lines",
+    ValueArg<double> checkpointEveryMs(
+            "", "checkpoint-every-ms",
+            "Create a checkpoint once decompressing since the last would "
+                    "take <ms>", false, 0, "ms", cmd);
+    ValueArg<uint64_t> checkpointEveryKeys(
+            "", "checkpoint-every-keys",
+            "Create a checkpoint every <num> indexed keys or so", false, 0,
+            "num", cmd);
+    ValueArg<uint64_t> checkpointBudget(
+            "", "checkpoint-budget",
+            "Space checkpoints to take up around <bytes> of the index", false,
+            0, "bytes", cmd);
+    vector<IndexOption> indexOptions;
+    IndexOptionOrder regexOrder(indexOptions, IndexOption::Regex);
+    IndexOptionOrder fieldOrder(indexOptions, IndexOption::Field);
+    IndexOptionOrder pipeOrder(indexOptions, IndexOption::Pipe);
+    IndexOptionOrder nameOrder(indexOptions, IndexOption::Name);
+    IndexOptionOrder numericOrder(indexOptions, IndexOption::Numeric);
+    IndexOptionOrder uniqueOrder(indexOptions, IndexOption::Unique);
+    MultiSwitchArg numeric(
+            "n", "numeric",
+            "Assume the index is numeric: the one created by the option "
+                    "before this, or if given before them all, every index",
+            cmd, 0, &numericOrder);
+    MultiSwitchArg unique(
+            "u", "unique",
+            "Assume each line's index is unique: the one created by the option "
+                    "before this, or if given before them all, every index",
+            cmd, 0, &uniqueOrder);
+    MultiArg<string> regex("", "regex", "Create an index using <regex>", false,
+                           "regex", cmd, &regexOrder);
+    ValueArg<uint64_t> skipFirst("", "skip-first",
+                                 "Skip the first <num> lines (by default, "
+                                         "as many as the index was built "
+                                         "skipping with --append or "
+                                         "--add-index)",
                                  false, 0, "num", cmd);
-    ValueArg<int> field("f", "field", "Create an index using field <num> "
+    MultiArg<int> field("f", "field", "Create an index using field <num> "
                                 "(delimited by -d/--delimiter)",
-                        false, 0, "num", cmd);
+                        false, "num", cmd, &fieldOrder);
     ValueArg<char> delimiter("d", "delimiter",
                              "Use <char> as the field delimiter", false, ' ',
                              "char", cmd);
-    ValueArg<string> externalIndexer(
+    SwitchArg csvQuoting("", "csv-quoting",
+                         "Allow --field fields to be double-quoted as in CSV "
+                                 "(RFC 4180), delimiters and all", cmd);
+    MultiArg<string> externalIndexer(
             "p", "pipe",
             "Create indices by piping output through <CMD> which should output "
                     "a single line for each input line. "
@@ -58,7 +110,68 @@ int Main(int argc, const char *argv[]) {
                     "The CMD should be unbuffered "
                     "(man stdbuf(1) for one way of doing this).\n"
                     "Example:  --pipe 'jq --raw-output --unbuffered .eventId')",
-            false, "", "CMD", cmd);
+            false, "CMD", cmd, &pipeOrder);
+    MultiArg<string> indexName(
+            "", "name",
+            "Name the index created by the --regex, --field or --pipe before "
+                    "this <name> (for zq --index). Each of several indices "
+                    "needs a different name; the default is 'default'",
+            false, "name", cmd, &nameOrder);
+    ValueArg<size_t> threads("", "threads",
+                             "Index lines using <num> threads (default 1)",
+                             false, 1, "num", cmd);
+    ValueArg<uint64_t> sortMemory(
+            "", "sort-memory",
+            "Use up to <bytes> of memory sorting unique keys before spilling "
+                    "to temporary files in $TMPDIR (at least 64KiB per "
+                    "unique index is used whatever this says)", false, 0,
+            "bytes", cmd);
+    SwitchArg sparse("", "sparse",
+                     "Store line offsets only at each checkpoint, "
+                             "rather than for every line", cmd);
+    ValueArg<uint64_t> sampleLinesEvery(
+            "", "sample-lines-every",
+            "With --sparse, also store the offset of every <num>th line",
+            false, 0, "num", cmd);
+    ValueArg<uint64_t> restartEvery(
+            "", "restart-every",
+            "Between checkpoints, add a restart point every <bytes>; these "
+                    "store only the parts of their window they need",
+            false, 0, "bytes", cmd);
+    vector<string> windowCodecs{"raw", "zlib", "zlib-fast", "lz4"};
+    ValuesConstraint<string> windowCodecConstraint(windowCodecs);
+    ValueArg<string> windowCodec(
+            "", "window-codec",
+            "Store checkpoint windows with <codec>: raw is largest but "
+                    "quickest to look up, zlib (the default) smallest",
+            false, "zlib", &windowCodecConstraint, cmd);
+    ValueArg<uint64_t> speculativeInflate(
+            "", "speculative-inflate",
+            "(Experimental) With --threads, inflate a gzip file in pieces of "
+                    "<bytes> in parallel, guessing where deflate blocks start",
+            false, 0, "bytes", cmd);
+    ValueArg<string> rewriteSeekable(
+            "", "rewrite-seekable",
+            "Rewrite the file to <file> as BGZF while indexing it (gzip that "
+                    "zcat still reads, in small members), and index that "
+                    "instead: lookups then start at a member, needing no "
+                    "stored windows",
+            false, "", "file", cmd);
+    SwitchArg append(
+            "", "append",
+            "Add lines appended to the file since the index was built, "
+                    "rather than rebuilding it. Give the same indices as when "
+                    "it was built", cmd);
+    SwitchArg addIndex(
+            "", "add-index",
+            "Add the indices given (each with a new --name) to an existing "
+                    "index, keeping its checkpoints and line offsets rather "
+                    "than rebuilding it. The file is decompressed from each "
+                    "checkpoint in parallel with --threads", cmd);
+    SwitchArg refineCheckpoints(
+            "", "refine-checkpoints",
+            "Add checkpoints to an existing index as per --checkpoint-every, "
+                    "keeping its indices, rather than rebuilding it", cmd);
     ValueArg<string> indexFilename("", "index-file",
                                    "Store index in <index-file> "
                                            "(default <file>.zindex)", false, "",
@@ -82,40 +195,121 @@ int Main(int argc, const char *argv[]) {
             return 1;
         }
 
+        auto indexedFile = rewriteSeekable.isSet() ? rewriteSeekable.getValue()
+                                                   : inputFile.getValue();
         auto outputFile = indexFilename.isSet() ? indexFilename.getValue() :
-                          inputFile.getValue() + ".zindex";
-        Index::Builder builder(log, move(in), realPath, outputFile,
-                               skipFirst.getValue());
-        if (regex.isSet() && field.isSet()) {
-            throw std::runtime_error(
-                    "Sorry; multiple indices are not supported yet");
-        }
-        if (regex.isSet()) {
-            builder.addIndexer("default", regex.getValue(), numeric.isSet(),
-                               unique.isSet(),
-                               std::unique_ptr<LineIndexer>(
-                                       new RegExpIndexer(regex.getValue())));
+                          indexedFile + ".zindex";
+        if (refineCheckpoints.isSet()) {
+            if (!checkpointEvery.isSet() || checkpointEvery.getValue() == 0)
+                throw std::runtime_error(
+                        "--refine-checkpoints needs --checkpoint-every");
+            Index::refineCheckpoints(log, move(in), outputFile,
+                                     checkpointEvery.getValue(),
+                                     threads.getValue());
+            return 0;
         }
-        if (field.isSet()) {
-            ostringstream name;
-            name << "Field " << field.getValue() << " delimited by '"
-            << delimiter.getValue() << "'";
-            builder.addIndexer("default", name.str(), numeric.isSet(),
-                               unique.isSet(), std::unique_ptr<LineIndexer>(
-                            new FieldIndexer(delimiter.getValue(),
-                                             field.getValue())));
+        // All built in the one pass over the file.
+        struct IndexSpec {
+            string name;
+            string creation;
+            std::unique_ptr<LineIndexer> indexer;
+            bool numeric;
+            bool unique;
+        };
+        vector<IndexSpec> specs;
+        bool allNumeric = false, allUnique = false;
+        size_t numRegexes = 0, numFields = 0, numPipes = 0, numNames = 0;
+        std::shared_ptr<FieldSplitter> splitter;
+        for (auto option : indexOptions) {
+            switch (option) {
+                case IndexOption::Regex: {
+                    auto &pattern = regex.getValue()[numRegexes++];
+                    specs.push_back({"", pattern, std::unique_ptr<LineIndexer>(
+                            new RegExpIndexer(pattern)), false, false});
+                    break;
+                }
+                case IndexOption::Field: {
+                    auto fieldNum = field.getValue()[numFields++];
+                    ostringstream creation;
+                    creation << "Field " << fieldNum << " delimited by '"
+                    << delimiter.getValue() << "'";
+                    if (csvQuoting.isSet()) creation << " (quoted)";
+                    // One splitter for all the fields, so each line's split
+                    // only once.
+                    if (!splitter)
+                        splitter = std::make_shared<FieldSplitter>(
+                                delimiter.getValue(),
+                                csvQuoting.isSet()
+                                ? FieldSplitter::Quoting::Rfc4180
+                                : FieldSplitter::Quoting::None);
+                    specs.push_back({"", creation.str(),
+                                     std::unique_ptr<LineIndexer>(
+                                             new FieldIndexer(splitter,
+                                                              fieldNum)),
+                                     false, false});
+                    break;
+                }
+                case IndexOption::Pipe: {
+                    auto &command = externalIndexer.getValue()[numPipes++];
+                    specs.push_back({"", command, std::unique_ptr<LineIndexer>(
+                            new ExternalIndexer(log, command,
+                                                delimiter.getValue())),
+                                     false, false});
+                    break;
+                }
+                case IndexOption::Name:
+                    if (specs.empty() || !specs.back().name.empty())
+                        throw std::runtime_error(
+                                "Each --name should follow the --regex, "
+                                        "--field or --pipe it names");
+                    specs.back().name = indexName.getValue()[numNames++];
+                    break;
+                case IndexOption::Numeric:
+                    (specs.empty() ? allNumeric : specs.back().numeric) = true;
+                    break;
+                case IndexOption::Unique:
+                    (specs.empty() ? allUnique : specs.back().unique) = true;
+                    break;
+            }
         }
-        if (externalIndexer.isSet()) {
-            auto indexer = std::unique_ptr<LineIndexer>(
-                    new ExternalIndexer(log,
-                                        externalIndexer.getValue(),
-                                        delimiter.getValue()));
-            builder.addIndexer("default", externalIndexer.getValue(),
-                               numeric.isSet(), unique.isSet(),
-                               std::move(indexer));
+        if (append.isSet() && addIndex.isSet())
+            throw std::runtime_error(
+                    "--append and --add-index can't be used together");
+        auto mode = append.isSet() ? Index::Builder::Mode::Append
+                                   : addIndex.isSet()
+                                     ? Index::Builder::Mode::AddIndices
+                                     : Index::Builder::Mode::Create;
+        Index::Builder builder(log, move(in), realPath, outputFile,
+                               skipFirst.getValue(), mode);
+        for (auto &spec : specs) {
+            builder.addIndexer(spec.name.empty() ? "default" : spec.name,
+                               spec.creation, spec.numeric || allNumeric,
+                               spec.unique || allUnique,
+                               std::move(spec.indexer));
         }
         if (checkpointEvery.isSet())
             builder.indexEvery(checkpointEvery.getValue());
+        else if (checkpointEveryMs.isSet() || checkpointEveryKeys.isSet()
+                 || checkpointBudget.isSet())
+            builder.indexEvery(0); // the adaptive criteria replace the default
+        if (checkpointEveryMs.isSet())
+            builder.indexEveryTime(checkpointEveryMs.getValue() / 1000);
+        if (checkpointEveryKeys.isSet())
+            builder.indexEveryKeys(checkpointEveryKeys.getValue());
+        if (checkpointBudget.isSet())
+            builder.checkpointBudget(checkpointBudget.getValue());
+        builder.numThreads(threads.getValue());
+        if (sparse.isSet() || sampleLinesEvery.isSet())
+            builder.sparseLineOffsets(sampleLinesEvery.getValue());
+        if (sortMemory.isSet())
+            builder.sortMemory(sortMemory.getValue());
+        builder.windowCodec(parseWindowCodec(windowCodec.getValue()));
+        if (restartEvery.isSet())
+            builder.restartEvery(restartEvery.getValue());
+        if (speculativeInflate.isSet())
+            builder.speculativeInflate(speculativeInflate.getValue());
+        if (rewriteSeekable.isSet())
+            builder.rewriteSeekable(rewriteSeekable.getValue());
         builder.build();
     } catch (const exception &e) {
         log.error(e.what());
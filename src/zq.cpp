@@ -5,6 +5,7 @@
 
 #include <tclap/CmdLine.h>
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include "RangeFetcher.h"
@@ -14,34 +15,52 @@ using namespace TCLAP;
 
 namespace {
 
+// Prints lines as they're fetched, along with the separators between
+// non-overlapping contexts recorded by a LineCollector.
 struct PrintSink : LineSink {
     bool printLineNum;
+    const std::vector<uint64_t> &lines;
+    const std::vector<size_t> &separators;
+    const std::string sep;
+    size_t nextLine;
+    size_t nextSeparator;
 
-    PrintSink(bool printLineNum) : printLineNum(printLineNum) { }
+    PrintSink(bool printLineNum, const std::vector<uint64_t> &lines,
+              const std::vector<size_t> &separators, const std::string &sep)
+            : printLineNum(printLineNum), lines(lines), separators(separators),
+              sep(sep), nextLine(0), nextSeparator(0) { }
 
     void onLine(size_t l, size_t, const char *line, size_t length) override {
+        // Lines beyond the end of the file are never fetched, so skip past
+        // any requested lines we weren't given.
+        while (nextLine < lines.size() && lines[nextLine] != l) ++nextLine;
+        while (nextSeparator < separators.size()
+               && separators[nextSeparator] <= nextLine) {
+            cout << sep << endl;
+            ++nextSeparator;
+        }
+        ++nextLine;
         if (printLineNum) cout << l << ":";
         cout << string(line, length) << endl;
     }
 };
 
-struct PrintHandler : RangeFetcher::Handler {
-    Index &index;
-    LineSink &sink;
-    const bool printSep;
-    const std::string sep;
+// Collects the lines to print, so they can all be fetched at once.
+struct LineCollector : RangeFetcher::Handler {
+    const bool recordSep;
+    std::vector<uint64_t> lines;
+    // Indices into lines before which to print a separator.
+    std::vector<size_t> separators;
 
-    PrintHandler(Index &index, LineSink &sink, bool printSep,
-                 const std::string &sep)
-            : index(index), sink(sink), printSep(printSep), sep(sep) { }
+    LineCollector(bool recordSep) : recordSep(recordSep) { }
 
     virtual void onLine(uint64_t line) override {
-        index.getLine(line, sink);
+        lines.push_back(line);
     }
 
     virtual void onSeparator() override {
-        if (printSep)
-            cout << sep << endl;
+        if (recordSep)
+            separators.push_back(lines.size());
     }
 };
 
@@ -87,6 +106,16 @@ int Main(int argc, const char *argv[]) {
                             false, "--", "SEPARATOR", cmd);
     ValueArg<string> indexArg("", "index-file", "Use index from <index-file> "
             "(default <file>.zindex)", false, "", "index", cmd);
+    ValueArg<string> indexName("", "index", "Query the index named <name> "
+            "(default 'default')", false, "default", "name", cmd);
+    SwitchArg fileOrder("", "file-order", "Print matches in the order they "
+            "appear in the file, rather than in query order", cmd);
+    ValueArg<uint64_t> numThreads("", "threads", "Decompress lines from "
+            "different checkpoints on up to <num> threads", false, 1, "num",
+                                  cmd);
+    ValueArg<uint64_t> cacheSize("", "cache-size", "Keep up to <bytes> of "
+            "decompressed data cached between lookups",
+                                 false, 64 * 1024 * 1024, "bytes", cmd);
     cmd.parse(argc, argv);
 
     ConsoleLog log(
@@ -107,6 +136,8 @@ int Main(int argc, const char *argv[]) {
                          inputFile.getValue() + ".zindex";
         auto index = Index::load(log, move(in), indexFile.c_str(),
                                  forceLoad.isSet());
+        index.setCacheSize(cacheSize.getValue());
+        index.setNumThreads(numThreads.getValue());
 
         uint64_t before = 0u;
         uint64_t after = 0u;
@@ -115,16 +146,36 @@ int Main(int argc, const char *argv[]) {
         if (contextArg.isSet()) before = after = contextArg.getValue();
         log.debug("Fetching context of ", before, " lines before and ", after,
                   " lines after");
-        PrintSink sink(lineNum.isSet());
-        PrintHandler ph(index, sink, (before || after) && !noSepArg.isSet(),
-                        sepArg.getValue());
-        RangeFetcher rangeFetcher(ph, before, after);
+        std::vector<uint64_t> matches;
         if (lineMode.isSet()) {
             for (auto &q : query.getValue())
-                rangeFetcher(toInt(q));
+                matches.push_back(toInt(q));
         } else {
-            index.queryIndexMulti("default", query.getValue(), rangeFetcher);
+            index.queryIndexMulti(indexName.getValue(), query.getValue(),
+                                  [&matches](size_t line) {
+                                      matches.push_back(line);
+                                  });
+        }
+        if (fileOrder.isSet())
+            std::sort(matches.begin(), matches.end());
+        LineCollector collector((before || after) && !noSepArg.isSet());
+        RangeFetcher rangeFetcher(collector, before, after);
+        for (auto match : matches) rangeFetcher(match);
+        log.debug("Fetching ", collector.lines.size(), " lines");
+        // The estimate looks up every line again, so is only worth it if
+        // it's to be shown.
+        if (verbose.isSet() || debug.isSet()) {
+            auto expected = index.estimateFetchSeconds(collector.lines);
+            if (expected >= 0)
+                log.info("Expected decompression time: ", expected * 1000,
+                         "ms");
         }
+        PrintSink sink(lineNum.isSet(), collector.lines, collector.separators,
+                       sepArg.getValue());
+        index.getLines(collector.lines, sink, Index::LineOrder::Requested);
+        auto stats = index.cacheStats();
+        log.info("Decompression cache: ", stats.hits, " hits, ", stats.misses,
+                 " misses");
     } catch (const exception &e) {
         log.error(e.what());
     }
@@ -0,0 +1,397 @@
+#include "Codec.h"
+#include "RandomAccessFile.h"
+
+#include "catch.hpp"
+#include "TempDir.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef ZINDEX_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ZINDEX_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef ZINDEX_HAVE_XZ
+#include <lzma.h>
+#endif
+
+namespace {
+
+void writeFile(const std::string &path, const std::string &contents) {
+    std::ofstream out(path, std::ios::binary);
+    out << contents;
+}
+
+std::vector<std::string> testTexts() {
+    std::vector<std::string> texts;
+    for (auto part = 0; part < 5; ++part) {
+        std::string text;
+        for (auto i = 0; i < 20000 * (part + 1); ++i)
+            text += "Part " + std::to_string(part) + " line "
+                    + std::to_string(i * 7919 % 100003) + "\n";
+        texts.push_back(text);
+    }
+    return texts;
+}
+
+// Checks the codec finds frames with the given data in the file, and can
+// decompress from each (and from one on to the end).
+void checkFrames(const Codec &codec, const std::string &path,
+                 const std::vector<std::string> &frameTexts) {
+    RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+    auto frames = codec.findFrames(file);
+    REQUIRE(frames.size() == frameTexts.size());
+    std::string expected;
+    std::vector<uint8_t> all;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        INFO("frame " << i);
+        std::vector<uint8_t> out;
+        codec.decompressFrame(file, frames[i], out);
+        CHECK(std::string(out.begin(), out.end()) == frameTexts[i]);
+        codec.decompressFrame(file, frames[i], all);
+        expected += frameTexts[i];
+    }
+    CHECK(std::string(all.begin(), all.end()) == expected);
+
+    auto middle = frames.size() / 2;
+    auto decompressor = codec.decompressorAt(file, frames[middle].offset,
+                                             frames[middle].bitOffset);
+    decompressor->skip(1000);
+    std::vector<uint8_t> rest(expected.size());
+    rest.resize(decompressor->read(&rest[0], rest.size()));
+    size_t restStart = 1000;
+    for (size_t i = 0; i < middle; ++i) restStart += frameTexts[i].size();
+    CHECK(std::string(rest.begin(), rest.end())
+          == expected.substr(restStart));
+}
+
+#ifdef ZINDEX_HAVE_ZSTD
+
+std::string zstdFrame(const std::string &text, bool checksum) {
+    auto context = ZSTD_createCCtx();
+    REQUIRE(context);
+    ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, checksum);
+    std::string result(ZSTD_compressBound(text.size()), '\0');
+    auto size = ZSTD_compress2(context, &result[0], result.size(),
+                               text.data(), text.size());
+    ZSTD_freeCCtx(context);
+    REQUIRE(!ZSTD_isError(size));
+    result.resize(size);
+    return result;
+}
+
+std::string le32(uint32_t value) {
+    std::string result;
+    for (int i = 0; i < 4; ++i) result += char((value >> (8 * i)) & 0xff);
+    return result;
+}
+
+#endif
+
+}
+
+TEST_CASE("detects compression formats", "[Codec]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/file";
+    auto Detect = [&](const std::string &contents) {
+        writeFile(path, contents);
+        return detectCompression(RandomAccessFile(File(fopen(path.c_str(),
+                                                             "rb"))));
+    };
+    CHECK(Detect("\x1f\x8b\x08\x00 and so on") == "");
+    CHECK(Detect("\x28\xb5\x2f\xfd and so on") == "zstd");
+    CHECK(Detect("\x5e\x2a\x4d\x18 and so on") == "zstd");
+    CHECK(Detect("BZh91AY&SY") == "bzip2");
+    CHECK(Detect(std::string("\xfd" "7zXZ\0\0\x04", 8)) == "xz");
+    CHECK(Detect("ab") == "");
+    CHECK_THROWS_AS(makeCodec("no such format"), const std::runtime_error &);
+}
+
+#ifdef ZINDEX_HAVE_ZSTD
+
+TEST_CASE("zstd frames", "[Codec]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/file.zst";
+    auto texts = testTexts();
+    REQUIRE(codecAvailable("zstd"));
+    auto codec = makeCodec("zstd");
+    CHECK(codec->name() == "zstd");
+    auto Check = [&](const std::string &contents, size_t frameOffset) {
+        writeFile(path, contents);
+        checkFrames(*codec, path, texts);
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        CHECK(codec->findFrames(file)[0].offset == frameOffset);
+    };
+
+    SECTION("found by their headers") {
+        std::string contents;
+        // A skippable frame first, as some tools write.
+        contents += le32(0x184d2a53) + le32(5) + "12345";
+        for (size_t i = 0; i < texts.size(); ++i)
+            contents += zstdFrame(texts[i], i % 2);
+        Check(contents, 13);
+    }
+
+    SECTION("found by the seekable format's table") {
+        std::string contents, table;
+        for (auto &text : texts) {
+            auto frame = zstdFrame(text, false);
+            table += le32(frame.size()) + le32(text.size());
+            contents += frame;
+        }
+        table += le32(texts.size()) + '\0' + le32(0x8f92eab1);
+        contents += le32(0x184d2a5e) + le32(table.size()) + table;
+        Check(contents, 0);
+    }
+
+    SECTION("rejects truncated files") {
+        auto contents = zstdFrame(texts[0], true);
+        writeFile(path, contents.substr(0, contents.size() / 2));
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        CHECK_THROWS_AS(codec->findFrames(file), const std::runtime_error &);
+        std::vector<uint8_t> out;
+        CHECK_THROWS_AS(codec->decompressFrame(
+                file, Frame{0, contents.size() / 2, 0}, out),
+                        const std::runtime_error &);
+    }
+}
+
+#endif
+
+#ifdef ZINDEX_HAVE_BZIP2
+
+TEST_CASE("bzip2 blocks", "[Codec]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/file.bz2";
+    auto texts = testTexts();
+    REQUIRE(codecAvailable("bzip2"));
+    auto codec = makeCodec("bzip2");
+    CHECK(codec->name() == "bzip2");
+    // With 100KB blocks, which then start part way through bytes. The texts
+    // are each a stream, as pbzip2 writes.
+    std::string contents;
+    std::string all;
+    for (auto &text : texts) {
+        std::vector<char> compressed(text.size() * 2);
+        auto size = static_cast<unsigned>(compressed.size());
+        REQUIRE(BZ2_bzBuffToBuffCompress(
+                &compressed[0], &size, const_cast<char *>(text.data()),
+                text.size(), 1, 0, 0) == BZ_OK);
+        contents.append(compressed.data(), size);
+        all += text;
+    }
+    writeFile(path, contents);
+    std::vector<std::string> blockTexts;
+    {
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        auto frames = codec->findFrames(file);
+        REQUIRE(frames.size() > texts.size());
+        CHECK(std::any_of(frames.begin(), frames.end(),
+                          [](const Frame &frame) {
+                              return frame.bitOffset != 0;
+                          }));
+        size_t offset = 0;
+        for (auto &frame : frames) {
+            std::vector<uint8_t> out;
+            codec->decompressFrame(file, frame, out);
+            REQUIRE(!out.empty());
+            blockTexts.push_back(all.substr(offset, out.size()));
+            offset += out.size();
+        }
+        CHECK(offset == all.size());
+    }
+    checkFrames(*codec, path, blockTexts);
+    {
+        // A block's decompressed whole, and counted.
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        auto frames = codec->findFrames(file);
+        auto decompressor = codec->decompressorAt(file, frames[0].offset,
+                                                  frames[0].bitOffset);
+        decompressor->skip(1);
+        CHECK(decompressor->memoryUsed() >= blockTexts[0].size());
+    }
+
+    SECTION("rejects corrupt blocks") {
+        contents[contents.size() / 2] ^= 0x10;
+        writeFile(path, contents);
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        auto DecompressAll = [&]() {
+            for (auto &frame : codec->findFrames(file)) {
+                std::vector<uint8_t> out;
+                codec->decompressFrame(file, frame, out);
+            }
+        };
+        CHECK_THROWS_AS(DecompressAll(), const std::runtime_error &);
+    }
+}
+
+namespace {
+
+uint32_t bzip2Crc(uint32_t crc, const std::string &data) {
+    for (auto c : data) {
+        crc ^= static_cast<uint32_t>(static_cast<unsigned char>(c)) << 24;
+        for (int i = 0; i < 8; ++i)
+            crc = crc & 0x80000000u ? (crc << 1) ^ 0x04c11db7u : crc << 1;
+    }
+    return crc;
+}
+
+// Text which bzip2 -9 compresses to a block whose header holds a block
+// marker, 70 bits in. It's spelled out by the low ten bits of the block's
+// CRC, the randomised bit, origPtr and the first of the bits saying which
+// byte values are used.
+std::string falseMarkerText() {
+    // The first byte is the one biggest, so the text is the last of its
+    // rotations: origPtr is the number of the others. The rest are from the
+    // sixteens the header says are used (the 0th, 3rd, 4th, 6th, 8th, 9th and
+    // 12th), with no runs for bzip2 to shorten.
+    const unsigned char used[] = {0x01, 0x32, 0x43, 0x64, 0x85, 0x96, 0xc1};
+    std::string text(1, '\xc5');
+    uint32_t random = 1;
+    while (text.size() < 1 + 0xac932 - 2) {
+        random = random * 1103515245 + 12345;
+        auto c = static_cast<char>(used[(random >> 16) % sizeof(used)]);
+        if (c != text.back()) text += c;
+    }
+    // The last two bytes make the CRC's low bits right.
+    auto crc = bzip2Crc(0xffffffffu, text);
+    auto usable = [&used](unsigned c) {
+        return std::any_of(std::begin(used), std::end(used),
+                           [c](unsigned char u) { return u >> 4 == c >> 4; })
+               && c < 0xc5;
+    };
+    for (unsigned first = 0; first < 0xc5; ++first) {
+        for (unsigned second = 0; second < 0xc5; ++second) {
+            if (!usable(first) || !usable(second)) continue;
+            std::string last{static_cast<char>(first),
+                             static_cast<char>(second)};
+            if ((~bzip2Crc(crc, last) & 0x3ff) == 0xc5) return text + last;
+        }
+    }
+    FAIL("No bytes give the CRC wanted");
+    return text;
+}
+
+}
+
+TEST_CASE("bzip2 blocks holding markers", "[Codec]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/file.bz2";
+    auto text = falseMarkerText();
+    std::vector<char> compressed(text.size() * 2);
+    auto size = static_cast<unsigned>(compressed.size());
+    REQUIRE(BZ2_bzBuffToBuffCompress(
+            &compressed[0], &size, const_cast<char *>(text.data()),
+            text.size(), 9, 0, 0) == BZ_OK);
+    // "BZh9", the block's own marker, then the one in its header.
+    uint64_t bits = 0;
+    for (auto bit = 102; bit < 150; ++bit)
+        bits = (bits << 1) | ((compressed[bit / 8] >> (7 - bit % 8)) & 1);
+    REQUIRE(bits == 0x314159265359ull);
+    writeFile(path, std::string(compressed.data(), size));
+
+    auto codec = makeCodec("bzip2");
+    RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+    auto frames = codec->findFrames(file);
+    REQUIRE(frames.size() == 2);
+    std::vector<uint8_t> out;
+    codec->decompressFrame(file, frames[0], out);
+    CHECK(out.size() == text.size());
+    codec->decompressFrame(file, frames[1], out);
+    CHECK(std::string(out.begin(), out.end()) == text);
+
+    auto decompressor = codec->decompressorAt(file, frames[0].offset,
+                                              frames[0].bitOffset);
+    std::vector<uint8_t> all(text.size() + 1);
+    all.resize(decompressor->read(&all[0], all.size()));
+    CHECK(std::string(all.begin(), all.end()) == text);
+}
+
+#endif
+
+#ifdef ZINDEX_HAVE_XZ
+
+namespace {
+
+// An xz stream of blocks of up to blockSize bytes.
+std::string xzStream(const std::string &text, uint64_t blockSize,
+                     lzma_check check) {
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_mt options = lzma_mt();
+    options.threads = 2;
+    options.block_size = blockSize;
+    options.preset = 1;
+    options.check = check;
+    REQUIRE(lzma_stream_encoder_mt(&stream, &options) == LZMA_OK);
+    std::string result(lzma_stream_buffer_bound(text.size()), '\0');
+    stream.next_in = reinterpret_cast<const uint8_t *>(text.data());
+    stream.avail_in = text.size();
+    stream.next_out = reinterpret_cast<uint8_t *>(&result[0]);
+    stream.avail_out = result.size();
+    REQUIRE(lzma_code(&stream, LZMA_FINISH) == LZMA_STREAM_END);
+    result.resize(stream.total_out);
+    lzma_end(&stream);
+    return result;
+}
+
+}
+
+TEST_CASE("xz blocks", "[Codec]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/file.xz";
+    auto texts = testTexts();
+    REQUIRE(codecAvailable("xz"));
+    auto codec = makeCodec("xz");
+    CHECK(codec->name() == "xz");
+
+    SECTION("in one stream") {
+        std::string all;
+        for (auto &text : texts) all += text;
+        writeFile(path, xzStream(all, 300000, LZMA_CHECK_CRC64));
+        std::vector<std::string> blockTexts;
+        for (size_t offset = 0; offset < all.size(); offset += 300000)
+            blockTexts.push_back(all.substr(offset, 300000));
+        checkFrames(*codec, path, blockTexts);
+
+        // liblzma's dictionary (1MiB at preset 1) is counted.
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        auto decompressor = codec->decompressorAt(
+                file, codec->findFrames(file)[0].offset, 0);
+        decompressor->skip(1);
+        CHECK(decompressor->memoryUsed() >= 1024 * 1024);
+    }
+
+    SECTION("in several streams, with padding") {
+        std::string contents;
+        const lzma_check checks[] = {LZMA_CHECK_NONE, LZMA_CHECK_CRC32,
+                                     LZMA_CHECK_CRC64, LZMA_CHECK_SHA256};
+        for (size_t i = 0; i < texts.size(); ++i) {
+            contents += xzStream(texts[i], 1 << 30, checks[i % 4]);
+            if (i == 2) contents += std::string(8, '\0');
+        }
+        writeFile(path, contents);
+        checkFrames(*codec, path, texts);
+    }
+
+    SECTION("rejects corrupt files") {
+        auto contents = xzStream(texts[0], 1 << 30, LZMA_CHECK_CRC32);
+        contents[contents.size() / 2] ^= 0x10;
+        writeFile(path, contents);
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")));
+        auto frames = codec->findFrames(file);
+        REQUIRE(frames.size() == 1);
+        std::vector<uint8_t> out;
+        CHECK_THROWS_AS(codec->decompressFrame(file, frames[0], out),
+                        const std::runtime_error &);
+        writeFile(path, contents.substr(0, contents.size() - 1));
+        RandomAccessFile truncated(File(fopen(path.c_str(), "rb")));
+        CHECK_THROWS_AS(makeCodec("xz")->findFrames(truncated),
+                        const std::runtime_error &);
+    }
+}
+
+#endif
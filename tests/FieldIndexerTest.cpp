@@ -35,4 +35,23 @@ TEST_CASE("field indexes", "[FieldIndexer]") {
         indexer.index(sink, "yibble\tbibble\tboing");
         CHECK(sink.captured == vs({"bibble"}));
     }
+    SECTION("Quoted") {
+        FieldIndexer indexer(std::make_shared<FieldSplitter>(
+                ',', FieldSplitter::Quoting::Rfc4180), 2);
+        indexer.index(sink, "1,\"Smith, \"\"J\"\"\",3");
+        indexer.index(sink, "1,\"\",3");
+        indexer.index(sink, "1,plain,3");
+        CHECK(sink.captured == vs({"Smith, \"J\"", "plain"}));
+    }
+    SECTION("Sharing a splitter") {
+        auto splitter = std::make_shared<FieldSplitter>(',');
+        FieldIndexer first(splitter, 1), third(splitter, 3);
+        CaptureSink thirdSink;
+        for (auto line : {"a,b,c", "d,e", "f,g,h,i"}) {
+            first.index(sink, line);
+            third.index(thirdSink, line);
+        }
+        CHECK(sink.captured == vs({"a", "d", "f"}));
+        CHECK(thirdSink.captured == vs({"c", "h"}));
+    }
 }
\ No newline at end of file
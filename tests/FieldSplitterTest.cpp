@@ -0,0 +1,109 @@
+#include "FieldSplitter.h"
+
+#include "catch.hpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+using vs = std::vector<std::string>;
+
+vs Split(const FieldSplitter &splitter, const std::string &line,
+         size_t maxFields = 0) {
+    std::vector<FieldSplitter::Field> fields;
+    splitter.split(line, fields, maxFields);
+    vs result;
+    std::string scratch;
+    for (auto &field : fields)
+        result.push_back(splitter.text(line, field, scratch).str());
+    return result;
+}
+
+// One field at a time, as simply as possible.
+vs SplitSlowly(const std::string &line, char delimiter, bool quoted) {
+    vs result(1);
+    bool inQuotes = false;
+    bool fieldStart = true;
+    for (size_t i = 0; i < line.size(); ++i) {
+        auto c = line[i];
+        auto wasFieldStart = fieldStart;
+        fieldStart = false;
+        if (quoted && c == '"' && inQuotes) {
+            if (i + 1 < line.size() && line[i + 1] == '"') {
+                result.back() += '"';
+                ++i;
+            } else {
+                inQuotes = false;
+            }
+        } else if (quoted && c == '"' && wasFieldStart) {
+            inQuotes = true;
+        } else if (c == delimiter && !inQuotes) {
+            result.emplace_back();
+            fieldStart = true;
+        } else {
+            result.back() += c;
+        }
+    }
+    return result;
+}
+}
+
+TEST_CASE("splits fields", "[FieldSplitter]") {
+    FieldSplitter spaces(' ');
+    CHECK(Split(spaces, "") == vs({""}));
+    CHECK(Split(spaces, "these are words") == vs({"these", "are", "words"}));
+    CHECK(Split(spaces, " a  b ") == vs({"", "a", "", "b", ""}));
+    CHECK(Split(spaces, "these are words", 2) == vs({"these", "are"}));
+    CHECK(Split(spaces, "these are words", 5)
+          == vs({"these", "are", "words"}));
+    CHECK(Split(spaces, "\"not quoted\"") == vs({"\"not", "quoted\""}));
+
+    FieldSplitter csv(',', FieldSplitter::Quoting::Rfc4180);
+    CHECK(csv.quoting() == FieldSplitter::Quoting::Rfc4180);
+    CHECK(Split(csv, "a,\"b,c\",d") == vs({"a", "b,c", "d"}));
+    CHECK(Split(csv, "\"say \"\"hi\"\", ok\",2")
+          == vs({"say \"hi\", ok", "2"}));
+    CHECK(Split(csv, "\"\",x") == vs({"", "x"}));
+    // Only a quote starting a field starts quotes.
+    CHECK(Split(csv, "a\"b,c,\"d\"") == vs({"a\"b", "c", "d"}));
+    CHECK(Split(csv, "5\" disk,\"x,y\",3\"")
+          == vs({"5\" disk", "x,y", "3\""}));
+    CHECK(Split(csv, "\"a\"\"\"") == vs({"a\""}));
+    CHECK(Split(csv, "\"a,b") == vs({"a,b"}));
+
+    SECTION("across blocks") {
+        for (auto quoted : {false, true}) {
+            FieldSplitter splitter('\t', quoted
+                                         ? FieldSplitter::Quoting::Rfc4180
+                                         : FieldSplitter::Quoting::None);
+            std::string line;
+            for (auto i = 0; i < 300; ++i) {
+                if (i) line += '\t';
+                if (i % 3 == 0) line += "\"q\t\"\"x\"\"\"";
+                else if (i % 7 == 0) line += "in\"ch\"";
+                else if (i % 5) line += std::to_string(i * 7919 % 1000);
+                INFO("quoted " << quoted << " line '" << line << "'");
+                REQUIRE(Split(splitter, line)
+                        == SplitSlowly(line, '\t', quoted));
+            }
+        }
+    }
+}
+
+TEST_CASE("shares splits", "[FieldSplitter]") {
+    FieldSplitter splitter(',');
+    splitter.addUser(2);
+    splitter.addUser(3);
+    std::string line = "a,b,c,d";
+    auto &fields = splitter.fields(line);
+    // Split only as far as the users need.
+    REQUIRE(fields.size() == 3);
+    CHECK(&splitter.fields(line) == &fields);
+    // Each user's had this line, so the next is split afresh, even at the
+    // same place.
+    line = "e,f,g,h";
+    std::string scratch;
+    CHECK(splitter.text(line, splitter.fields(line)[0], scratch).str()
+          == "e");
+}
@@ -1,20 +1,96 @@
 #include <fstream>
+#include "Codec.h"
 #include "RegExpIndexer.h"
 #include "Index.h"
+#include "Sqlite.h"
+#include "WindowCodec.h"
 
 #include "catch.hpp"
 #include "TempDir.h"
 #include "LineSink.h"
 #include "CaptureLog.h"
+#include <algorithm>
+#include <functional>
+#include <thread>
 #include <unordered_map>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
 #include <FieldIndexer.h>
 
+#ifdef ZINDEX_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 using namespace std;
 
 namespace {
 
+// Writes data as BGZF (as bgzip does), in members of up to blockSize bytes,
+// ending with an empty member.
+void writeBgzf(const string &path, const string &data, size_t blockSize) {
+    ofstream out(path, ios::binary);
+    auto writeMember = [&out](const char *begin, size_t length) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        REQUIRE(deflateInit2(&zs, 6, Z_DEFLATED, -15, 8,
+                             Z_DEFAULT_STRATEGY) == Z_OK);
+        vector<unsigned char> deflated(deflateBound(&zs, length));
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(begin));
+        zs.avail_in = length;
+        zs.next_out = &deflated[0];
+        zs.avail_out = deflated.size();
+        REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+        deflated.resize(zs.total_out);
+        deflateEnd(&zs);
+        auto le = [&out](uint32_t value, int bytes) {
+            for (int i = 0; i < bytes; ++i) out.put((value >> (8 * i)) & 0xff);
+        };
+        const unsigned char header[] = {
+                0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0};
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        le(deflated.size() + 25, 2);
+        out.write(reinterpret_cast<const char *>(deflated.data()),
+                  deflated.size());
+        le(crc32(crc32(0, nullptr, 0),
+                 reinterpret_cast<const Bytef *>(begin), length), 4);
+        le(length, 4);
+    };
+    for (size_t pos = 0; pos < data.size(); pos += blockSize)
+        writeMember(data.data() + pos, min(blockSize, data.size() - pos));
+    writeMember(nullptr, 0);
+}
+
+// Copies a gzip file, giving the deflate block at its checkpoint'th
+// checkpoint (in the index built for it) an invalid type, and keeping its
+// modification time so the index still matches.
+void copyCorrupted(Log &log, const string &from, const string &to,
+                   int checkpoint) {
+    REQUIRE(system(("cp -p " + from + " " + to).c_str()) == 0);
+    uint64_t blockBit;
+    {
+        Sqlite db(log);
+        db.open(from + ".zindex", true);
+        auto stmt = db.prepare(R"(
+SELECT compressedOffset * 8 - bitOffset FROM AccessPoints
+ORDER BY uncompressedOffset LIMIT 1 OFFSET :checkpoint)");
+        stmt.bindInt64(":checkpoint", checkpoint);
+        REQUIRE(!stmt.step());
+        blockBit = stmt.columnInt64(0);
+    }
+    {
+        // The two bits after the block's BFINAL give its type.
+        File corrupter(fopen(to.c_str(), "r+b"));
+        for (auto bit = blockBit + 1; bit <= blockBit + 2; ++bit) {
+            fseek(corrupter.get(), bit / 8, SEEK_SET);
+            auto byte = fgetc(corrupter.get());
+            fseek(corrupter.get(), bit / 8, SEEK_SET);
+            fputc(byte | (1 << (bit % 8)), corrupter.get());
+        }
+    }
+    REQUIRE(system(("touch -r " + from + " " + to).c_str()) == 0);
+}
+
 struct CaptureSink : LineSink {
     vector<string> captured;
 
@@ -25,6 +101,34 @@ struct CaptureSink : LineSink {
     }
 };
 
+// Indexes the file by line number (skipping the first skipFirst lines), as
+// configured, and returns the rows each query then finds in the index: their
+// first three columns, a row to a line.
+vector<string> BuildAndDump(Log &log, const string &file, uint64_t skipFirst,
+                            function<void(Index::Builder &)> configure,
+                            const vector<string> &queries) {
+    Index::Builder builder(log, File(fopen(file.c_str(), "rb")), file,
+                           file + ".zindex", skipFirst);
+    builder.addIndexer("default", "blah", true, true,
+                       unique_ptr<LineIndexer>(
+                               new RegExpIndexer("^Line ([0-9]+)")));
+    configure(builder);
+    builder.build();
+    Sqlite db(log);
+    db.open(file + ".zindex", true);
+    vector<string> contents;
+    for (auto &query : queries) {
+        auto stmt = db.prepare(query);
+        string rows;
+        while (!stmt.step()) {
+            for (int i = 0; i < 3; ++i) rows += stmt.columnString(i) + " ";
+            rows += "\n";
+        }
+        contents.push_back(rows);
+    }
+    return contents;
+}
+
 }
 
 TEST_CASE("indexes files", "[Index]") {
@@ -176,6 +280,1019 @@ TEST_CASE("indexes files", "[Index]") {
         CheckIndex("65536", 1);
     }
 
+    SECTION("multi-threaded build") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+        builder.addIndexer("default", "blah", true, false, move(indexer))
+                .indexEvery(256 * 1024)
+                .numThreads(4)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("default") == 65536);
+        CaptureSink cs;
+        index.queryIndex("default", "7", cs);
+        REQUIRE(cs.captured.size() == 256);
+        for (auto i = 0u; i < cs.captured.size(); ++i) {
+            auto line = 7 + i * 256;
+            INFO("line " << line);
+            CHECK(cs.captured[i].find("Line " + to_string(line) + " ") == 0);
+        }
+    }
+
+    SECTION("multi-threaded build should throw on duplicates") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+        CHECK_THROWS(
+                builder.addIndexer("default", "blah", true, true,
+                                   move(indexer))
+                        .indexEvery(256 * 1024)
+                        .numThreads(4)
+                        .build());
+    }
+
+    SECTION("unique keys sorted via temporary files") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Hex ([0-9a-f]+)"));
+        builder
+                .addIndexer("default", "blah", false, true, move(indexer))
+                .indexEvery(256 * 1024)
+                .sortMemory(256 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("default") == 65536);
+        CaptureSink cs;
+        index.queryIndex("default", "ffff", cs);
+        REQUIRE(cs.captured.size() == 1);
+        CHECK(cs.captured[0] == "Line 65535 - Hex ffff - Mod 255");
+        CHECK_THROWS(builder.sortMemory(0));
+    }
+
+    SECTION("reports duplicate unique keys") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+        builder.addIndexer("default", "blah", true, true, move(indexer));
+        try {
+            builder.build();
+            FAIL("Should have thrown");
+        } catch (const exception &e) {
+            CHECK(string(e.what()) == "Duplicate key '0' in unique index "
+                    "'default' (lines 256 and 512)");
+        }
+    }
+
+    SECTION("sparse line offsets") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("^Line ([0-9]+)"));
+        builder
+                .addIndexer("default", "blah", true, true, move(indexer))
+                .indexEvery(256 * 1024)
+                .sparseLineOffsets(1000)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.getMetadata().at("lineOffsets") == "sparse");
+        auto CheckLine = [ & ](uint64_t line, const string &expected) {
+            CaptureSink cs;
+            index.getLine(line, cs);
+            INFO("line " << line);
+            REQUIRE(cs.captured.size() == 1);
+            CHECK(cs.captured.at(0) == expected);
+        };
+        CheckLine(1, "Line 1 - Hex 1 - Mod 1");
+        CheckLine(1000, "Line 1000 - Hex 3e8 - Mod 232");
+        CheckLine(1001, "Line 1001 - Hex 3e9 - Mod 233");
+        CheckLine(12345, "Line 12345 - Hex 3039 - Mod 57");
+        CheckLine(65536, "Line 65536 - Hex 10000 - Mod 0");
+        for (uint64_t line = 20000; line < 20100; ++line) {
+            CaptureSink cs;
+            index.getLine(line, cs);
+            REQUIRE(cs.captured.size() == 1);
+            CHECK(cs.captured.at(0).find(
+                    "Line " + to_string(line) + " ") == 0);
+        }
+        CaptureSink none;
+        index.getLine(65537, none);
+        CHECK(none.captured.empty());
+
+        CaptureSink cs;
+        index.queryIndex("default", "54321", cs);
+        REQUIRE(cs.captured.size() == 1);
+        CHECK(cs.captured.at(0) == "Line 54321 - Hex d431 - Mod 49");
+    }
+
+    SECTION("cached lookups") {
+        for (auto sparse : {false, true}) {
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder
+                    .addIndexer("default", "blah", true, true, move(indexer))
+                    .indexEvery(256 * 1024);
+            if (sparse) builder.sparseLineOffsets(1000);
+            builder.build();
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            index.setCacheSize(4 * 1024 * 1024);
+            INFO("sparse " << sparse);
+            for (auto line : {30000, 30001, 29999, 1, 65536, 30500, 2}) {
+                CaptureSink cs;
+                index.getLine(line, cs);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured.at(0).find(
+                        "Line " + to_string(line) + " ") == 0);
+            }
+            auto stats = index.cacheStats();
+            CHECK(stats.misses == 3);
+            CHECK(stats.hits == 4);
+            CHECK(stats.bytes > 0);
+            CHECK(stats.bytes <= 4 * 1024 * 1024);
+
+            index.setCacheSize(0);
+            CHECK(index.cacheStats().bytes == 0);
+            CaptureSink cs;
+            index.getLine(30000, cs);
+            REQUIRE(cs.captured.size() == 1);
+            CHECK(cs.captured.at(0) == "Line 30000 - Hex 7530 - Mod 48");
+        }
+    }
+
+    SECTION("batched lookups") {
+        for (auto sparse : {false, true}) {
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+            builder
+                    .addIndexer("default", "blah", true, false, move(indexer))
+                    .indexEvery(256 * 1024);
+            if (sparse) builder.sparseLineOffsets(1000);
+            builder.build();
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            INFO("sparse " << sparse);
+            auto Numbers = [](const vector<string> &lines) {
+                vector<uint64_t> numbers;
+                for (auto &line : lines)
+                    numbers.push_back(stoull(line.substr(5)));
+                return numbers;
+            };
+
+            vector<uint64_t> wanted{50000, 3, 65536, 3, 70000, 12345, 12346};
+            CaptureSink inFileOrder;
+            index.getLines(wanted, inFileOrder);
+            CHECK(Numbers(inFileOrder.captured)
+                  == (vector<uint64_t>{3, 3, 12345, 12346, 50000, 65536}));
+            CaptureSink inRequestedOrder;
+            index.getLines(wanted, inRequestedOrder,
+                           Index::LineOrder::Requested);
+            CHECK(Numbers(inRequestedOrder.captured)
+                  == (vector<uint64_t>{50000, 3, 65536, 3, 12345, 12346}));
+
+            CaptureSink matches;
+            index.queryIndexMulti("default", {"9", "7"}, matches);
+            REQUIRE(matches.captured.size() == 512);
+            auto numbers = Numbers(matches.captured);
+            CHECK(is_sorted(numbers.begin(), numbers.end()));
+            CHECK(numbers.front() == 7);
+            CHECK(numbers.back() == 65289);
+
+            CaptureSink queryOrder;
+            index.queryIndexMulti("default", {"9", "7"}, queryOrder,
+                                  Index::LineOrder::Requested);
+            REQUIRE(queryOrder.captured.size() == 512);
+            CHECK(Numbers(queryOrder.captured).front() == 9);
+            CHECK(Numbers(queryOrder.captured).at(256) == 7);
+        }
+    }
+
+    SECTION("multi-threaded lookups") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+        builder.addIndexer("default", "blah", true, false, move(indexer))
+                .indexEvery(64 * 1024)
+                .sparseLineOffsets(100)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        vector<uint64_t> wanted;
+        for (uint64_t line = 65536; line > 97; line -= 97)
+            wanted.push_back(line);
+        CaptureSink expected;
+        index.getLines(wanted, expected, Index::LineOrder::Requested);
+        REQUIRE(expected.captured.size() == wanted.size());
+
+        index.setNumThreads(4);
+        for (auto cacheSize : {0, 1024 * 1024}) {
+            index.setCacheSize(cacheSize);
+            INFO("cache size " << cacheSize);
+            CaptureSink inOrder;
+            index.getLines(wanted, inOrder, Index::LineOrder::Requested);
+            CHECK(inOrder.captured == expected.captured);
+            CaptureSink matches;
+            index.queryIndex("default", "17", matches);
+            REQUIRE(matches.captured.size() == 256);
+            for (auto i = 0u; i < matches.captured.size(); ++i) {
+                auto line = 17 + i * 256;
+                INFO("line " << line);
+                CHECK(matches.captured[i].find(
+                        "Line " + to_string(line) + " ") == 0);
+            }
+        }
+        SECTION("reports corrupt data") {
+            // Only the fetch from the corrupt checkpoint fails (as it
+            // inflates, on the thread pool).
+            auto corruptFile = tempDir.path + "/corrupt.gz";
+            copyCorrupted(log, testFile, corruptFile, 3);
+            Index corrupt = Index::load(
+                    log, File(fopen(corruptFile.c_str(), "rb")),
+                    testFile + ".zindex", false);
+            corrupt.setNumThreads(4);
+            corrupt.setCacheSize(0);
+            CaptureSink lines;
+            // Not a std::future_error, which isn't a runtime_error.
+            CHECK_THROWS_AS(corrupt.getLines(wanted, lines,
+                                             Index::LineOrder::Requested),
+                            const std::runtime_error &);
+        }
+    }
+
+    SECTION("concurrent lookups sharing an index") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        unique_ptr<LineIndexer> indexer(new RegExpIndexer("Mod ([0-9]+)"));
+        builder.addIndexer("default", "blah", true, false, move(indexer))
+                .indexEvery(64 * 1024)
+                .build();
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        index.setCacheSize(256 * 1024);
+        vector<thread> threads;
+        vector<size_t> failures(4);
+        for (auto t = 0u; t < failures.size(); ++t) {
+            threads.emplace_back([&index, &failures, t]() {
+                for (uint64_t line = 1 + t; line <= 65536; line += 61) {
+                    CaptureSink cs;
+                    index.getLine(line, cs);
+                    if (cs.captured.size() != 1
+                        || cs.captured[0].find("Line " + to_string(line) + " ")
+                           != 0)
+                        ++failures[t];
+                }
+            });
+        }
+        for (auto &thread : threads) thread.join();
+        CHECK(failures == vector<size_t>(4));
+    }
+
+    SECTION("window codecs") {
+        for (auto codec : {WindowCodec::Raw, WindowCodec::ZlibFast,
+                           WindowCodec::Lz4}) {
+            if (!windowCodecAvailable(codec)) continue;
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer))
+                    .indexEvery(64 * 1024)
+                    .windowCodec(codec)
+                    .build();
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            INFO("codec " << windowCodecName(codec));
+            CHECK(index.getMetadata().at("windowCodec")
+                  == windowCodecName(codec));
+            CaptureSink cs;
+            index.getLines({1, 23456, 65536}, cs);
+            REQUIRE(cs.captured.size() == 3);
+            CHECK(cs.captured.at(1) == "Line 23456 - Hex 5ba0 - Mod 160");
+            CHECK(cs.captured.at(2) == "Line 65536 - Hex 10000 - Mod 0");
+        }
+    }
+
+    SECTION("restart points") {
+        for (auto sparse : {false, true}) {
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer))
+                    .indexEvery(1024 * 1024)
+                    .restartEvery(32 * 1024);
+            if (sparse) builder.sparseLineOffsets(0);
+            builder.build();
+            INFO("sparse " << sparse);
+            {
+                Sqlite db(log);
+                db.open(testFile + ".zindex", true);
+                auto stmt = db.prepare(
+                        "SELECT COUNT(*) FROM AccessPoints");
+                REQUIRE(!stmt.step());
+                // Only three are checkpoints; restart points are limited by
+                // how often deflate blocks end.
+                CHECK(stmt.columnInt64(0) > 3);
+            }
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            CHECK(index.getMetadata().at("restartEvery") == "32768");
+            for (uint64_t line = 1; line <= 65536; line += 997) {
+                CaptureSink cs;
+                index.getLine(line, cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+    }
+
+    SECTION("refining checkpoints") {
+        for (auto sparse : {false, true}) {
+            for (size_t threads : {1, 4}) {
+                Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                       testFile, testFile + ".zindex", 0);
+                unique_ptr<LineIndexer> indexer(
+                        new RegExpIndexer("^Line ([0-9]+)"));
+                builder.addIndexer("default", "blah", true, true,
+                                   move(indexer))
+                        .restartEvery(1024 * 1024);
+                if (sparse) builder.sparseLineOffsets(0);
+                builder.build();
+                INFO("sparse " << sparse << " threads " << threads);
+                auto count = [&](const string &table) {
+                    Sqlite db(log);
+                    db.open(testFile + ".zindex", true);
+                    auto stmt = db.prepare("SELECT COUNT(*) FROM " + table);
+                    REQUIRE(!stmt.step());
+                    return stmt.columnInt64(0);
+                };
+                auto accessPoints = count("AccessPoints");
+                auto keys = count("index_default");
+                Index::refineCheckpoints(
+                        log, File(fopen(testFile.c_str(), "rb")),
+                        testFile + ".zindex", 64 * 1024, threads);
+                CHECK(count("AccessPoints") > accessPoints);
+                CHECK(count("index_default") == keys);
+                Index index = Index::load(
+                        log, File(fopen(testFile.c_str(), "rb")),
+                        testFile + ".zindex", false);
+                CHECK(index.estimateFetchSeconds({1, 65536}) >= 0);
+                for (uint64_t line = 1; line <= 65536; line += 997) {
+                    CaptureSink cs;
+                    index.getLine(line, cs);
+                    INFO("line " << line);
+                    REQUIRE(cs.captured.size() == 1);
+                    CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                          == 0);
+                }
+            }
+        }
+        SECTION("reports corrupt data") {
+            auto corruptFile = tempDir.path + "/corrupt.gz";
+            copyCorrupted(log, testFile, corruptFile, 2);
+            // Not a std::future_error, which isn't a runtime_error.
+            CHECK_THROWS_AS(Index::refineCheckpoints(
+                                    log, File(fopen(corruptFile.c_str(), "rb")),
+                                    testFile + ".zindex", 64 * 1024, 4),
+                            const std::runtime_error &);
+        }
+    }
+
+    SECTION("appending") {
+        auto Build = [&](Index::Builder::Mode mode, const string &creation,
+                         uint64_t skipFirst) {
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", skipFirst,
+                                   mode);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", creation, true, true, move(indexer))
+                    .indexEvery(256 * 1024)
+                    .build();
+        };
+        Build(Index::Builder::Mode::Create, "blah", 2);
+        {
+            auto extraFile = tempDir.path + "/extra.log";
+            ofstream fileOut(extraFile);
+            for (auto i = 65537; i <= 70000; ++i)
+                fileOut << "Line " << i << " - appended" << endl;
+            fileOut.close();
+            REQUIRE(system(("gzip -f " + extraFile + " && cat " + extraFile
+                            + ".gz >> " + testFile).c_str()) == 0);
+        }
+        SECTION("with the same indices") {
+            // Skipping the same lines as before, without being told.
+            Build(Index::Builder::Mode::Append, "blah", 0);
+            Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                      testFile + ".zindex", false);
+            CHECK(index.indexSize("default") == 70000 - 2);
+            for (uint64_t line : {3, 65536, 65537, 70000}) {
+                CaptureSink cs;
+                index.queryIndex("default", to_string(line), cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+        SECTION("with different indices") {
+            REQUIRE_THROWS(Build(Index::Builder::Mode::Append, "other", 0));
+        }
+        SECTION("skipping different lines") {
+            REQUIRE_THROWS(Build(Index::Builder::Mode::Append, "blah", 1));
+        }
+    }
+
+    SECTION("multi-member files") {
+        // As made by cat, or bgzip: the first member split into several,
+        // with an empty one along the way.
+        auto memberFile = tempDir.path + "/members.gz";
+        {
+            REQUIRE(system(("gzip -dc " + testFile + " | split -b 300000 - "
+                            + tempDir.path + "/part_").c_str()) == 0);
+            REQUIRE(system(("cd " + tempDir.path + " && : > part_ab0 && "
+                            + "gzip part_* && cat part_* > "
+                            + memberFile).c_str()) == 0);
+        }
+        for (auto sparse : {false, true}) {
+            INFO("sparse " << sparse);
+            Index::Builder builder(log, File(fopen(memberFile.c_str(), "rb")),
+                                   memberFile, memberFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer));
+            if (sparse) builder.sparseLineOffsets(0);
+            builder.build();
+            {
+                Sqlite db(log);
+                db.open(memberFile + ".zindex", true);
+                auto stmt = db.prepare(R"(
+SELECT COUNT(*), SUM(window IS NULL) FROM AccessPoints)");
+                REQUIRE(!stmt.step());
+                // One checkpoint, with no window, for each non-empty member.
+                CHECK(stmt.columnInt64(0) > 3);
+                CHECK(stmt.columnInt64(1) == stmt.columnInt64(0));
+            }
+            Index index = Index::load(
+                    log, File(fopen(memberFile.c_str(), "rb")),
+                    memberFile + ".zindex", false);
+            CHECK(index.indexSize("default") == 65536);
+            for (uint64_t line = 1; line <= 65536; line += 997) {
+                CaptureSink cs;
+                index.getLine(line, cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+    }
+
+    SECTION("BGZF files in parallel") {
+        string text;
+        for (auto i = 1; i <= 65536; ++i)
+            text += "Line " + to_string(i) + " - BGZF\n";
+        text += "Line 65537 - unterminated";
+        auto bgzfFile = tempDir.path + "/test.bgz";
+        writeBgzf(bgzfFile, text, 65280);
+        auto Build = [&](size_t threads, bool sparse) {
+            return BuildAndDump(
+                    log, bgzfFile, 10,
+                    [&](Index::Builder &builder) {
+                        builder.numThreads(threads);
+                        if (sparse) builder.sparseLineOffsets(100);
+                    },
+                    {"SELECT uncompressedOffset, uncompressedEndOffset, "
+                             "compressedOffset, bitOffset FROM AccessPoints",
+                     sparse ? "SELECT line, offset, 0 FROM LineSamples"
+                            : "SELECT * FROM LineOffsets",
+                     "SELECT * FROM index_default"});
+        };
+        for (auto sparse : {false, true}) {
+            INFO("sparse " << sparse);
+            auto serial = Build(1, sparse);
+            log.records.clear();
+            auto parallel = Build(4, sparse);
+            CHECK(find_if(log.records.begin(), log.records.end(),
+                          [](const CaptureLog::Record &record) {
+                              return record.message.find(
+                                      "BGZF members in parallel")
+                                     != string::npos;
+                          }) != log.records.end());
+            CHECK(serial == parallel);
+            Index index = Index::load(
+                    log, File(fopen(bgzfFile.c_str(), "rb")),
+                    bgzfFile + ".zindex", false);
+            CHECK(index.indexSize("default") == 65537 - 10);
+            for (uint64_t line : {11, 12345, 65536, 65537}) {
+                CaptureSink cs;
+                index.queryIndex("default", to_string(line), cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+        SECTION("reports corrupt members") {
+            {
+                // The second member's deflate data gets an invalid block
+                // type.
+                File corrupter(fopen(bgzfFile.c_str(), "r+b"));
+                unsigned char size[2];
+                fseek(corrupter.get(), 16, SEEK_SET);
+                REQUIRE(fread(size, 1, 2, corrupter.get()) == 2);
+                fseek(corrupter.get(), size[0] + (size[1] << 8) + 1 + 18,
+                      SEEK_SET);
+                fputc(0x07, corrupter.get());
+            }
+            // Not a std::future_error, which isn't a runtime_error.
+            CHECK_THROWS_AS(Build(4, false), const std::runtime_error &);
+        }
+    }
+
+    SECTION("concatenated gzip files in parallel") {
+        // Several members, one empty and one stored rather than compressed,
+        // holding what looks like a member header over 1MiB in, where a
+        // range starts.
+        auto lines = [](int from, int to) {
+            string text;
+            for (auto i = from; i <= to; ++i)
+                text += "Line " + to_string(i) + " - concatenated\n";
+            return text;
+        };
+        auto gzipMember = [](const string &text, int level) {
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            REQUIRE(deflateInit2(&zs, level, Z_DEFLATED, 31, 8,
+                                 Z_DEFAULT_STRATEGY) == Z_OK);
+            string deflated(deflateBound(&zs, text.size()), '\0');
+            zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(
+                    text.data()));
+            zs.avail_in = text.size();
+            zs.next_out = reinterpret_cast<Bytef *>(&deflated[0]);
+            zs.avail_out = deflated.size();
+            REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+            deflated.resize(zs.total_out);
+            deflateEnd(&zs);
+            return deflated;
+        };
+        string fakeHeader("\x1f\x8b\x08\0\0\0\0\0\0\x03", 10);
+        auto concatenated = gzipMember(lines(1, 20000), 6)
+                            + gzipMember("", 6)
+                            + gzipMember(lines(20001, 60000) + fakeHeader
+                                         + "\n" + lines(60001, 65000), 0);
+        auto lastMember = concatenated.size();
+        concatenated += gzipMember(lines(65001, 70000), 6);
+        auto catFile = tempDir.path + "/concatenated.gz";
+        {
+            ofstream out(catFile, ios::binary);
+            out.write(concatenated.data(), concatenated.size());
+        }
+        auto Build = [&](size_t threads) {
+            return BuildAndDump(
+                    log, catFile, 0,
+                    [&](Index::Builder &builder) {
+                        builder.numThreads(threads).indexEvery(100000);
+                    },
+                    {"SELECT uncompressedOffset, uncompressedEndOffset, "
+                             "compressedOffset * 8 - bitOffset "
+                             "FROM AccessPoints",
+                     "SELECT uncompressedOffset, HEX(window), 0 "
+                             "FROM AccessPoints",
+                     "SELECT * FROM LineOffsets",
+                     "SELECT * FROM index_default"});
+        };
+        auto serial = Build(1);
+        log.records.clear();
+        auto parallel = Build(4);
+        CHECK(find_if(log.records.begin(), log.records.end(),
+                      [](const CaptureLog::Record &record) {
+                          return record.message.find(
+                                  "gzip members in parallel")
+                                 != string::npos;
+                      }) != log.records.end());
+        CHECK(serial == parallel);
+        Index index = Index::load(log, File(fopen(catFile.c_str(), "rb")),
+                                  catFile + ".zindex", false);
+        CHECK(index.indexSize("default") == 70000);
+        for (uint64_t line : {1, 20000, 20001, 60000, 60001, 65001, 70000}) {
+            CaptureSink cs;
+            index.queryIndex("default", to_string(line), cs);
+            INFO("line " << line);
+            REQUIRE(cs.captured.size() == 1);
+            CHECK(cs.captured[0] == "Line " + to_string(line)
+                                    + " - concatenated");
+        }
+        SECTION("reports corrupt members") {
+            {
+                // The last member's deflate data gets an invalid block type.
+                File corrupter(fopen(catFile.c_str(), "r+b"));
+                fseek(corrupter.get(), lastMember + 10, SEEK_SET);
+                fputc(0x07, corrupter.get());
+            }
+            CHECK_THROWS_AS(Build(4), const std::runtime_error &);
+        }
+    }
+
+    SECTION("speculative inflate") {
+        // Besides the test file: one stored rather than compressed, so there
+        // are no blocks to find, and one in several members.
+        auto storedFile = tempDir.path + "/stored.gz";
+        auto memberFile = tempDir.path + "/members.gz";
+        REQUIRE(system(("gzip -dc " + testFile + " | split -b 500000 - "
+                        + tempDir.path + "/part_ && gzip " + tempDir.path
+                        + "/part_* && cat " + tempDir.path + "/part_* > "
+                        + memberFile).c_str()) == 0);
+        {
+            // Ending with an empty block of its own, as some tools do.
+            gzFile in = gzopen(testFile.c_str(), "rb");
+            REQUIRE(in);
+            string text;
+            char buffer[16384];
+            int numRead;
+            while ((numRead = gzread(in, buffer, sizeof(buffer))) > 0)
+                text.append(buffer, numRead);
+            gzclose(in);
+            z_stream zs;
+            memset(&zs, 0, sizeof(zs));
+            REQUIRE(deflateInit2(&zs, 0, Z_DEFLATED, 31, 8,
+                                 Z_DEFAULT_STRATEGY) == Z_OK);
+            vector<unsigned char> deflated(deflateBound(&zs, text.size()));
+            zs.next_in = reinterpret_cast<Bytef *>(&text[0]);
+            zs.avail_in = text.size();
+            zs.next_out = &deflated[0];
+            zs.avail_out = deflated.size();
+            REQUIRE(deflate(&zs, Z_SYNC_FLUSH) == Z_OK);
+            REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+            deflateEnd(&zs);
+            ofstream out(storedFile, ios::binary);
+            out.write(reinterpret_cast<const char *>(deflated.data()),
+                      zs.total_out);
+        }
+        auto Build = [&](const string &file, uint64_t pieceBytes) {
+            return BuildAndDump(
+                    log, file, 0,
+                    [&](Index::Builder &builder) {
+                        builder.indexEvery(100000);
+                        if (pieceBytes)
+                            builder.numThreads(4).speculativeInflate(
+                                    pieceBytes);
+                    },
+                    {"SELECT uncompressedOffset, uncompressedEndOffset, "
+                             "compressedOffset * 8 - bitOffset "
+                             "FROM AccessPoints",
+                     "SELECT uncompressedOffset, HEX(window), 0 "
+                             "FROM AccessPoints",
+                     "SELECT * FROM LineOffsets",
+                     "SELECT * FROM index_default"});
+        };
+        for (auto file : {testFile, storedFile, memberFile}) {
+            INFO("file " << file);
+            auto serial = Build(file, 0);
+            log.records.clear();
+            auto speculative = Build(file, 20000);
+            CHECK(find_if(log.records.begin(), log.records.end(),
+                          [](const CaptureLog::Record &record) {
+                              return record.message.find(
+                                      "pieces speculatively")
+                                     != string::npos;
+                          }) != log.records.end());
+            CHECK(serial == speculative);
+            Index index = Index::load(log, File(fopen(file.c_str(), "rb")),
+                                      file + ".zindex", false);
+            for (uint64_t line : {1, 12345, 40000, 65536}) {
+                CaptureSink cs;
+                index.queryIndex("default", to_string(line), cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+        SECTION("reports a corrupt first piece") {
+            // Whose start is known, so it can't be a wrong guess.
+            auto corruptFile = tempDir.path + "/corrupt.gz";
+            copyCorrupted(log, testFile, corruptFile, 0);
+            // Not a std::future_error, which isn't a runtime_error.
+            CHECK_THROWS_AS(Build(corruptFile, 20000),
+                            const std::runtime_error &);
+        }
+    }
+
+    SECTION("other compression formats") {
+        vector<string> files;
+#ifdef ZINDEX_HAVE_ZSTD
+        {
+            // In frames of up to 200KB, as zstd's seekable format writes
+            // them.
+            auto zstdFile = tempDir.path + "/test.log.zst";
+            gzFile in = gzopen(testFile.c_str(), "rb");
+            REQUIRE(in);
+            ofstream out(zstdFile, ios::binary);
+            vector<char> text(200000);
+            vector<char> frame(ZSTD_compressBound(text.size()));
+            int numRead;
+            while ((numRead = gzread(in, &text[0], text.size())) > 0) {
+                auto size = ZSTD_compress(&frame[0], frame.size(), &text[0],
+                                          numRead, 3);
+                REQUIRE(!ZSTD_isError(size));
+                out.write(frame.data(), size);
+            }
+            gzclose(in);
+            files.push_back(zstdFile);
+        }
+#endif
+        if (codecAvailable("bzip2")) {
+            files.push_back(tempDir.path + "/test.log.bz2");
+            REQUIRE(system(("gzip -dc " + testFile + " | bzip2 -1 > "
+                            + files.back()).c_str()) == 0);
+        }
+        if (codecAvailable("xz")) {
+            files.push_back(tempDir.path + "/test.log.xz");
+            REQUIRE(system(("gzip -dc " + testFile
+                            + " | xz -1 --block-size=200000 > "
+                            + files.back()).c_str()) == 0);
+        }
+        for (auto &file : files) {
+            INFO("file " << file);
+            Index::Builder builder(log, File(fopen(file.c_str(), "rb")),
+                                   file, file + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer))
+                    .numThreads(2)
+                    .build();
+            Index index = Index::load(log, File(fopen(file.c_str(), "rb")),
+                                      file + ".zindex", false);
+            CHECK(index.indexSize("default") == 65536);
+            Sqlite db(log);
+            db.open(file + ".zindex", true);
+            auto stmt = db.prepare(
+                    "SELECT COUNT(*), SUM(LENGTH(window)) FROM AccessPoints");
+            REQUIRE(!stmt.step());
+            CHECK(stmt.columnInt64(0) > 5);
+            CHECK(stmt.columnInt64(1) == 0);
+            for (uint64_t line : {1, 12345, 40000, 65536}) {
+                CaptureSink cs;
+                index.queryIndex("default", to_string(line), cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+            CaptureSink cs;
+            index.getLine(65536, cs);
+            REQUIRE(cs.captured.size() == 1);
+            CHECK(cs.captured[0] == "Line 65536 - Hex 10000 - Mod 0");
+        }
+    }
+
+    SECTION("rewrite seekable") {
+        auto rewritten = tempDir.path + "/rewritten.gz";
+        for (size_t threads : {1, 3}) {
+            INFO("threads " << threads);
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, rewritten + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer))
+                    .numThreads(threads)
+                    .rewriteSeekable(rewritten)
+                    .build();
+            auto Contents = [](const string &file) {
+                gzFile in = gzopen(file.c_str(), "rb");
+                REQUIRE(in);
+                string text;
+                char buffer[16384];
+                int numRead;
+                while ((numRead = gzread(in, buffer, sizeof(buffer))) > 0)
+                    text.append(buffer, numRead);
+                gzclose(in);
+                return text;
+            };
+            auto text = Contents(rewritten);
+            CHECK(text == Contents(testFile));
+
+            Index index = Index::load(log, File(fopen(rewritten.c_str(),
+                                                      "rb")),
+                                      rewritten + ".zindex", false);
+            CHECK(index.getMetadata().at("compressedFile") == rewritten);
+            Sqlite db(log);
+            db.open(rewritten + ".zindex", true);
+            auto stmt = db.prepare(
+                    "SELECT COUNT(*), SUM(LENGTH(window)) FROM AccessPoints");
+            REQUIRE(!stmt.step());
+            CHECK(stmt.columnInt64(0) == (text.size() + 0xfeff) / 0xff00);
+            CHECK(stmt.columnInt64(1) == 0);
+            for (uint64_t line : {1, 12345, 40000, 65536}) {
+                CaptureSink cs;
+                index.queryIndex("default", to_string(line), cs);
+                INFO("line " << line);
+                REQUIRE(cs.captured.size() == 1);
+                CHECK(cs.captured[0].find("Line " + to_string(line) + " ")
+                      == 0);
+            }
+        }
+
+        // Then indexing the new file finds its members without inflating.
+        log.records.clear();
+        {
+            Index::Builder builder(log, File(fopen(rewritten.c_str(), "rb")),
+                                   rewritten, rewritten + ".zindex", 0);
+            builder.numThreads(2).build();
+        }
+        CHECK(find_if(log.records.begin(), log.records.end(),
+                      [](const CaptureLog::Record &record) {
+                          return record.message.find("BGZF members in "
+                                                     "parallel")
+                                 != string::npos;
+                      }) != log.records.end());
+
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        CHECK_THROWS_AS(builder.rewriteSeekable(testFile).build(),
+                        const std::runtime_error &);
+    }
+
+    SECTION("several named indices") {
+        Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                               testFile, testFile + ".zindex", 0);
+        builder.addIndexer("line", "^Line ([0-9]+)", true, true,
+                           unique_ptr<LineIndexer>(
+                                   new RegExpIndexer("^Line ([0-9]+)")))
+                .addIndexer("mod", "Mod ([0-9]+)", true, false,
+                            unique_ptr<LineIndexer>(
+                                    new RegExpIndexer("Mod ([0-9]+)")))
+                .addIndexer("hex", "Field 5", false, true,
+                            unique_ptr<LineIndexer>(
+                                    new FieldIndexer(' ', 5)));
+        CHECK_THROWS_AS(builder.addIndexer(
+                "mod", "again", true, false, unique_ptr<LineIndexer>(
+                        new RegExpIndexer("Mod ([0-9]+)"))),
+                        const std::runtime_error &);
+        CHECK_THROWS_AS(builder.addIndexer(
+                "no spaces", "x", true, false, unique_ptr<LineIndexer>(
+                        new RegExpIndexer("Mod ([0-9]+)"))),
+                        const std::runtime_error &);
+        builder.numThreads(2).build();
+
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.indexSize("line") == 65536);
+        CHECK(index.indexSize("mod") == 65536);
+        CHECK(index.indexSize("hex") == 65536);
+        auto Query = [&](const string &name, const string &query) {
+            CaptureSink cs;
+            index.queryIndex(name, query, cs);
+            return cs.captured;
+        };
+        CHECK(Query("line", "4660")
+              == vector<string>{"Line 4660 - Hex 1234 - Mod 52"});
+        CHECK(Query("hex", "1234")
+              == vector<string>{"Line 4660 - Hex 1234 - Mod 52"});
+        CHECK(Query("mod", "52").size() == 256);
+        CHECK_THROWS_AS(Query("default", "1"), const std::runtime_error &);
+    }
+
+    SECTION("adding indices") {
+        for (auto sparse : {false, true}) {
+            for (size_t threads : {1, 4}) {
+                INFO("sparse " << sparse << " threads " << threads);
+                {
+                    Index::Builder builder(
+                            log, File(fopen(testFile.c_str(), "rb")),
+                            testFile, testFile + ".zindex", 1);
+                    builder.addIndexer("line", "^Line ([0-9]+)", true, true,
+                                       unique_ptr<LineIndexer>(
+                                               new RegExpIndexer(
+                                                       "^Line ([0-9]+)")))
+                            .indexEvery(64 * 1024);
+                    if (sparse) builder.sparseLineOffsets(0);
+                    builder.build();
+                }
+                auto count = [&](const string &table) {
+                    Sqlite db(log);
+                    db.open(testFile + ".zindex", true);
+                    auto stmt = db.prepare("SELECT COUNT(*) FROM " + table);
+                    REQUIRE(!stmt.step());
+                    return stmt.columnInt64(0);
+                };
+                auto accessPoints = count("AccessPoints");
+                REQUIRE(accessPoints > 4);
+                auto Add = [&](const string &name, bool unique,
+                               uint64_t skipFirst) {
+                    Index::Builder builder(
+                            log, File(fopen(testFile.c_str(), "rb")),
+                            testFile, testFile + ".zindex", skipFirst,
+                            Index::Builder::Mode::AddIndices);
+                    builder.addIndexer(name, "Mod ([0-9]+)", true, unique,
+                                       unique_ptr<LineIndexer>(
+                                               new RegExpIndexer(
+                                                       "Mod ([0-9]+)")))
+                            .addIndexer(name + "_hex", "Field 5", false, true,
+                                        unique_ptr<LineIndexer>(
+                                                new FieldIndexer(' ', 5)))
+                            .numThreads(threads)
+                            .build();
+                };
+                // Mod isn't unique, so this fails, and leaves no trace.
+                CHECK_THROWS_AS(Add("mod", true, 0),
+                                const std::runtime_error &);
+                // The index skipped just the first line.
+                CHECK_THROWS_AS(Add("mod", false, 2),
+                                const std::runtime_error &);
+                // Which is skipped again without being asked.
+                Add("mod", false, 0);
+                CHECK_THROWS_AS(Add("mod", false, 1),
+                                const std::runtime_error &);
+                CHECK(count("AccessPoints") == accessPoints);
+
+                Index index = Index::load(
+                        log, File(fopen(testFile.c_str(), "rb")),
+                        testFile + ".zindex", false);
+                CHECK(index.indexSize("line") == 65535);
+                CHECK(index.indexSize("mod") == 65535);
+                CHECK(index.indexSize("mod_hex") == 65535);
+                auto Query = [&](const string &name, const string &query) {
+                    CaptureSink cs;
+                    index.queryIndex(name, query, cs);
+                    return cs.captured;
+                };
+                CHECK(Query("mod_hex", "1234")
+                      == vector<string>{"Line 4660 - Hex 1234 - Mod 52"});
+                CHECK(Query("mod_hex", "ffff")
+                      == vector<string>{"Line 65535 - Hex ffff - Mod 255"});
+                CHECK(Query("mod_hex", "1").empty());
+                CHECK(Query("mod", "52").size() == 256);
+                CHECK(Query("mod", "1").size() == 255);
+            }
+        }
+    }
+
+    SECTION("adaptive checkpoints") {
+        auto Build = [&](function<void(Index::Builder &)> configure) {
+            Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
+                                   testFile, testFile + ".zindex", 0);
+            unique_ptr<LineIndexer> indexer(
+                    new RegExpIndexer("^Line ([0-9]+)"));
+            builder.addIndexer("default", "blah", true, true, move(indexer))
+                    .indexEvery(0);
+            configure(builder);
+            builder.build();
+            Sqlite db(log);
+            db.open(testFile + ".zindex", true);
+            auto stmt = db.prepare(R"(
+SELECT COUNT(*), SUM(LENGTH(window)), MIN(decompressMicros)
+FROM AccessPoints)");
+            REQUIRE(!stmt.step());
+            return vector<int64_t>{stmt.columnInt64(0), stmt.columnInt64(1),
+                                   stmt.columnInt64(2)};
+        };
+        SECTION("no criteria") {
+            CHECK(Build([](Index::Builder &) { }).at(0) == 1);
+        }
+        SECTION("by time") {
+            auto result = Build([](Index::Builder &builder) {
+                builder.indexEveryTime(1e-9);
+            });
+            // Every block, then.
+            CHECK(result.at(0) > 3);
+            CHECK(result.at(2) >= 0);
+        }
+        SECTION("by keys") {
+            auto result = Build([](Index::Builder &builder) {
+                builder.indexEveryKeys(5000);
+            });
+            // Keys aren't counted until the first batch of lines is indexed,
+            // and checkpoints can only go at block boundaries.
+            CHECK(result.at(0) >= 5);
+            CHECK(result.at(0) <= 14);
+        }
+        SECTION("by budget") {
+            auto everyBlock = Build([](Index::Builder &builder) {
+                builder.indexEveryTime(1e-9);
+            });
+            auto budget = everyBlock.at(1) / 2;
+            auto result = Build([budget](Index::Builder &builder) {
+                builder.checkpointBudget(budget);
+            });
+            CHECK(result.at(0) > 1);
+            CHECK(result.at(0) < everyBlock.at(0));
+            CHECK(result.at(1) <= budget * 3 / 2);
+        }
+        Index index = Index::load(log, File(fopen(testFile.c_str(), "rb")),
+                                  testFile + ".zindex", false);
+        CHECK(index.estimateFetchSeconds({1, 30000, 65536}) >= 0);
+        CHECK(index.estimateFetchSeconds({}) == 0);
+    }
+
     SECTION("field-based tests with skip") {
         Index::Builder builder(log, File(fopen(testFile.c_str(), "rb")),
                                testFile, testFile + ".zindex",
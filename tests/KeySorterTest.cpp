@@ -0,0 +1,127 @@
+#include "KeySorter.h"
+
+#include "catch.hpp"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+IndexKeys shuffledKeys(size_t count, bool numeric) {
+    IndexKeys keys;
+    for (size_t i = 0; i < count; ++i) {
+        IndexKey key;
+        key.numeric = static_cast<int64_t>(i) - 100;
+        key.alpha = numeric ? "" : std::to_string(i);
+        key.line = i + 1;
+        key.offset = i % 7;
+        keys.push_back(key);
+    }
+    std::mt19937 rng(1234);
+    std::shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+IndexKeys sortAll(KeySorter &sorter, const IndexKeys &keys) {
+    for (size_t i = 0; i < keys.size(); i += 100) {
+        auto end = std::min(keys.size(), i + 100);
+        sorter.add(IndexKeys(keys.begin() + i, keys.begin() + end));
+    }
+    IndexKeys result;
+    sorter.finish([&result](const IndexKeys &sorted) {
+        result.insert(result.end(), sorted.begin(), sorted.end());
+    });
+    return result;
+}
+
+}
+
+TEST_CASE("sorts numeric keys", "[KeySorter]") {
+    auto keys = shuffledKeys(10000, true);
+    SECTION("in memory") {
+        KeySorter sorter(true, 1024 * 1024 * 1024);
+        auto sorted = sortAll(sorter, keys);
+        REQUIRE(sorted.size() == 10000);
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            REQUIRE(sorted[i].numeric == static_cast<int64_t>(i) - 100);
+            REQUIRE(sorted[i].line == i + 1);
+            REQUIRE(sorted[i].offset == i % 7);
+        }
+    }
+    SECTION("spilling to disk") {
+        KeySorter sorter(true, 64 * 1024);
+        for (auto &key : keys) sorter.add(IndexKeys{ key });
+        CHECK(sorter.numSpilledRuns() > 1);
+        IndexKeys sorted;
+        sorter.finish([&sorted](const IndexKeys &batch) {
+            sorted.insert(sorted.end(), batch.begin(), batch.end());
+        });
+        REQUIRE(sorted.size() == 10000);
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            REQUIRE(sorted[i].numeric == static_cast<int64_t>(i) - 100);
+            REQUIRE(sorted[i].line == i + 1);
+        }
+    }
+    SECTION("with more runs than can be merged at once") {
+        KeySorter sorter(true, 1024);
+        auto sorted = sortAll(sorter, keys);
+        REQUIRE(sorted.size() == 10000);
+        for (size_t i = 0; i < sorted.size(); ++i)
+            REQUIRE(sorted[i].numeric == static_cast<int64_t>(i) - 100);
+    }
+}
+
+TEST_CASE("merges runs in levels", "[KeySorter]") {
+    // A run per key: two full merges leave 63 runs plus the two merged
+    // ones, more than can be merged at once at the end.
+    auto keys = shuffledKeys(64 * 2 + 63, true);
+    KeySorter sorter(true, 1);
+    auto sorted = sortAll(sorter, keys);
+    CHECK(sorter.numSpilledRuns() == keys.size());
+    REQUIRE(sorted.size() == keys.size());
+    for (size_t i = 0; i < sorted.size(); ++i)
+        REQUIRE(sorted[i].numeric == static_cast<int64_t>(i) - 100);
+}
+
+TEST_CASE("needs some memory", "[KeySorter]") {
+    CHECK_THROWS(KeySorter(true, 0));
+}
+
+TEST_CASE("sorts alpha keys", "[KeySorter]") {
+    auto keys = shuffledKeys(5000, false);
+    auto expected = keys;
+    std::sort(expected.begin(), expected.end(),
+              [](const IndexKey &lhs, const IndexKey &rhs) {
+                  return lhs.alpha < rhs.alpha;
+              });
+    KeySorter sorter(false, 16 * 1024);
+    auto sorted = sortAll(sorter, keys);
+    REQUIRE(sorted.size() == expected.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        REQUIRE(sorted[i].alpha == expected[i].alpha);
+        REQUIRE(sorted[i].line == expected[i].line);
+    }
+}
+
+TEST_CASE("orders equal keys by line", "[KeySorter]") {
+    KeySorter sorter(false, 1024);
+    IndexKeys keys;
+    for (uint64_t line = 100; line > 0; --line) {
+        IndexKey key;
+        key.numeric = 0;
+        key.alpha = line % 2 ? "odd" : "even";
+        key.line = line;
+        key.offset = 0;
+        keys.push_back(key);
+    }
+    auto sorted = sortAll(sorter, keys);
+    REQUIRE(sorted.size() == 100);
+    for (size_t i = 0; i < 50; ++i) {
+        REQUIRE(sorted[i].alpha == "even");
+        REQUIRE(sorted[i].line == (i + 1) * 2);
+        REQUIRE(sorted[i + 50].alpha == "odd");
+        REQUIRE(sorted[i + 50].line == i * 2 + 1);
+    }
+}
@@ -11,9 +11,11 @@ namespace {
 struct RecordingSink : LineSink {
     std::vector<std::string> lines;
     std::vector<size_t> fileOffsets;
+    std::vector<size_t> lineNumbers;
 
-    void onLine(size_t, size_t offset,
+    void onLine(size_t lineNumber, size_t offset,
             const char *line, size_t length) override {
+        lineNumbers.emplace_back(lineNumber);
         lines.emplace_back(line, length);
         fileOffsets.emplace_back(offset);
     }
@@ -29,23 +31,22 @@ TEST_CASE("finds lines", "[LineFinder]") {
     RecordingSink sink;
     LineFinder finder(sink);
 
-    REQUIRE(finder.lineOffsets().empty());
+    REQUIRE(finder.numLines() == 0);
+    REQUIRE(finder.endOffset() == 0);
     REQUIRE(sink.empty());
 
     SECTION("empty input") {
         finder.add(nullptr, 0, true);
-        REQUIRE(finder.lineOffsets().size() == 1);
-        REQUIRE(finder.lineOffsets()[0] == uint64_t(0));
+        REQUIRE(finder.numLines() == 0);
+        REQUIRE(finder.endOffset() == uint64_t(0));
         REQUIRE(sink.empty());
     }
 
     SECTION("single line") {
         static const uint8_t one[] = "One\n";
         finder.add(one, sizeof(one) - 1, true);
-        const auto &lo = finder.lineOffsets();
-        REQUIRE(lo.size() == 2);
-        REQUIRE(lo[0] == uint64_t(0));
-        REQUIRE(lo[1] == uint64_t(4));
+        REQUIRE(finder.numLines() == 1);
+        REQUIRE(finder.endOffset() == uint64_t(4));
         REQUIRE(sink.lines.size() == 1);
         REQUIRE(sink.lines[0] == "One");
         REQUIRE(sink.fileOffsets[0] == 0);
@@ -54,11 +55,8 @@ TEST_CASE("finds lines", "[LineFinder]") {
         static const uint8_t oneTwo[] = "One\nTwo\n";
         SECTION("in one go") {
             finder.add(oneTwo, sizeof(oneTwo) - 1, true);
-            const auto &lo = finder.lineOffsets();
-            REQUIRE(lo.size() == 3);
-            REQUIRE(lo[0] == uint64_t(0));
-            REQUIRE(lo[1] == uint64_t(4));
-            REQUIRE(lo[2] == uint64_t(8));
+            REQUIRE(finder.numLines() == 2);
+            REQUIRE(finder.endOffset() == uint64_t(8));
             REQUIRE(sink.lines.size() == 2);
             REQUIRE(sink.lines[0] == "One");
             REQUIRE(sink.lines[1] == "Two");
@@ -68,11 +66,8 @@ TEST_CASE("finds lines", "[LineFinder]") {
         SECTION("byte at a time") {
             for (auto i = 0u; i < sizeof(oneTwo) - 1; ++i)
                 finder.add(oneTwo + i, 1, i == sizeof(oneTwo) - 2);
-            const auto &lo = finder.lineOffsets();
-            REQUIRE(lo.size() == 3);
-            REQUIRE(lo[0] == uint64_t(0));
-            REQUIRE(lo[1] == uint64_t(4));
-            REQUIRE(lo[2] == uint64_t(8));
+            REQUIRE(finder.numLines() == 2);
+            REQUIRE(finder.endOffset() == uint64_t(8));
             REQUIRE(sink.lines.size() == 2);
             REQUIRE(sink.lines[0] == "One");
             REQUIRE(sink.lines[1] == "Two");
@@ -85,11 +80,8 @@ TEST_CASE("finds lines", "[LineFinder]") {
                 auto length = remaining < 3 ? remaining : 3;
                 finder.add(oneTwo + i, length, remaining <= 3);
             }
-            const auto &lo = finder.lineOffsets();
-            REQUIRE(lo.size() == 3);
-            REQUIRE(lo[0] == uint64_t(0));
-            REQUIRE(lo[1] == uint64_t(4));
-            REQUIRE(lo[2] == uint64_t(8));
+            REQUIRE(finder.numLines() == 2);
+            REQUIRE(finder.endOffset() == uint64_t(8));
             REQUIRE(sink.lines.size() == 2);
             REQUIRE(sink.lines[0] == "One");
             REQUIRE(sink.lines[1] == "Two");
@@ -98,11 +90,8 @@ TEST_CASE("finds lines", "[LineFinder]") {
         }
         SECTION("in one go missing newline") {
             finder.add(oneTwo, sizeof(oneTwo) - 2, true);
-            const auto &lo = finder.lineOffsets();
-            REQUIRE(lo.size() == 3);
-            REQUIRE(lo[0] == uint64_t(0));
-            REQUIRE(lo[1] == uint64_t(4));
-            REQUIRE(lo[2] == uint64_t(8));
+            REQUIRE(finder.numLines() == 2);
+            REQUIRE(finder.endOffset() == uint64_t(8));
             REQUIRE(sink.lines.size() == 2);
             REQUIRE(sink.lines[0] == "One");
             REQUIRE(sink.lines[1] == "Two");
@@ -111,3 +100,18 @@ TEST_CASE("finds lines", "[LineFinder]") {
         }
     }
 }
+
+TEST_CASE("carries on part way through a file", "[LineFinder]") {
+    RecordingSink sink;
+    LineFinder finder(sink, 10, 100);
+    static const uint8_t oneTwo[] = "One\nTwo";
+    finder.add(oneTwo, sizeof(oneTwo) - 1, true);
+    REQUIRE(finder.numLines() == 11);
+    REQUIRE(finder.endOffset() == uint64_t(108));
+    REQUIRE(sink.lines.size() == 2);
+    REQUIRE(sink.lines[1] == "Two");
+    REQUIRE(sink.lineNumbers[0] == 10);
+    REQUIRE(sink.lineNumbers[1] == 11);
+    REQUIRE(sink.fileOffsets[0] == 100);
+    REQUIRE(sink.fileOffsets[1] == 104);
+}
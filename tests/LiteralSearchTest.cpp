@@ -0,0 +1,43 @@
+#include "LiteralSearch.h"
+
+#include "catch.hpp"
+
+#include <cstring>
+#include <string>
+
+TEST_CASE("finds literals", "[LiteralSearch]") {
+    auto Find = [](const std::string &literal, const std::string &text) {
+        auto found = LiteralSearch(literal).find(text.data(),
+                                                 text.data() + text.size());
+        return found ? static_cast<long>(found - text.data()) : -1l;
+    };
+    CHECK(Find("", "abc") == 0);
+    CHECK(Find("a", "") == -1);
+    CHECK(Find("c", "abc") == 2);
+    CHECK(Find("orderId=", "orderId=") == 0);
+    CHECK(Find("orderId=", "orderId") == -1);
+    CHECK(Find("orderId=", "an orderId: 1, then orderId=2") == 20);
+    // The first and last bytes match often, the middle rarely.
+    std::string text(100, 'a');
+    CHECK(Find("abba", text) == -1);
+    text.replace(70, 4, "abba");
+    CHECK(Find("abba", text) == 70);
+    CHECK(Find("aa", text) == 0);
+
+    SECTION("at every position and length") {
+        std::string haystack;
+        for (auto i = 0; i < 100; ++i)
+            haystack += static_cast<char>('a' + (i * 7) % 13);
+        for (size_t length = 1; length < 40; ++length) {
+            for (size_t pos = 0; pos + length <= haystack.size(); ++pos) {
+                auto literal = haystack.substr(pos, length);
+                INFO("'" << literal << "'");
+                CHECK(Find(literal, haystack)
+                      == static_cast<long>(haystack.find(literal)));
+                // And with the text ending just after it.
+                CHECK(Find(literal, haystack.substr(0, pos + length))
+                      == static_cast<long>(haystack.find(literal)));
+            }
+        }
+    }
+}
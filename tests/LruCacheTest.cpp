@@ -0,0 +1,60 @@
+#include "LruCache.h"
+
+#include "catch.hpp"
+
+#include <string>
+
+TEST_CASE("LRU cache", "[LruCache]") {
+    LruCache<int, std::string> cache(10);
+    auto value = [](const char *s) {
+        return std::make_shared<std::string>(s);
+    };
+
+    SECTION("counts hits and misses") {
+        CHECK(!cache.get(1));
+        cache.put(1, value("one"), 3);
+        REQUIRE(cache.get(1));
+        CHECK(*cache.get(1) == "one");
+        CHECK(cache.hits() == 2);
+        CHECK(cache.misses() == 1);
+    }
+
+    SECTION("evicts least recently used first") {
+        cache.put(1, value("one"), 4);
+        cache.put(2, value("two"), 4);
+        cache.get(1);
+        cache.put(3, value("three"), 4);
+        CHECK(cache.size() == 2);
+        CHECK(cache.totalCost() == 8);
+        CHECK(cache.get(1));
+        CHECK(!cache.get(2));
+        CHECK(cache.get(3));
+    }
+
+    SECTION("evicts as costs grow") {
+        cache.put(1, value("one"), 4);
+        cache.put(2, value("two"), 4);
+        cache.updateCost(2, 7);
+        CHECK(cache.size() == 1);
+        CHECK(cache.get(2));
+        cache.updateCost(2, 11);
+        CHECK(cache.size() == 0);
+        CHECK(cache.totalCost() == 0);
+    }
+
+    SECTION("evicted values live on while held") {
+        cache.put(1, value("one"), 4);
+        auto held = cache.get(1);
+        cache.setCapacity(0);
+        CHECK(cache.size() == 0);
+        CHECK(*held == "one");
+    }
+
+    SECTION("replaces existing entries") {
+        cache.put(1, value("one"), 4);
+        cache.put(1, value("uno"), 5);
+        CHECK(cache.size() == 1);
+        CHECK(cache.totalCost() == 5);
+        CHECK(*cache.get(1) == "uno");
+    }
+}
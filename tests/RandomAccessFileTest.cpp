@@ -0,0 +1,40 @@
+#include "RandomAccessFile.h"
+
+#include "catch.hpp"
+#include "TempDir.h"
+
+#include <fstream>
+#include <string>
+
+TEST_CASE("random access file", "[RandomAccessFile]") {
+    TempDir tempDir;
+    auto path = tempDir.path + "/test.dat";
+    std::string contents;
+    for (auto i = 0; i < 100000; ++i) contents += std::to_string(i) + ",";
+    {
+        std::ofstream out(path);
+        out << contents;
+    }
+
+    for (auto map : {true, false}) {
+        RandomAccessFile file(File(fopen(path.c_str(), "rb")), map);
+        INFO("map " << map);
+        CHECK(file.mapped() == map);
+        CHECK(file.size() == contents.size());
+        uint8_t buffer[1024];
+        const uint8_t *data = nullptr;
+
+        auto numRead = file.read(12345, sizeof(buffer), buffer, data);
+        REQUIRE(numRead == sizeof(buffer));
+        CHECK(std::string(reinterpret_cast<const char *>(data), numRead)
+              == contents.substr(12345, numRead));
+
+        numRead = file.read(contents.size() - 10, sizeof(buffer), buffer, data);
+        REQUIRE(numRead == 10);
+        CHECK(std::string(reinterpret_cast<const char *>(data), numRead)
+              == contents.substr(contents.size() - 10));
+
+        CHECK(file.read(contents.size(), sizeof(buffer), buffer, data) == 0);
+        file.willNeed(contents.size() - 10, 1024 * 1024);
+    }
+}
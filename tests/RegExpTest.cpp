@@ -46,4 +46,98 @@ TEST_CASE("moves", "[RegExp]") {
     RegExp nR("1234");
     nR = std::move(r);
     REQUIRE(r.exec("moo", matches) == true);
-}
\ No newline at end of file
+}
+TEST_CASE("matches views", "[RegExp]") {
+    for (auto engine : {RegExp::Engine::Dfa, RegExp::Engine::Posix}) {
+        INFO("engine " << static_cast<int>(engine));
+        RegExp r("^id:([0-9]+)|val=([0-9]+)", engine);
+        RegExp::Matches matches;
+        // Views stop part way through the number. (The text is still NUL
+        // terminated, as ASan's regexec checks for that regardless.)
+        const char *text = "id:123 val=456";
+        REQUIRE(r.exec(StringView(text, 12), matches));
+        REQUIRE(matches.size() == 2);
+        CHECK(matches[0] == RegExp::Match(0, 6));
+        CHECK(matches[1] == RegExp::Match(3, 6));
+        // Relative to the offset, after which ^ no longer matches (and the
+        // first group takes no part, so ends the matches).
+        REQUIRE(r.exec(StringView(text, 13), matches, 1));
+        REQUIRE(matches.size() == 1);
+        CHECK(matches[0] == RegExp::Match(6, 12));
+        CHECK(!r.exec(StringView(text, 10), matches, 1));
+        CHECK(!r.exec(StringView(nullptr, 0), matches));
+        CHECK(!r.exec("id:12", matches, false));
+    }
+}
+
+TEST_CASE("engines agree", "[RegExp]") {
+    const char *regexes[] = {
+            "[a-z]+", "(a|ab)(c|bcd)(d*)", "x*", "^(\\w+) (\\w+)$",
+            "[[:digit:]]+\\.[0-9]{2}", "\\bis\\b", "[]a]+", "[^]a ]+",
+            "(foo|foobar)(bar)?", "a.c"};
+    const char *texts[] = {
+            "abcd", "this is a line", "price 12.34 or 5.6", "]a]b", "foobar",
+            "", "a\nc", "\xe9t\xe9"};
+    for (auto regex : regexes) {
+        RegExp dfa(regex), posix(regex, RegExp::Engine::Posix);
+        CHECK(posix.engine() == RegExp::Engine::Posix);
+#ifdef ZINDEX_HAVE_RE2
+        CHECK(dfa.engine() == RegExp::Engine::Dfa);
+#endif
+        for (auto text : texts) {
+            INFO("'" << regex << "' against '" << text << "'");
+            RegExp::Matches dfaMatches, posixMatches;
+            CHECK(dfa.exec(StringView(text), dfaMatches)
+                  == posix.exec(StringView(text), posixMatches));
+            CHECK(dfaMatches == posixMatches);
+        }
+    }
+}
+
+TEST_CASE("falls back to POSIX", "[RegExp]") {
+    RegExp::Matches matches;
+    for (auto regex : {"\\<is\\>", "(a)\\1", "[\\d]", "[[=a=]]"}) {
+        INFO(regex);
+        CHECK(RegExp(regex).engine() == RegExp::Engine::Posix);
+    }
+    RegExp words("\\<is\\>");
+    REQUIRE(words.exec(StringView("this is"), matches));
+    CHECK(matches[0] == RegExp::Match(5, 7));
+    RegExp backslash("[\\d]+");
+    REQUIRE(backslash.exec(StringView("12\\dd3"), matches));
+    CHECK(matches[0] == RegExp::Match(2, 5));
+}
+
+TEST_CASE("looks for required literals first", "[RegExp]") {
+    auto Literal = [](const char *regex) {
+        RegExp r(regex);
+        return std::make_pair(r.requiredLiteral(), r.literalIsPrefix());
+    };
+    using L = std::pair<std::string, bool>;
+    CHECK(Literal("orderId=([0-9]+)") == L("orderId=", true));
+    CHECK(Literal("\"eventId\":([0-9]+)") == L("\"eventId\":", true));
+    CHECK(Literal("^[0-9.]+ - - \\[([^]]+)\\]") == L(" - - [", false));
+    CHECK(Literal("^id:([0-9]+)") == L("id:", false));
+    CHECK(Literal("ab*c") == L("a", true));
+    CHECK(Literal("a*bcd") == L("bcd", false));
+    CHECK(Literal("ab{2}cde?") == L("cd", false));
+    CHECK(Literal("x(y|z)w") == L("x", true));
+    CHECK(Literal("id|name") == L("", false));
+    CHECK(Literal("[a-z]+") == L("", false));
+    CHECK(Literal("\\bkey\\w+") == L("key", false));
+
+    for (auto engine : {RegExp::Engine::Dfa, RegExp::Engine::Posix}) {
+        INFO("engine " << static_cast<int>(engine));
+        RegExp r("orderId=([0-9]+)", engine);
+        RegExp::Matches matches;
+        std::string line = "orderId=x orderId=12 orderId=34";
+        REQUIRE(r.exec(line, matches, 1));
+        REQUIRE(matches.size() == 2);
+        CHECK(matches[0] == RegExp::Match(9, 19));
+        CHECK(matches[1] == RegExp::Match(17, 19));
+        CHECK(!r.exec(line, matches, 30));
+        CHECK(!r.exec(StringView("no key here"), matches));
+        RegExp anchored("^a+b", engine);
+        CHECK(!anchored.exec(StringView("xab"), matches, 1));
+    }
+}
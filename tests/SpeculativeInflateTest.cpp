@@ -0,0 +1,154 @@
+#include "SpeculativeInflate.h"
+
+#include "catch.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace {
+
+std::vector<uint8_t> gzipped(const std::string &text, int level) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    REQUIRE(deflateInit2(&zs, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY)
+            == Z_OK);
+    std::vector<uint8_t> result(deflateBound(&zs, text.size()));
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+    zs.avail_in = text.size();
+    zs.next_out = &result[0];
+    zs.avail_out = result.size();
+    REQUIRE(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+    result.resize(zs.total_out);
+    deflateEnd(&zs);
+    return result;
+}
+
+struct Boundary {
+    uint64_t bit;
+    uint64_t offset;
+};
+
+// The block boundaries zlib finds (the first being just after the header).
+std::vector<Boundary> zlibBoundaries(const std::vector<uint8_t> &compressed,
+                                     size_t uncompressedSize) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    REQUIRE(inflateInit2(&zs, 31) == Z_OK);
+    std::vector<uint8_t> out(uncompressedSize + 1);
+    zs.next_in = const_cast<Bytef *>(compressed.data());
+    zs.avail_in = compressed.size();
+    zs.next_out = &out[0];
+    zs.avail_out = out.size();
+    std::vector<Boundary> result;
+    int ret;
+    while ((ret = inflate(&zs, Z_BLOCK)) == Z_OK) {
+        if ((zs.data_type & 0x80) && !(zs.data_type & 0x40))
+            result.push_back({zs.total_in * 8 - (zs.data_type & 7),
+                              zs.total_out});
+    }
+    REQUIRE(ret == Z_STREAM_END);
+    inflateEnd(&zs);
+    return result;
+}
+
+}
+
+TEST_CASE("speculative inflate", "[SpeculativeInflate]") {
+    std::string text;
+    for (auto i = 0; i < 200000; ++i)
+        text += "Line " + std::to_string(i) + " of "
+                + std::to_string(i * 7919 % 10007) + "\n";
+    auto compressed = gzipped(text, 6);
+    auto data = compressed.data();
+    auto size = compressed.size();
+    auto boundaries = zlibBoundaries(compressed, text.size());
+    REQUIRE(boundaries.size() > 10);
+    auto asString = [](const std::vector<uint8_t> &bytes) {
+        return std::string(bytes.begin(), bytes.end());
+    };
+
+    SECTION("inflates a whole member") {
+        auto start = gzipDataStart(data, size, 0);
+        CHECK(start == boundaries[0].bit);
+        auto piece = inflatePiece(data, size, start, size * 8, nullptr, true);
+        CHECK(piece.finished);
+        CHECK(piece.endBit == size * 8);
+        CHECK(piece.unresolved.empty());
+        CHECK(asString(piece.data) == text);
+        REQUIRE(piece.boundaries.size() == boundaries.size());
+        for (size_t i = 0; i < boundaries.size(); ++i) {
+            CHECK(piece.boundaries[i].bit == boundaries[i].bit);
+            CHECK(piece.boundaries[i].offset == boundaries[i].offset);
+            CHECK(piece.boundaries[i].memberStart == (i == 0));
+        }
+        REQUIRE(piece.memberEnds.size() == 1);
+        CHECK(piece.memberEnds[0].offset == text.size());
+        CHECK(piece.memberEnds[0].size == text.size());
+        CHECK(piece.memberEnds[0].crc == crc32(
+                crc32(0, nullptr, 0),
+                reinterpret_cast<const Bytef *>(text.data()), text.size()));
+    }
+
+    SECTION("finds where blocks start") {
+        for (size_t i = 1; i + 1 < boundaries.size(); i += 3) {
+            auto from = (boundaries[i - 1].bit + boundaries[i].bit) / 2;
+            INFO("from " << from);
+            CHECK(findBlockStart(data, size, from, size * 8)
+                  == boundaries[i].bit);
+            CHECK(findBlockStart(data, size, from, boundaries[i].bit)
+                  == boundaries[i].bit);
+        }
+    }
+
+    SECTION("inflates without the window and resolves it later") {
+        auto &start = boundaries[boundaries.size() / 2];
+        auto &stop = boundaries[boundaries.size() / 2 + 2];
+        auto piece = inflatePiece(data, size, start.bit, stop.bit - 1,
+                                  nullptr);
+        CHECK(!piece.finished);
+        CHECK(piece.startBit == start.bit);
+        CHECK(piece.endBit == stop.bit);
+        CHECK(piece.boundaries.size() == 2);
+        CHECK(!piece.unresolved.empty());
+        auto expected = text.substr(start.offset, stop.offset - start.offset);
+        CHECK(asString(piece.data) != expected);
+        resolvePiece(piece, reinterpret_cast<const uint8_t *>(
+                &text[start.offset - 32768]));
+        CHECK(piece.unresolved.empty());
+        CHECK(asString(piece.data) == expected);
+    }
+
+    SECTION("carries on through stored blocks and members") {
+        auto stored = gzipped(text.substr(0, 100000), 0);
+        auto second = gzipped(text.substr(100000), 9);
+        stored.insert(stored.end(), second.begin(), second.end());
+        auto start = gzipDataStart(stored.data(), stored.size(), 0);
+        auto piece = inflatePiece(stored.data(), stored.size(), start,
+                                  stored.size() * 8, nullptr, true);
+        CHECK(piece.finished);
+        CHECK(asString(piece.data) == text);
+        REQUIRE(piece.memberEnds.size() == 2);
+        CHECK(piece.memberEnds[0].offset == 100000);
+        CHECK(std::count_if(piece.boundaries.begin(), piece.boundaries.end(),
+                            [](const InflatedPiece::Boundary &boundary) {
+                                return boundary.memberStart;
+                            }) == 2);
+        // No dynamic blocks to find in stored data.
+        CHECK(findBlockStart(stored.data(), stored.size(), start + 1,
+                             start + 50000 * 8) == start + 50000 * 8);
+    }
+
+    SECTION("rejects invalid data") {
+        CHECK_THROWS_AS(gzipDataStart(data + 1, size - 1, 0),
+                        const DeflateError &);
+        std::vector<uint8_t> junk(1000, 0xff);
+        CHECK_THROWS_AS(inflatePiece(junk.data(), junk.size(), 0, 8000,
+                                     nullptr), const DeflateError &);
+        CHECK_THROWS_AS(inflatePiece(data, size / 2, boundaries[0].bit,
+                                     size * 8, nullptr, true),
+                        const DeflateError &);
+    }
+}
@@ -115,3 +115,37 @@ TEST_CASE("handles binds and blobs", "[Sqlite]") {
     for (int i = 0; i < byteLen; ++i) REQUIRE(blob2[i] == (0xff ^ (i & 0xff)));
     CHECK(select.step() == true);
 }
+
+TEST_CASE("binds by parameter index", "[Sqlite]") {
+    TempDir tempDir;
+    CaptureLog log;
+    Sqlite sqlite(log);
+    auto dbPath = tempDir.path + "/db.sqlite";
+    sqlite.open(dbPath, false);
+
+    REQUIRE(sqlite.prepare("create table t(id integer, name text, data blob)").step() == true);
+    auto inserter = sqlite.prepare("insert into t values(:id, :name, :data)");
+    CHECK(inserter.parameterIndex(":id") == 1);
+    CHECK(inserter.parameterIndex(":name") == 2);
+    CHECK(inserter.parameterIndex(":data") == 3);
+    CHECK_THROWS(inserter.parameterIndex(":missing"));
+    const char blob[] = { 1, 2, 3 };
+    inserter.bindInt64(1, 1234).bindString(2, "moo").bindBlob(3, blob, 3);
+    CHECK(inserter.step() == true);
+
+    auto multi = sqlite.prepare("insert into t values(?, ?, NULL), (?, ?, NULL)");
+    multi.bindInt64(1, 1).bindString(2, "one").bindInt64(3, 2).bindString(4, "two");
+    CHECK(multi.step() == true);
+
+    auto select = sqlite.prepare("select id, name from t order by id");
+    CHECK(select.step() == false);
+    CHECK(select.columnInt64(0) == 1);
+    CHECK(select.columnString(1) == "one");
+    CHECK(select.step() == false);
+    CHECK(select.columnInt64(0) == 2);
+    CHECK(select.columnString(1) == "two");
+    CHECK(select.step() == false);
+    CHECK(select.columnInt64(0) == 1234);
+    CHECK(select.columnString(1) == "moo");
+    CHECK(select.step() == true);
+}
@@ -0,0 +1,41 @@
+#include "ThreadPool.h"
+
+#include "catch.hpp"
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+TEST_CASE("runs work", "[ThreadPool]") {
+    ThreadPool pool(4);
+    CHECK(pool.size() == 4);
+
+    SECTION("returns results") {
+        std::vector<std::future<int>> results;
+        for (int i = 0; i < 100; ++i)
+            results.emplace_back(pool.submit([i]() { return i * i; }));
+        for (int i = 0; i < 100; ++i)
+            CHECK(results[i].get() == i * i);
+    }
+
+    SECTION("propagates exceptions") {
+        auto result = pool.submit([]() -> int {
+            throw std::runtime_error("oops");
+        });
+        CHECK_THROWS(result.get());
+    }
+}
+
+TEST_CASE("finishes outstanding work on destruction", "[ThreadPool]") {
+    std::atomic<int> count(0);
+    {
+        ThreadPool pool(2);
+        for (int i = 0; i < 1000; ++i)
+            pool.submit([&count]() { ++count; });
+    }
+    CHECK(count == 1000);
+}
+
+TEST_CASE("needs a thread", "[ThreadPool]") {
+    CHECK_THROWS(ThreadPool(0));
+}
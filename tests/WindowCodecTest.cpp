@@ -0,0 +1,39 @@
+#include "WindowCodec.h"
+
+#include "catch.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+TEST_CASE("window codecs", "[WindowCodec]") {
+    uint8_t window[32768];
+    for (size_t i = 0; i < sizeof(window); ++i)
+        window[i] = "some text, repeated with a number "[i % 34] + (i / 1000);
+
+    for (auto name : {"raw", "zlib", "zlib-fast", "lz4"}) {
+        auto codec = parseWindowCodec(name);
+        if (!windowCodecAvailable(codec)) continue;
+        INFO("codec " << name);
+        auto stored = encodeWindow(codec, window, sizeof(window));
+        if (codec == WindowCodec::Raw)
+            CHECK(stored.size() == sizeof(window));
+        else
+            CHECK(stored.size() < sizeof(window) / 2);
+        uint8_t buffer[sizeof(window)];
+        auto decoded = decodeWindow(parseWindowCodec(windowCodecName(codec)),
+                                    stored, buffer, sizeof(buffer));
+        CHECK(memcmp(decoded, window, sizeof(window)) == 0);
+
+        stored.resize(stored.size() / 2);
+        CHECK_THROWS(decodeWindow(codec, stored, buffer, sizeof(buffer)));
+
+        stored.clear();
+        decoded = decodeWindow(codec, stored, buffer, sizeof(buffer));
+        CHECK(std::count(decoded, decoded + sizeof(buffer), 0)
+              == sizeof(buffer));
+    }
+
+    CHECK_THROWS(parseWindowCodec("snappy"));
+    CHECK(windowCodecName(WindowCodec::ZlibFast) == "zlib");
+}